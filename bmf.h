@@ -0,0 +1,340 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+// Binary model format (bmf), version 2. Shared by the model exporter and the runtime loader.
+//
+// A v2 file starts with a BMFHeader. The header points to a table of contents (an array of
+// BMFSection) which gives the byte offset and size of every section. Sections and all payloads in
+// the blob section start at BMF_ALIGNMENT aligned offsets, so vertex and index data can be handed
+// to GL directly from a memory mapping of the file.
+//
+// Record sections (materials, meshes, bounds) are arrays of fixed size records. The record size is
+// section.size / section.count, so new fields can be appended to a record without breaking older
+// readers; readers zero fill fields that are missing in older files.
+//
+// Textures can be embedded in the blob section (see BMFTextureRecord). Their payloads start at
+// BMF_PAGE_SIZE aligned offsets, so every texture begins on its own page of the mapping.
+//
+// Version 1 files have no header and start directly with the material count.
+
+#define BMF_MAGIC 0x32464d42 // "BMF2"
+#define BMF_VERSION 2
+#define BMF_ALIGNMENT 16
+#define BMF_PAGE_SIZE 4096
+
+enum BMFSectionType {
+    BMF_SECTION_MATERIALS = 1,
+    BMF_SECTION_MESHES = 2,
+    BMF_SECTION_BOUNDS = 3,
+    BMF_SECTION_BLOB = 4,
+    BMF_SECTION_TEXTURES = 5,
+    BMF_SECTION_NODES = 6,
+    // uint32_t mesh indices, referenced by the node records
+    BMF_SECTION_NODE_MESHES = 7,
+    BMF_SECTION_LODS = 8,
+    BMF_SECTION_MESHLETS = 9,
+    BMF_SECTION_SUBMESHES = 10,
+};
+
+enum BMFTextureFormat {
+    // The original image file (tga, png, ...), decoded with stb_image when it is loaded
+    BMF_TEXTURE_ENCODED = 1,
+    // RGBA8 pixels with the bottom row first, ready for glTexImage2D
+    BMF_TEXTURE_RGBA8 = 2,
+    // Block compressed, 4x4 pixel blocks with the bottom row of blocks first, ready for
+    // glCompressedTexImage2D. BC1 is RGB, BC3 RGBA and BC5 holds the X and Y of normal maps.
+    BMF_TEXTURE_BC1 = 3,
+    BMF_TEXTURE_BC3 = 4,
+    BMF_TEXTURE_BC5 = 5,
+    // Two channel normal maps without a specular map packed into them, RG8 with the bottom row first
+    BMF_TEXTURE_RG8 = 6,
+};
+
+// Texture channel that holds the specular intensity of a material, which scales its specular color
+enum BMFSpecularChannel {
+    // No specular map, the intensity is 1
+    BMF_SPECULAR_NONE = 0,
+    // The diffuse map is not alpha tested then
+    BMF_SPECULAR_DIFFUSE_ALPHA = 1,
+    BMF_SPECULAR_NORMAL_BLUE = 2,
+};
+
+// BMFMeshRecord flags
+#define BMF_MESH_QUANTIZED_VERTICES (1 << 0)
+// Vertex or index stream is compressed with the codecs in bmf_codec.h
+#define BMF_MESH_COMPRESSED_VERTICES (1 << 1)
+#define BMF_MESH_COMPRESSED_INDICES (1 << 2)
+// Indices are uint16 instead of uint32
+#define BMF_MESH_INDEX16 (1 << 3)
+// Vertices carry baked ambient occlusion, 1 where nothing occludes the vertex. Float vertices get a
+// twelfth float, quantized vertices store it in the fourth position component.
+#define BMF_MESH_VERTEX_OCCLUSION (1 << 4)
+
+struct BMFHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t numSections;
+    uint64_t tocOffset;
+    uint64_t fileSize;
+};
+
+struct BMFSection {
+    uint32_t type;
+    uint32_t count;
+    uint64_t offset;
+    uint64_t size;
+};
+
+// Offset and size of a payload in the blob section. Offsets are relative to the start of the file.
+struct BMFBlobRange {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct BMFMaterialRecord {
+    float diffuse[3];
+    float specular[3];
+    float emissive[3];
+    float shininess;
+    BMFBlobRange diffuseMapName;
+    BMFBlobRange normalMapName;
+    // Index + 1 into the textures section, 0 if the texture is loaded from the file named above
+    uint32_t diffuseMapTexture;
+    uint32_t normalMapTexture;
+    // BMFSpecularChannel. Normal maps only store X and Y in red and green, Z is reconstructed.
+    uint32_t specularChannel;
+    uint32_t padding;
+};
+
+struct BMFMeshRecord {
+    uint32_t materialIndex;
+    uint32_t flags;
+    uint64_t numVertices;
+    // Indices of all levels of detail
+    uint64_t numIndices;
+    BMFBlobRange vertices;
+    BMFBlobRange indices;
+    // Range in the LODs section. Meshes without levels of detail have no LOD records and draw all
+    // of their indices.
+    uint32_t firstLod;
+    uint32_t numLods;
+    // Range in the meshlets section, the meshlets cover the full detail level
+    uint32_t firstMeshlet;
+    uint32_t numMeshlets;
+    // Range in the submeshes section. Only meshes that were merged from several source meshes have
+    // submesh records.
+    uint32_t firstSubmesh;
+    uint32_t numSubmeshes;
+};
+
+// A level of detail of a mesh, a range of its indices. All levels use the same vertices. The first
+// level is the full detail mesh with an error of 0, the following levels are coarser.
+struct BMFLodRecord {
+    uint64_t firstIndex;
+    uint64_t numIndices;
+    // Largest distance of the simplified surface to the full detail one, in model units
+    float error;
+    uint32_t padding;
+};
+
+// A cluster of at most 64 vertices and 124 triangles of the full detail level, so the renderer can
+// skip clusters that are outside the view or face away from the camera.
+struct BMFMeshletRecord {
+    // Range of the mesh indices
+    uint32_t firstIndex;
+    uint32_t numIndices;
+    // Bounding sphere in model units
+    float center[3];
+    float radius;
+    // The cluster faces away from a camera at p if
+    // dot(center - p, coneAxis) >= coneCutoff * length(center - p) + radius. A cutoff of 1 never culls.
+    float coneAxis[3];
+    float coneCutoff;
+};
+
+// The part of a merged mesh that came from one source mesh, a range of the full detail indices.
+// Meshlets never span two submeshes.
+struct BMFSubmeshRecord {
+    uint32_t firstIndex;
+    uint32_t numIndices;
+    // Index of the mesh in the source file
+    uint32_t sourceMesh;
+    uint32_t padding;
+};
+
+struct BMFTextureRecord {
+    uint32_t format;
+    // 0 for BMF_TEXTURE_ENCODED, the size is only known after decoding
+    uint32_t width;
+    uint32_t height;
+    // Mip levels in data, largest first and each half the size of the previous one. 0 in older
+    // files, which means a single level.
+    uint32_t numMips;
+    // Hash of the source image file, so models that embed the same image can share the texture
+    uint64_t hash;
+    BMFBlobRange data;
+};
+
+// A node of the scene hierarchy. Parents are always stored before their children. Meshes that
+// several nodes reference are stored once and drawn instanced. Files without nodes are drawn with
+// every mesh at the origin.
+struct BMFNodeRecord {
+    // Column major, relative to the parent node
+    float transform[16];
+    // BMF_NO_PARENT for the root
+    uint32_t parent;
+    // Range in the node meshes section
+    uint32_t firstMesh;
+    uint32_t numMeshes;
+    uint32_t padding;
+};
+
+#define BMF_NO_PARENT 0xffffffff
+
+struct BMFBoundsRecord {
+    float min[3];
+    float max[3];
+};
+
+// Vertex layout of meshes with BMF_MESH_QUANTIZED_VERTICES (20 bytes instead of 44).
+// position: unorm16 relative to the mesh bounds, the fourth component is the unorm16 ambient
+// occlusion with BMF_MESH_VERTEX_OCCLUSION and padding otherwise
+// normal, tangent: snorm16 octahedral encoding
+// textureCoord: half floats
+struct BMFQuantizedVertex {
+    uint16_t position[4];
+    int16_t normal[2];
+    int16_t tangent[2];
+    uint16_t textureCoord[2];
+};
+
+inline uint64_t bmfVertexSize(uint32_t meshFlags) {
+    if(meshFlags & BMF_MESH_QUANTIZED_VERTICES) {
+        return sizeof(BMFQuantizedVertex);
+    }
+    return ((meshFlags & BMF_MESH_VERTEX_OCCLUSION) ? 12 : 11) * sizeof(float);
+}
+
+inline uint64_t bmfIndexSize(uint32_t meshFlags) {
+    return (meshFlags & BMF_MESH_INDEX16) ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+// Bytes of one mip level of a texture that is not BMF_TEXTURE_ENCODED
+inline uint64_t bmfTextureLevelSize(uint32_t format, uint32_t width, uint32_t height) {
+    if(format == BMF_TEXTURE_RGBA8 || format == BMF_TEXTURE_RG8) {
+        return (uint64_t)width * height * (format == BMF_TEXTURE_RGBA8 ? 4 : 2);
+    }
+    uint64_t numBlocks = (uint64_t)((width + 3) / 4) * ((height + 3) / 4);
+    return numBlocks * (format == BMF_TEXTURE_BC1 ? 8 : 16);
+}
+
+// Levels of a full mip chain down to 1x1
+inline uint32_t bmfMaxMips(uint32_t width, uint32_t height) {
+    uint32_t size = width > height ? width : height;
+    uint32_t result = 1;
+    while(size > 1) {
+        size >>= 1;
+        result++;
+    }
+    return result;
+}
+
+// Decodes a BC1 color block into 16 RGBA8 pixels, row by row. The color blocks of BC3 always use
+// the four color mode, BC1 blocks with color0 <= color1 have three colors and transparent black.
+inline void bmfDecodeBC1Block(const uint8_t* block, uint8_t* pixels, bool alwaysFourColors) {
+    uint16_t colors[2] = {(uint16_t)(block[0] | block[1] << 8), (uint16_t)(block[2] | block[3] << 8)};
+    uint8_t palette[4][4];
+    for(uint32_t i = 0; i < 2; i++) {
+        uint32_t r = (colors[i] >> 11) & 31;
+        uint32_t g = (colors[i] >> 5) & 63;
+        uint32_t b = colors[i] & 31;
+        palette[i][0] = (uint8_t)((r << 3) | (r >> 2));
+        palette[i][1] = (uint8_t)((g << 2) | (g >> 4));
+        palette[i][2] = (uint8_t)((b << 3) | (b >> 2));
+        palette[i][3] = 255;
+    }
+    bool fourColors = alwaysFourColors || colors[0] > colors[1];
+    for(uint32_t c = 0; c < 3; c++) {
+        if(fourColors) {
+            palette[2][c] = (uint8_t)((2 * palette[0][c] + palette[1][c]) / 3);
+            palette[3][c] = (uint8_t)((palette[0][c] + 2 * palette[1][c]) / 3);
+        } else {
+            palette[2][c] = (uint8_t)((palette[0][c] + palette[1][c]) / 2);
+            palette[3][c] = 0;
+        }
+    }
+    palette[2][3] = 255;
+    palette[3][3] = fourColors ? 255 : 0;
+    uint32_t indices = block[4] | block[5] << 8 | block[6] << 16 | (uint32_t)block[7] << 24;
+    for(uint32_t i = 0; i < 16; i++) {
+        const uint8_t* color = palette[(indices >> (i * 2)) & 3];
+        pixels[i * 4] = color[0];
+        pixels[i * 4 + 1] = color[1];
+        pixels[i * 4 + 2] = color[2];
+        pixels[i * 4 + 3] = color[3];
+    }
+}
+
+// Decodes a single channel block of BC3 alpha, BC4 or BC5 into 16 values, stride bytes apart
+inline void bmfDecodeBC4Block(const uint8_t* block, uint8_t* values, uint32_t stride) {
+    uint32_t palette[8] = {block[0], block[1]};
+    if(block[0] > block[1]) {
+        for(uint32_t i = 1; i < 7; i++) {
+            palette[i + 1] = ((7 - i) * block[0] + i * block[1]) / 7;
+        }
+    } else {
+        for(uint32_t i = 1; i < 5; i++) {
+            palette[i + 1] = ((5 - i) * block[0] + i * block[1]) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+    uint64_t indices = 0;
+    for(uint32_t i = 0; i < 6; i++) {
+        indices |= (uint64_t)block[2 + i] << (i * 8);
+    }
+    for(uint32_t i = 0; i < 16; i++) {
+        values[i * stride] = (uint8_t)palette[(indices >> (i * 3)) & 7];
+    }
+}
+
+// Decodes one level of a BC1 or BC3 texture into RGBA8 pixels, for drivers without S3TC
+inline void bmfDecodeBCLevel(uint32_t format, uint32_t width, uint32_t height, const uint8_t* data, uint8_t* pixels) {
+    uint32_t blocksX = (width + 3) / 4;
+    uint32_t blocksY = (height + 3) / 4;
+    uint8_t block[16 * 4];
+    for(uint32_t by = 0; by < blocksY; by++) {
+        for(uint32_t bx = 0; bx < blocksX; bx++) {
+            if(format == BMF_TEXTURE_BC3) {
+                bmfDecodeBC1Block(data + 8, block, true);
+                bmfDecodeBC4Block(data, block + 3, 4);
+                data += 16;
+            } else {
+                bmfDecodeBC1Block(data, block, false);
+                data += 8;
+            }
+            // Edge blocks cover pixels outside the image
+            for(uint32_t y = 0; y < 4 && by * 4 + y < height; y++) {
+                for(uint32_t x = 0; x < 4 && bx * 4 + x < width; x++) {
+                    memcpy(pixels + (((uint64_t)(by * 4 + y) * width + bx * 4 + x) * 4), block + (y * 4 + x) * 4, 4);
+                }
+            }
+        }
+    }
+}
+
+inline uint64_t bmfAlign(uint64_t offset, uint64_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// 64 bit FNV-1a
+inline uint64_t bmfHash(const void* data, uint64_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(uint64_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
@@ -0,0 +1,380 @@
+#pragma once
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include "defines.h"
+
+// Lossless compression of the vertex and index streams of a bmf mesh.
+//
+// Vertex codec: vertices are processed in blocks of BMF_VERTEX_CODEC_BLOCK_SIZE. Inside a block
+// every byte position of the vertex ("lane") is stored separately as the zigzag encoded delta to
+// the same byte of the previous vertex. The deltas of a lane are packed in groups of 16 with a
+// 2 bit header per group selecting 0, 2, 4 or 8 bits per delta.
+//
+// Index codec: every triangle is coded with one byte. If the triangle shares an edge with one of
+// the recently coded triangles (edge FIFO), only the third vertex is coded. Vertices that are
+// referenced for the first time in order ("next") cost nothing, all others are stored as zigzag
+// varint deltas to the previously coded vertex.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BMF_CODEC_SSE2
+#include <emmintrin.h>
+#endif
+
+#define BMF_VERTEX_CODEC_TAG 0xa1
+#define BMF_INDEX_CODEC_TAG 0xb1
+#define BMF_VERTEX_CODEC_BLOCK_SIZE 256
+#define BMF_VERTEX_CODEC_MAX_VERTEX_SIZE 256
+#define BMF_INDEX_CODEC_FIFO_SIZE 15
+
+inline uint8 bmfZigzag8(uint8 delta) {
+    return (uint8)((delta << 1) ^ (uint8)((int8)delta >> 7));
+}
+
+inline uint8 bmfUnzigzag8(uint8 value) {
+    return (uint8)((value >> 1) ^ (uint8)-(int8)(value & 1));
+}
+
+inline uint32 bmfZigzag32(uint32 delta) {
+    return (delta << 1) ^ (uint32)((int32)delta >> 31);
+}
+
+inline uint32 bmfUnzigzag32(uint32 value) {
+    return (value >> 1) ^ (uint32)-(int32)(value & 1);
+}
+
+inline void bmfEncodeVertexBuffer(std::vector<uint8>& result, const void* vertices, uint64 numVertices, uint64 vertexSize) {
+    assert(vertexSize > 0 && vertexSize <= BMF_VERTEX_CODEC_MAX_VERTEX_SIZE);
+    const uint8* vertexData = (const uint8*)vertices;
+    uint8 lastVertex[BMF_VERTEX_CODEC_MAX_VERTEX_SIZE] = {};
+    uint8 deltas[BMF_VERTEX_CODEC_BLOCK_SIZE];
+
+    result.push_back(BMF_VERTEX_CODEC_TAG);
+    for(uint64 blockStart = 0; blockStart < numVertices; blockStart += BMF_VERTEX_CODEC_BLOCK_SIZE) {
+        uint64 blockSize = numVertices - blockStart < BMF_VERTEX_CODEC_BLOCK_SIZE ? numVertices - blockStart : BMF_VERTEX_CODEC_BLOCK_SIZE;
+        uint64 numGroups = (blockSize + 15) / 16;
+        for(uint64 k = 0; k < vertexSize; k++) {
+            memset(deltas, 0, sizeof(deltas));
+            for(uint64 i = 0; i < blockSize; i++) {
+                uint8 value = vertexData[(blockStart + i) * vertexSize + k];
+                deltas[i] = bmfZigzag8((uint8)(value - lastVertex[k]));
+                lastVertex[k] = value;
+            }
+
+            uint64 headerOffset = result.size();
+            result.resize(result.size() + (numGroups + 3) / 4, 0);
+            for(uint64 group = 0; group < numGroups; group++) {
+                const uint8* groupDeltas = deltas + group * 16;
+                uint8 maxDelta = 0;
+                for(uint32 i = 0; i < 16; i++) {
+                    maxDelta = groupDeltas[i] > maxDelta ? groupDeltas[i] : maxDelta;
+                }
+                uint8 mode = maxDelta == 0 ? 0 : (maxDelta < 4 ? 1 : (maxDelta < 16 ? 2 : 3));
+                result[headerOffset + group / 4] |= mode << ((group % 4) * 2);
+                if(mode == 1) {
+                    for(uint32 i = 0; i < 16; i += 4) {
+                        result.push_back(groupDeltas[i] | (groupDeltas[i+1] << 2) | (groupDeltas[i+2] << 4) | (groupDeltas[i+3] << 6));
+                    }
+                } else if(mode == 2) {
+                    for(uint32 i = 0; i < 16; i += 2) {
+                        result.push_back(groupDeltas[i] | (groupDeltas[i+1] << 4));
+                    }
+                } else if(mode == 3) {
+                    result.insert(result.end(), groupDeltas, groupDeltas + 16);
+                }
+            }
+        }
+    }
+}
+
+// Unpacks a group of 16 zigzag deltas. Returns the number of bytes consumed.
+inline uint32 bmfUnpackVertexGroup(uint8 mode, const uint8* data, uint8* deltas) {
+    switch(mode) {
+        case 0:
+        memset(deltas, 0, 16);
+        return 0;
+        case 1:
+        for(uint32 i = 0; i < 4; i++) {
+            deltas[i*4+0] = data[i] & 3;
+            deltas[i*4+1] = (data[i] >> 2) & 3;
+            deltas[i*4+2] = (data[i] >> 4) & 3;
+            deltas[i*4+3] = data[i] >> 6;
+        }
+        return 4;
+        case 2:
+        for(uint32 i = 0; i < 8; i++) {
+            deltas[i*2+0] = data[i] & 15;
+            deltas[i*2+1] = data[i] >> 4;
+        }
+        return 8;
+        default:
+        memcpy(deltas, data, 16);
+        return 16;
+    }
+}
+
+#ifdef BMF_CODEC_SSE2
+inline __m128i bmfUnpackVertexGroupSSE2(uint8 mode, const uint8* data) {
+    switch(mode) {
+        case 0:
+        return _mm_setzero_si128();
+        case 1: {
+            int32 packed;
+            memcpy(&packed, data, 4);
+            __m128i bits = _mm_cvtsi32_si128(packed);
+            __m128i mask = _mm_set1_epi8(3);
+            __m128i a = _mm_and_si128(bits, mask);
+            __m128i b = _mm_and_si128(_mm_srli_epi16(bits, 2), mask);
+            __m128i c = _mm_and_si128(_mm_srli_epi16(bits, 4), mask);
+            __m128i d = _mm_and_si128(_mm_srli_epi16(bits, 6), mask);
+            return _mm_unpacklo_epi16(_mm_unpacklo_epi8(a, b), _mm_unpacklo_epi8(c, d));
+        }
+        case 2: {
+            __m128i bits = _mm_loadl_epi64((const __m128i*)data);
+            __m128i mask = _mm_set1_epi8(15);
+            return _mm_unpacklo_epi8(_mm_and_si128(bits, mask), _mm_and_si128(_mm_srli_epi16(bits, 4), mask));
+        }
+        default:
+        return _mm_loadu_si128((const __m128i*)data);
+    }
+}
+#endif
+
+// Returns false if the data is malformed
+inline bool bmfDecodeVertexBuffer(void* destination, uint64 numVertices, uint64 vertexSize, const uint8* data, uint64 size) {
+    if(vertexSize == 0 || vertexSize > BMF_VERTEX_CODEC_MAX_VERTEX_SIZE || size < 1 || data[0] != BMF_VERTEX_CODEC_TAG) {
+        return false;
+    }
+    static const uint32 groupSizes[4] = {0, 4, 8, 16};
+    uint8* vertexData = (uint8*)destination;
+    const uint8* cursor = data + 1;
+    const uint8* end = data + size;
+    uint8 lastVertex[BMF_VERTEX_CODEC_MAX_VERTEX_SIZE] = {};
+
+    for(uint64 blockStart = 0; blockStart < numVertices; blockStart += BMF_VERTEX_CODEC_BLOCK_SIZE) {
+        uint64 blockSize = numVertices - blockStart < BMF_VERTEX_CODEC_BLOCK_SIZE ? numVertices - blockStart : BMF_VERTEX_CODEC_BLOCK_SIZE;
+        uint64 numGroups = (blockSize + 15) / 16;
+        for(uint64 k = 0; k < vertexSize; k++) {
+            const uint8* header = cursor;
+            cursor += (numGroups + 3) / 4;
+            if(cursor > end) {
+                return false;
+            }
+            uint8* output = vertexData + blockStart * vertexSize + k;
+            uint8 last = lastVertex[k];
+            for(uint64 group = 0; group < numGroups; group++) {
+                uint8 mode = (header[group / 4] >> ((group % 4) * 2)) & 3;
+                if((uint64)(end - cursor) < groupSizes[mode]) {
+                    return false;
+                }
+                alignas(16) uint8 values[16];
+#ifdef BMF_CODEC_SSE2
+                __m128i deltas = bmfUnpackVertexGroupSSE2(mode, cursor);
+                // Undo zigzag: (v >> 1) ^ -(v & 1)
+                __m128i sign = _mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(deltas, _mm_set1_epi8(1)));
+                deltas = _mm_xor_si128(_mm_and_si128(_mm_srli_epi16(deltas, 1), _mm_set1_epi8(127)), sign);
+                // Prefix sum of the deltas, starting at the last decoded value
+                deltas = _mm_add_epi8(deltas, _mm_slli_si128(deltas, 1));
+                deltas = _mm_add_epi8(deltas, _mm_slli_si128(deltas, 2));
+                deltas = _mm_add_epi8(deltas, _mm_slli_si128(deltas, 4));
+                deltas = _mm_add_epi8(deltas, _mm_slli_si128(deltas, 8));
+                deltas = _mm_add_epi8(deltas, _mm_set1_epi8((char)last));
+                _mm_store_si128((__m128i*)values, deltas);
+#else
+                uint8 deltas[16];
+                bmfUnpackVertexGroup(mode, cursor, deltas);
+                uint8 value = last;
+                for(uint32 i = 0; i < 16; i++) {
+                    value += bmfUnzigzag8(deltas[i]);
+                    values[i] = value;
+                }
+#endif
+                cursor += groupSizes[mode];
+                // Padding deltas are zero, so the last value is also the last value of the lane
+                last = values[15];
+
+                uint64 count = blockSize - group * 16 < 16 ? blockSize - group * 16 : 16;
+                for(uint64 i = 0; i < count; i++) {
+                    output[(group * 16 + i) * vertexSize] = values[i];
+                }
+            }
+            lastVertex[k] = last;
+        }
+    }
+    return true;
+}
+
+// Edge FIFO shared by the index encoder and decoder
+struct BMFEdgeFifo {
+    BMFEdgeFifo() {
+        memset(edges, 0xff, sizeof(edges));
+    }
+
+    void push(uint32 a, uint32 b) {
+        edges[head][0] = a;
+        edges[head][1] = b;
+        head = (head + 1) % BMF_INDEX_CODEC_FIFO_SIZE;
+    }
+
+    // Returns the age of the edge or -1 if it is not in the FIFO
+    int32 find(uint32 a, uint32 b) {
+        for(int32 i = 0; i < BMF_INDEX_CODEC_FIFO_SIZE; i++) {
+            uint32 index = (head + 2 * BMF_INDEX_CODEC_FIFO_SIZE - 1 - i) % BMF_INDEX_CODEC_FIFO_SIZE;
+            if(edges[index][0] == a && edges[index][1] == b) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    const uint32* get(int32 age) {
+        return edges[(head + 2 * BMF_INDEX_CODEC_FIFO_SIZE - 1 - age) % BMF_INDEX_CODEC_FIFO_SIZE];
+    }
+
+    // A neighboring triangle with the same winding contains the edges in reverse order
+    void pushTriangle(const uint32* triangle) {
+        push(triangle[1], triangle[0]);
+        push(triangle[2], triangle[1]);
+        push(triangle[0], triangle[2]);
+    }
+
+private:
+    uint32 edges[BMF_INDEX_CODEC_FIFO_SIZE][2];
+    uint32 head = 0;
+};
+
+inline void bmfWriteVarint(std::vector<uint8>& result, uint32 value) {
+    while(value >= 0x80) {
+        result.push_back((uint8)(value | 0x80));
+        value >>= 7;
+    }
+    result.push_back((uint8)value);
+}
+
+inline bool bmfReadVarint(const uint8*& cursor, const uint8* end, uint32* value) {
+    uint32 result = 0;
+    for(uint32 shift = 0; shift < 35; shift += 7) {
+        if(cursor >= end) {
+            return false;
+        }
+        uint8 byte = *cursor++;
+        result |= (uint32)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+// T is uint16 or uint32, the encoded data is the same for both
+template<typename T>
+void bmfEncodeIndexBuffer(std::vector<uint8>& result, const T* indices, uint64 numIndices) {
+    assert(numIndices % 3 == 0);
+    uint64 numTriangles = numIndices / 3;
+    uint64 codesOffset = result.size() + 1;
+    result.push_back(BMF_INDEX_CODEC_TAG);
+    result.resize(codesOffset + numTriangles);
+
+    BMFEdgeFifo fifo;
+    uint32 next = 0;
+    uint32 last = 0;
+    for(uint64 i = 0; i < numTriangles; i++) {
+        uint32 triangle[3] = {indices[i * 3], indices[i * 3 + 1], indices[i * 3 + 2]};
+        uint8 code = 0;
+        int32 edge = -1;
+        uint32 rotation = 0;
+        for(; rotation < 3; rotation++) {
+            edge = fifo.find(triangle[rotation], triangle[(rotation + 1) % 3]);
+            if(edge >= 0) {
+                break;
+            }
+        }
+
+        if(edge >= 0) {
+            uint32 third = triangle[(rotation + 2) % 3];
+            code = (uint8)((edge << 4) | (rotation << 2));
+            if(third == next) {
+                next++;
+            } else {
+                code |= 1;
+                bmfWriteVarint(result, bmfZigzag32(third - last));
+            }
+            last = third;
+        } else {
+            code = 0xf0;
+            for(uint32 j = 0; j < 3; j++) {
+                if(triangle[j] == next) {
+                    code |= 1 << j;
+                    next++;
+                } else {
+                    bmfWriteVarint(result, bmfZigzag32(triangle[j] - last));
+                }
+                last = triangle[j];
+            }
+        }
+        result[codesOffset + i] = code;
+        fifo.pushTriangle(triangle);
+    }
+}
+
+// Returns false if the data is malformed
+template<typename T>
+bool bmfDecodeIndexBuffer(T* destination, uint64 numIndices, const uint8* data, uint64 size) {
+    uint64 numTriangles = numIndices / 3;
+    if(numIndices % 3 != 0 || size < 1 + numTriangles || data[0] != BMF_INDEX_CODEC_TAG) {
+        return false;
+    }
+    const uint8* codes = data + 1;
+    const uint8* cursor = codes + numTriangles;
+    const uint8* end = data + size;
+
+    BMFEdgeFifo fifo;
+    uint32 next = 0;
+    uint32 last = 0;
+    for(uint64 i = 0; i < numTriangles; i++) {
+        uint32 triangle[3];
+        uint8 code = codes[i];
+        uint32 edge = code >> 4;
+        if(edge < BMF_INDEX_CODEC_FIFO_SIZE) {
+            uint32 rotation = (code >> 2) & 3;
+            if(rotation > 2) {
+                return false;
+            }
+            const uint32* shared = fifo.get(edge);
+            uint32 third = next;
+            if(code & 1) {
+                uint32 delta = 0;
+                if(!bmfReadVarint(cursor, end, &delta)) {
+                    return false;
+                }
+                third = last + bmfUnzigzag32(delta);
+            } else {
+                next++;
+            }
+            last = third;
+            triangle[rotation] = shared[0];
+            triangle[(rotation + 1) % 3] = shared[1];
+            triangle[(rotation + 2) % 3] = third;
+        } else {
+            for(uint32 j = 0; j < 3; j++) {
+                if(code & (1 << j)) {
+                    triangle[j] = next++;
+                } else {
+                    uint32 delta = 0;
+                    if(!bmfReadVarint(cursor, end, &delta)) {
+                        return false;
+                    }
+                    triangle[j] = last + bmfUnzigzag32(delta);
+                }
+                last = triangle[j];
+            }
+        }
+        fifo.pushTriangle(triangle);
+        destination[i * 3] = (T)triangle[0];
+        destination[i * 3 + 1] = (T)triangle[1];
+        destination[i * 3 + 2] = (T)triangle[2];
+    }
+    return true;
+}
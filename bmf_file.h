@@ -0,0 +1,348 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstring>
+#include <iostream>
+
+#include "defines.h"
+#include "bmf.h"
+#include "bmf_codec.h"
+#include "mapped_file.h"
+
+// Bounds checked cursor over the bytes of a bmf file
+struct BMFReader {
+    BMFReader(const uint8* data, uint64 size) : cursor(data), end(data + size) {}
+
+    template<typename T>
+    bool read(T* value) {
+        const uint8* source = take(sizeof(T));
+        if(!source) {
+            return false;
+        }
+        memcpy(value, source, sizeof(T));
+        return true;
+    }
+
+    // Returns a pointer to the next size bytes and advances past them, 0 if the file is too short
+    const uint8* take(uint64 size) {
+        if((uint64)(end - cursor) < size) {
+            cursor = end;
+            return 0;
+        }
+        const uint8* result = cursor;
+        cursor += size;
+        return result;
+    }
+
+    const uint8* getCursor() {
+        return cursor;
+    }
+
+private:
+    const uint8* cursor;
+    const uint8* end;
+};
+
+// A memory mapped bmf file (v2 or v1) and its record tables. Does not touch GL, so it is also used
+// by the tools.
+struct BMFFile {
+    bool open(const char* filename) {
+        close();
+        if(!file.open(filename)) {
+            std::cout << "File not found" << std::endl;
+            return false;
+        }
+
+        BMFHeader header = {};
+        if(file.getSize() >= sizeof(BMFHeader)) {
+            memcpy(&header, file.getData(), sizeof(BMFHeader));
+        }
+        bool result = header.magic == BMF_MAGIC ? openV2(header) : openV1();
+        if(!result) {
+            std::cout << "Invalid bmf file " << filename << std::endl;
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        file.close();
+        materialRecords.clear();
+        meshRecords.clear();
+        meshBounds.clear();
+        textureRecords.clear();
+        nodeRecords.clear();
+        nodeMeshes.clear();
+        lodRecords.clear();
+        meshletRecords.clear();
+        submeshRecords.clear();
+    }
+
+    // Releases the mapping but keeps the record tables
+    void releaseData() {
+        file.close();
+    }
+
+    bool isOpen() {
+        return file.getData() != 0;
+    }
+
+    const uint8* getData(const BMFBlobRange& range) {
+        return file.getData() + range.offset;
+    }
+
+    std::string getString(const BMFBlobRange& range) {
+        return std::string((const char*)getData(range), range.size);
+    }
+
+    // Returns pointers to the vertex and index data of a mesh. Compressed streams are decoded into
+    // the scratch buffers, everything else points straight into the mapping.
+    bool getMeshData(uint64 index, std::vector<uint8>& vertexScratch, std::vector<uint8>& indexScratch, const uint8** vertices, const uint8** indices) {
+        const BMFMeshRecord& record = meshRecords[index];
+        *vertices = getData(record.vertices);
+        *indices = getData(record.indices);
+        if(record.flags & BMF_MESH_COMPRESSED_VERTICES) {
+            uint64 vertexSize = bmfVertexSize(record.flags);
+            vertexScratch.resize(record.numVertices * vertexSize);
+            if(!bmfDecodeVertexBuffer(vertexScratch.data(), record.numVertices, vertexSize, *vertices, record.vertices.size)) {
+                return false;
+            }
+            *vertices = vertexScratch.data();
+        }
+        if(record.flags & BMF_MESH_COMPRESSED_INDICES) {
+            indexScratch.resize(record.numIndices * bmfIndexSize(record.flags));
+            bool result = (record.flags & BMF_MESH_INDEX16)
+                ? bmfDecodeIndexBuffer((uint16*)indexScratch.data(), record.numIndices, *indices, record.indices.size)
+                : bmfDecodeIndexBuffer((uint32*)indexScratch.data(), record.numIndices, *indices, record.indices.size);
+            if(!result) {
+                return false;
+            }
+            *indices = indexScratch.data();
+        }
+        return true;
+    }
+
+    std::vector<BMFMaterialRecord> materialRecords;
+    std::vector<BMFMeshRecord> meshRecords;
+    // One per mesh, zero for meshes of files that store no bounds
+    std::vector<BMFBoundsRecord> meshBounds;
+    std::vector<BMFTextureRecord> textureRecords;
+    std::vector<BMFNodeRecord> nodeRecords;
+    std::vector<uint32> nodeMeshes;
+    std::vector<BMFLodRecord> lodRecords;
+    std::vector<BMFMeshletRecord> meshletRecords;
+    std::vector<BMFSubmeshRecord> submeshRecords;
+
+    // Bytes of all mip levels of a texture that is not BMF_TEXTURE_ENCODED
+    static uint64 getTextureSize(const BMFTextureRecord& texture) {
+        uint64 size = 0;
+        uint32 numMips = texture.numMips > 0 ? texture.numMips : 1;
+        for(uint32 i = 0; i < numMips && i < 32; i++) {
+            uint32 width = texture.width >> i > 0 ? texture.width >> i : 1;
+            uint32 height = texture.height >> i > 0 ? texture.height >> i : 1;
+            size += bmfTextureLevelSize(texture.format, width, height);
+        }
+        return size;
+    }
+
+private:
+    bool isRangeValid(const BMFBlobRange& range) {
+        return range.offset <= file.getSize() && range.size <= file.getSize() - range.offset;
+    }
+
+    // Reads a record section. Records may be larger (newer file) or smaller (older file) than T.
+    template<typename T>
+    bool readRecords(const BMFSection& section, std::vector<T>& records) {
+        if(section.count == 0) {
+            return true;
+        }
+        uint64 stride = section.size / section.count;
+        if(!isRangeValid({section.offset, section.size}) || stride == 0) {
+            return false;
+        }
+        records.resize(section.count);
+        for(uint32 i = 0; i < section.count; i++) {
+            memset(&records[i], 0, sizeof(T));
+            memcpy(&records[i], file.getData() + section.offset + i * stride, stride < sizeof(T) ? stride : sizeof(T));
+        }
+        return true;
+    }
+
+    bool openV2(const BMFHeader& header) {
+        if(header.version != BMF_VERSION) {
+            std::cout << "Unsupported bmf version " << header.version << std::endl;
+            return false;
+        }
+        if(!isRangeValid({header.tocOffset, header.numSections * sizeof(BMFSection)})) {
+            return false;
+        }
+        const BMFSection* sections = (const BMFSection*)(file.getData() + header.tocOffset);
+        for(uint32 i = 0; i < header.numSections; i++) {
+            const BMFSection& section = sections[i];
+            bool result = true;
+            switch(section.type) {
+                case BMF_SECTION_MATERIALS:
+                result = readRecords(section, materialRecords);
+                break;
+                case BMF_SECTION_MESHES:
+                result = readRecords(section, meshRecords);
+                break;
+                case BMF_SECTION_BOUNDS:
+                result = readRecords(section, meshBounds);
+                break;
+                case BMF_SECTION_TEXTURES:
+                result = readRecords(section, textureRecords);
+                break;
+                case BMF_SECTION_NODES:
+                result = readRecords(section, nodeRecords);
+                break;
+                case BMF_SECTION_NODE_MESHES:
+                result = readRecords(section, nodeMeshes);
+                break;
+                case BMF_SECTION_LODS:
+                result = readRecords(section, lodRecords);
+                break;
+                case BMF_SECTION_MESHLETS:
+                result = readRecords(section, meshletRecords);
+                break;
+                case BMF_SECTION_SUBMESHES:
+                result = readRecords(section, submeshRecords);
+                break;
+            }
+            if(!result) {
+                return false;
+            }
+        }
+
+        for(BMFTextureRecord& texture : textureRecords) {
+            if(!isRangeValid(texture.data)) {
+                return false;
+            }
+            if(texture.format != BMF_TEXTURE_ENCODED && (texture.width == 0 || texture.height == 0
+                || texture.numMips > bmfMaxMips(texture.width, texture.height) || texture.data.size < getTextureSize(texture))) {
+                return false;
+            }
+        }
+        for(BMFMaterialRecord& material : materialRecords) {
+            if(!isRangeValid(material.diffuseMapName) || !isRangeValid(material.normalMapName)) {
+                return false;
+            }
+            if(material.diffuseMapTexture > textureRecords.size() || material.normalMapTexture > textureRecords.size()) {
+                return false;
+            }
+            if(material.specularChannel > BMF_SPECULAR_NORMAL_BLUE) {
+                return false;
+            }
+        }
+        for(uint64 i = 0; i < meshRecords.size(); i++) {
+            // Quantized positions can't be decoded without the bounds
+            if((meshRecords[i].flags & BMF_MESH_QUANTIZED_VERTICES) && i >= meshBounds.size()) {
+                return false;
+            }
+        }
+        for(BMFMeshRecord& mesh : meshRecords) {
+            if(mesh.materialIndex >= materialRecords.size() || !isRangeValid(mesh.vertices) || !isRangeValid(mesh.indices)) {
+                return false;
+            }
+            // Compressed streams are checked while decoding
+            if(!(mesh.flags & BMF_MESH_COMPRESSED_VERTICES) && mesh.vertices.size < mesh.numVertices * bmfVertexSize(mesh.flags)) {
+                return false;
+            }
+            if(!(mesh.flags & BMF_MESH_COMPRESSED_INDICES) && mesh.indices.size < mesh.numIndices * bmfIndexSize(mesh.flags)) {
+                return false;
+            }
+            if((uint64)mesh.firstLod + mesh.numLods > lodRecords.size()) {
+                return false;
+            }
+            for(uint32 i = mesh.firstLod; i < mesh.firstLod + mesh.numLods; i++) {
+                if(lodRecords[i].firstIndex > mesh.numIndices || lodRecords[i].numIndices > mesh.numIndices - lodRecords[i].firstIndex) {
+                    return false;
+                }
+            }
+            if((uint64)mesh.firstMeshlet + mesh.numMeshlets > meshletRecords.size()) {
+                return false;
+            }
+            uint64 fullDetailIndices = mesh.numLods > 0 ? lodRecords[mesh.firstLod].numIndices : mesh.numIndices;
+            for(uint32 i = mesh.firstMeshlet; i < mesh.firstMeshlet + mesh.numMeshlets; i++) {
+                if((uint64)meshletRecords[i].firstIndex + meshletRecords[i].numIndices > fullDetailIndices) {
+                    return false;
+                }
+            }
+            if((uint64)mesh.firstSubmesh + mesh.numSubmeshes > submeshRecords.size()) {
+                return false;
+            }
+            for(uint32 i = mesh.firstSubmesh; i < mesh.firstSubmesh + mesh.numSubmeshes; i++) {
+                if((uint64)submeshRecords[i].firstIndex + submeshRecords[i].numIndices > fullDetailIndices) {
+                    return false;
+                }
+            }
+        }
+        for(uint32 i = 0; i < nodeRecords.size(); i++) {
+            const BMFNodeRecord& node = nodeRecords[i];
+            if((node.parent != BMF_NO_PARENT && node.parent >= i) || (uint64)node.firstMesh + node.numMeshes > nodeMeshes.size()) {
+                return false;
+            }
+        }
+        for(uint32 mesh : nodeMeshes) {
+            if(mesh >= meshRecords.size()) {
+                return false;
+            }
+        }
+        meshBounds.resize(meshRecords.size());
+        return true;
+    }
+
+    // Version 1 files have no table of contents. Walking them is cheap though, because only the
+    // counts are read and the payloads are skipped.
+    bool openV1() {
+        const uint64 vertexSize = bmfVertexSize(0);
+        const uint64 materialSize = 10 * sizeof(float);
+        BMFReader input(file.getData(), file.getSize());
+        uint64 numMaterials = 0;
+        if(!input.read(&numMaterials)) {
+            return false;
+        }
+        for(uint64 i = 0; i < numMaterials; i++) {
+            BMFMaterialRecord record = {};
+            const uint8* values = input.take(materialSize);
+            uint64 diffuseMapNameLength = 0;
+            input.read(&diffuseMapNameLength);
+            const uint8* diffuseMapName = input.take(diffuseMapNameLength);
+            uint64 normalMapNameLength = 0;
+            input.read(&normalMapNameLength);
+            const uint8* normalMapName = input.take(normalMapNameLength);
+            if(!values || !diffuseMapName || !normalMapName) {
+                return false;
+            }
+            memcpy(&record, values, materialSize);
+            record.diffuseMapName = {(uint64)(diffuseMapName - file.getData()), diffuseMapNameLength};
+            record.normalMapName = {(uint64)(normalMapName - file.getData()), normalMapNameLength};
+            materialRecords.push_back(record);
+        }
+
+        uint64 numMeshes = 0;
+        input.read(&numMeshes);
+        for(uint64 i = 0; i < numMeshes; i++) {
+            uint64 materialIndex = 0;
+            BMFMeshRecord record = {};
+            input.read(&materialIndex);
+            input.read(&record.numVertices);
+            input.read(&record.numIndices);
+            const uint8* vertices = input.take(record.numVertices * vertexSize);
+            const uint8* indices = input.take(record.numIndices * sizeof(uint32));
+            if(!vertices || !indices || materialIndex >= materialRecords.size()) {
+                return false;
+            }
+            record.materialIndex = (uint32)materialIndex;
+            record.vertices = {(uint64)(vertices - file.getData()), record.numVertices * vertexSize};
+            record.indices = {(uint64)(indices - file.getData()), record.numIndices * sizeof(uint32)};
+            meshRecords.push_back(record);
+        }
+        // Version 1 meshes are never quantized, so nothing needs their bounds
+        meshBounds.resize(meshRecords.size());
+        return true;
+    }
+
+    MappedFile file;
+};
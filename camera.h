@@ -2,12 +2,14 @@
 
 #include "libs/glm/glm.hpp"
 #include "libs/glm/ext/matrix_transform.hpp"
+#include "libs/glm/ext/matrix_clip_space.hpp"
 
 class Camera {
 public:
 
     Camera(float fov, float width, float height) {
         projection = glm::perspective(fov/2.0f, width / height, 0.1f, 1000.0f);
+        screenHeight = height;
         view = glm::mat4(1.0f);
         position = glm::vec3(0.0f);
         update();
@@ -21,6 +23,11 @@ public:
         return view;
     }
 
+    // Pixels covered by one unit of length at a distance of one unit in front of the camera
+    float getPixelsPerUnit() {
+        return projection[1][1] * screenHeight * 0.5f;
+    }
+
     virtual void update() {
         viewProj = projection * view;
     }
@@ -35,4 +42,5 @@ protected:
     glm::mat4 projection;
     glm::mat4 view;
     glm::mat4 viewProj;
+    float screenHeight;
 };
\ No newline at end of file
@@ -20,4 +20,10 @@ struct Vertex {
 	glm::vec3 normal;
 	glm::vec3 tangent;
 	glm::vec2 textureCoord;
+};
+
+// Per instance data of an instanced mesh, see InstanceBuffer
+struct Instance {
+	glm::mat4 transform;
+	glm::mat3 normalMatrix;
 };
\ No newline at end of file
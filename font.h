@@ -2,6 +2,9 @@
 #include <GL/glew.h>
 
 #include "defines.h"
+#include "gl_state.h"
+#include "shader.h"
+#include "ring_buffer.h"
 
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "libs/stb_truetype.h"
@@ -12,56 +15,51 @@ struct FontVertex {
 };
 
 struct Font {
-    ~Font() {
-        if(fontVertexBufferData) {
-            delete[]fontVertexBufferData;
-        }
-    }
-
-    void initFont(const char* filename) {
+    // The vertices of every string are written to frameBuffer, which has to outlive the font. Strings
+    // are drawn with fontShader, which the caller binds.
+    void initFont(const char* filename, RingBuffer* frameBuffer, Shader* fontShader) {
+        this->frameBuffer = frameBuffer;
+        textureUniform = fontShader->getUniform<int32>(uniformHash("u_texture"));
         uint8 ttfBuffer[1<<20];
         uint8 tmpBitmap[512*512];
 
         fread(ttfBuffer, 1, 1<<20, fopen(filename, "rb"));
         stbtt_BakeFontBitmap(ttfBuffer, 0, 32.0f, tmpBitmap, 512, 512, 32, 96, cdata);
 
+        GLState& state = GLState::get();
         glGenTextures(1, &fontTexture);
-        glBindTexture(GL_TEXTURE_2D, fontTexture);
+        state.bindTexture(0, fontTexture);
         glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, 512, 512, 0, GL_ALPHA, GL_UNSIGNED_BYTE, tmpBitmap);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        state.bindTexture(0, 0);
 
         glGenVertexArrays(1, &fontVao);
-        glBindVertexArray(fontVao);
-        glGenBuffers(1, &fontVertexBufferId);
-        glBindBuffer(GL_ARRAY_BUFFER, fontVertexBufferId);
-        fontVertexBufferCapacity = 20;
-        fontVertexBufferData = new FontVertex[fontVertexBufferCapacity * 6];
-        glBufferData(GL_ARRAY_BUFFER, sizeof(FontVertex) * 6 * fontVertexBufferCapacity, 0, GL_DYNAMIC_DRAW);
+        state.bindVertexArray(fontVao);
         glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(FontVertex), 0);
         glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(FontVertex), (const void*)offsetof(FontVertex, texCoords));
-        glBindVertexArray(0);
+        state.bindVertexArray(0);
     }
 
-    void drawString(float x, float y, const char* text, Shader* fontShader) {
-        glBindVertexArray(fontVao);
-        glBindBuffer(GL_ARRAY_BUFFER, fontVertexBufferId);
-
+    void drawString(float x, float y, const char* text) {
         uint32 len = strlen(text);
-        if(fontVertexBufferCapacity < len) {
-            fontVertexBufferCapacity = len;
-            glBufferData(GL_ARRAY_BUFFER, sizeof(FontVertex) * 6 * fontVertexBufferCapacity, 0, GL_DYNAMIC_DRAW);
-            delete[]fontVertexBufferData;
-            fontVertexBufferData = new FontVertex[fontVertexBufferCapacity * 6];
+        RingAllocation allocation = frameBuffer->allocate(sizeof(FontVertex) * 6 * len, sizeof(FontVertex));
+        if(!allocation.data) {
+            return;
+        }
+        GLState& state = GLState::get();
+        state.bindVertexArray(fontVao);
+        // The attributes point at the start of the ring buffer, draws start at the allocation
+        if(attributeGeneration != frameBuffer->getGeneration()) {
+            attributeGeneration = frameBuffer->getGeneration();
+            state.bindBuffer(GL_ARRAY_BUFFER, allocation.buffer);
+            glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(FontVertex), 0);
+            glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(FontVertex), (const void*)offsetof(FontVertex, texCoords));
         }
 
-        GLCALL(glActiveTexture(GL_TEXTURE0));
-        GLCALL(glBindTexture(GL_TEXTURE_2D, fontTexture));
-        GLCALL(glUniform1i(glGetUniformLocation(fontShader->getShaderId(), "u_texture"), 0));
+        state.bindTexture(0, fontTexture);
+        state.uniform1i(textureUniform.location, 0);
 
-        FontVertex* vData = fontVertexBufferData;
+        FontVertex* vData = (FontVertex*)allocation.data;
         uint32 numVertices = 0;
         while(*text) {
             if(*text >= 32 && *text < 128) {
@@ -81,16 +79,17 @@ struct Font {
             ++text;
         }
 
-        GLCALL(glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(FontVertex)*numVertices, fontVertexBufferData));
-        GLCALL(glDrawArrays(GL_TRIANGLES, 0, numVertices));
+        frameBuffer->flush(allocation);
+        GLCALL(glDrawArrays(GL_TRIANGLES, (GLint)(allocation.offset / sizeof(FontVertex)), numVertices));
     }
 
 private:
     stbtt_bakedchar cdata[96];
     GLuint fontTexture;
     GLuint fontVao;
-    GLuint fontVertexBufferId;
-    FontVertex* fontVertexBufferData = 0;
-    uint32 fontVertexBufferCapacity;
+    Uniform<int32> textureUniform;
+    RingBuffer* frameBuffer = 0;
+    // RingBuffer::getGeneration of the buffer the vertex attributes point at
+    uint32 attributeGeneration = 0;
 };
 
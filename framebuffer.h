@@ -1,23 +1,25 @@
 #include <GL/glew.h>
 
 #include "defines.h"
+#include "gl_state.h"
 
 struct Framebuffer {
     void create(uint32 width, uint32 height) {
         glGenFramebuffers(1, &fbo);
 
+        GLState& state = GLState::get();
         glGenTextures(2, textures);
 
-        glBindTexture(GL_TEXTURE_2D, textures[0]);
+        state.bindTexture(0, textures[0]);
         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-        glBindTexture(GL_TEXTURE_2D, textures[1]);
+        state.bindTexture(0, textures[1]);
         glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        state.bindTexture(0, 0);
 
         bind();
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[0], 0);
@@ -28,7 +30,8 @@ struct Framebuffer {
     void destroy() {
         glDeleteFramebuffers(1, &fbo);
         // This line was missing in the original implementation in the framebuffer video
-        glDeleteTextures(2, textures);
+        GLState::get().deleteTexture(textures[0]);
+        GLState::get().deleteTexture(textures[1]);
     }
 
     void bind() {
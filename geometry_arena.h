@@ -0,0 +1,271 @@
+#pragma once
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <iostream>
+#include <GL/glew.h>
+
+#include "defines.h"
+#include "bmf.h"
+#include "gl_state.h"
+#include "vertex_buffer.h"
+
+// First fit allocator of ranges of [0, capacity). Free ranges are kept sorted by offset and merged
+// with their neighbours when a range is freed, so freeing everything gives back one range.
+class FreeListAllocator {
+public:
+    static const uint64 INVALID = ~0ull;
+
+    FreeListAllocator(uint64 capacity = 0) {
+        this->capacity = capacity;
+        if(capacity) {
+            ranges[0] = capacity;
+        }
+    }
+
+    // Returns the offset of size units, a multiple of alignment, or INVALID if no free range fits
+    uint64 allocate(uint64 size, uint64 alignment = 1) {
+        for(auto it = ranges.begin(); it != ranges.end(); ++it) {
+            uint64 offset = (it->first + alignment - 1) / alignment * alignment;
+            uint64 end = it->first + it->second;
+            if(offset + size > end) {
+                continue;
+            }
+            // The padding in front stays free, the rest of the range after the allocation as well
+            uint64 start = it->first;
+            ranges.erase(it);
+            if(offset > start) {
+                ranges[start] = offset - start;
+            }
+            if(offset + size < end) {
+                ranges[offset + size] = end - offset - size;
+            }
+            used += size;
+            return offset;
+        }
+        return INVALID;
+    }
+
+    void free(uint64 offset, uint64 size) {
+        used -= size;
+        auto next = ranges.lower_bound(offset);
+        if(next != ranges.end() && offset + size == next->first) {
+            size += next->second;
+            next = ranges.erase(next);
+        }
+        if(next != ranges.begin()) {
+            auto previous = std::prev(next);
+            if(previous->first + previous->second == offset) {
+                previous->second += size;
+                return;
+            }
+        }
+        ranges[offset] = size;
+    }
+
+    uint64 getUsed() {
+        return used;
+    }
+
+    uint64 getCapacity() {
+        return capacity;
+    }
+
+    uint64 getLargestFree() {
+        uint64 result = 0;
+        for(const auto& range : ranges) {
+            result = std::max(result, range.second);
+        }
+        return result;
+    }
+
+private:
+    // Offset to size of the free ranges
+    std::map<uint64, uint64> ranges;
+    uint64 capacity = 0;
+    uint64 used = 0;
+};
+
+// Where GeometryArena placed the vertices and indices of a mesh. Indices stay relative to the
+// first vertex of the mesh, draws add baseVertex.
+struct GeometryAllocation {
+    uint32 block = ~0u;
+    uint32 meshFlags = 0;
+    GLint baseVertex = 0;
+    uint32 numVertices = 0;
+    // In bytes, so 16 and 32 bit indices can share an index buffer
+    uint64 indexOffset = 0;
+    uint64 indexSize = 0;
+};
+
+struct GeometryArenaStats {
+    uint64 numBlocks = 0;
+    uint64 vertexBytes = 0;
+    uint64 vertexCapacity = 0;
+    uint64 indexBytes = 0;
+    uint64 indexCapacity = 0;
+    // Part of the free space that is not in the largest free range of its buffer. 0 when every
+    // buffer has one free range, near 1 when the free space is scattered in small holes.
+    float fragmentation = 0.0f;
+};
+
+// Places the static vertices and indices of all meshes in a few large buffers. Each block holds a
+// vertex buffer, an index buffer and one vertex array set up for a vertex format, so meshes of the
+// same format draw from the same vertex array with base vertex and index offsets instead of
+// switching buffers. Blocks are added when the existing ones of a format are full, each one twice the
+// size of the previous block of its format, so a small scene only reserves a few MB of VRAM while a
+// large one still ends up with few blocks. GL thread only.
+class GeometryArena {
+public:
+    // Bytes of the buffers of the first block of a format, and of every block once doubling reached
+    // the maximum. Meshes that are larger get a block of their own size.
+    static const uint64 MIN_VERTEX_BLOCK_SIZE = 1024 * 1024;
+    static const uint64 MIN_INDEX_BLOCK_SIZE = 512 * 1024;
+    static const uint64 MAX_VERTEX_BLOCK_SIZE = 64 * 1024 * 1024;
+    static const uint64 MAX_INDEX_BLOCK_SIZE = 32 * 1024 * 1024;
+
+    static GeometryArena& get() {
+        static GeometryArena arena;
+        return arena;
+    }
+
+    // Uploads the vertices in the layout meshFlags selects and the indices in bmfIndexSize(meshFlags)
+    GeometryAllocation allocate(const void* vertices, uint64 numVertices, const void* indices, uint64 numIndices, uint32 meshFlags) {
+        GeometryAllocation result;
+        result.meshFlags = meshFlags;
+        result.numVertices = (uint32)numVertices;
+        result.indexSize = numIndices * bmfIndexSize(meshFlags);
+        uint32 format = meshFlags & (BMF_MESH_QUANTIZED_VERTICES | BMF_MESH_VERTEX_OCCLUSION);
+        uint64 vertexSize = bmfVertexSize(meshFlags);
+
+        uint32 numFormatBlocks = 0;
+        for(uint32 i = 0; i < blocks.size() && result.block == ~0u; i++) {
+            if(blocks[i].format != format) {
+                continue;
+            }
+            numFormatBlocks++;
+            if(place(blocks[i], numVertices, result)) {
+                result.block = i;
+            }
+        }
+        if(result.block == ~0u) {
+            uint32 shift = std::min(numFormatBlocks, 6u);
+            uint64 vertexBlockSize = std::min(MIN_VERTEX_BLOCK_SIZE << shift, (uint64)MAX_VERTEX_BLOCK_SIZE);
+            uint64 indexBlockSize = std::min(MIN_INDEX_BLOCK_SIZE << shift, (uint64)MAX_INDEX_BLOCK_SIZE);
+            Block block;
+            create(block, format, std::max(vertexBlockSize / vertexSize, numVertices), std::max(indexBlockSize, result.indexSize));
+            place(block, numVertices, result);
+            result.block = (uint32)blocks.size();
+            blocks.push_back(block);
+        }
+
+        Block& block = blocks[result.block];
+        GLState& state = GLState::get();
+        state.bindBuffer(GL_ARRAY_BUFFER, block.vertexBufferId);
+        glBufferSubData(GL_ARRAY_BUFFER, result.baseVertex * vertexSize, numVertices * vertexSize, vertices);
+        // Written through the copy target, the element buffer binding belongs to the vertex array
+        state.bindBuffer(GL_COPY_WRITE_BUFFER, block.indexBufferId);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, result.indexOffset, result.indexSize, indices);
+        return result;
+    }
+
+    void free(const GeometryAllocation& allocation) {
+        if(allocation.block == ~0u) {
+            return;
+        }
+        Block& block = blocks[allocation.block];
+        block.vertices.free(allocation.baseVertex, allocation.numVertices);
+        block.indices.free(allocation.indexOffset, allocation.indexSize);
+    }
+
+    // Binds the vertex array of the block, which has the vertex and index buffer attached
+    void bind(const GeometryAllocation& allocation) {
+        GLState::get().bindVertexArray(blocks[allocation.block].vao);
+    }
+
+    GeometryArenaStats getStats() {
+        GeometryArenaStats result;
+        uint64 freeBytes = 0;
+        uint64 largestFreeBytes = 0;
+        for(Block& block : blocks) {
+            uint64 vertexSize = bmfVertexSize(block.format);
+            result.numBlocks++;
+            result.vertexBytes += block.vertices.getUsed() * vertexSize;
+            result.vertexCapacity += block.vertices.getCapacity() * vertexSize;
+            result.indexBytes += block.indices.getUsed();
+            result.indexCapacity += block.indices.getCapacity();
+            freeBytes += (block.vertices.getCapacity() - block.vertices.getUsed()) * vertexSize
+                + block.indices.getCapacity() - block.indices.getUsed();
+            largestFreeBytes += block.vertices.getLargestFree() * vertexSize + block.indices.getLargestFree();
+        }
+        if(freeBytes) {
+            result.fragmentation = 1.0f - (float)largestFreeBytes / freeBytes;
+        }
+        return result;
+    }
+
+    void printStats() {
+        GeometryArenaStats current = getStats();
+        uint64 used = current.vertexBytes + current.indexBytes;
+        uint64 capacity = current.vertexCapacity + current.indexCapacity;
+        std::cout << "Geometry arena: " << current.numBlocks << " blocks, "
+            << current.vertexBytes / (1024.0 * 1024.0) << " / " << current.vertexCapacity / (1024.0 * 1024.0) << " MB vertices, "
+            << current.indexBytes / (1024.0 * 1024.0) << " / " << current.indexCapacity / (1024.0 * 1024.0) << " MB indices, "
+            << (capacity ? 100.0 * used / capacity : 0.0) << "% used, "
+            << 100.0 * current.fragmentation << "% fragmented" << std::endl;
+    }
+
+private:
+    struct Block {
+        // BMF_MESH_QUANTIZED_VERTICES and BMF_MESH_VERTEX_OCCLUSION of the meshes in the block
+        uint32 format = 0;
+        GLuint vao = 0;
+        GLuint vertexBufferId = 0;
+        GLuint indexBufferId = 0;
+        // In vertices
+        FreeListAllocator vertices;
+        // In bytes
+        FreeListAllocator indices;
+    };
+
+    void create(Block& block, uint32 format, uint64 numVertices, uint64 indexBytes) {
+        GLState& state = GLState::get();
+        block.format = format;
+        block.vertices = FreeListAllocator(numVertices);
+        block.indices = FreeListAllocator(indexBytes);
+
+        glGenVertexArrays(1, &block.vao);
+        state.bindVertexArray(block.vao);
+
+        glGenBuffers(1, &block.vertexBufferId);
+        state.bindBuffer(GL_ARRAY_BUFFER, block.vertexBufferId);
+        glBufferData(GL_ARRAY_BUFFER, numVertices * bmfVertexSize(format), 0, GL_STATIC_DRAW);
+        setVertexAttributes(format);
+
+        glGenBuffers(1, &block.indexBufferId);
+        state.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, block.indexBufferId);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes, 0, GL_STATIC_DRAW);
+
+        state.bindVertexArray(0);
+    }
+
+    // Reserves the ranges of the allocation in block, nothing if one of them does not fit
+    bool place(Block& block, uint64 numVertices, GeometryAllocation& allocation) {
+        uint64 baseVertex = block.vertices.allocate(numVertices);
+        if(baseVertex == FreeListAllocator::INVALID) {
+            return false;
+        }
+        // Offsets of 32 bit indices must be 4 byte aligned
+        uint64 indexOffset = block.indices.allocate(allocation.indexSize, sizeof(uint32));
+        if(indexOffset == FreeListAllocator::INVALID) {
+            block.vertices.free(baseVertex, numVertices);
+            return false;
+        }
+        allocation.baseVertex = (GLint)baseVertex;
+        allocation.indexOffset = indexOffset;
+        return true;
+    }
+
+    std::vector<Block> blocks;
+};
@@ -0,0 +1,346 @@
+#pragma once
+#include <cstring>
+#include <iterator>
+#include <unordered_map>
+#include <GL/glew.h>
+
+#include "defines.h"
+
+// GL calls the state cache issued and skipped, counted over a frame
+struct GLStateStats {
+    uint64 calls = 0;
+    uint64 skipped = 0;
+};
+
+// Shadows the GL state the renderer touches every draw (program, vertex array, buffer and texture
+// bindings, capabilities, blend and depth state and uniform values) and skips calls that would set
+// it to the value it already has. GL thread only.
+//
+// The shadow starts out unknown, so the first call of each kind always reaches GL. Code that
+// changes state without going through the cache has to call invalidate() afterwards. Objects must
+// be deleted through the cache, since GL unbinds them and a new object may reuse the name.
+class GLState {
+public:
+    static GLState& get() {
+        static GLState state;
+        return state;
+    }
+
+    void useProgram(GLuint program) {
+        if(set(this->program, program)) {
+            glUseProgram(program);
+        }
+    }
+
+    void bindVertexArray(GLuint vao) {
+        if(set(vertexArray, vao)) {
+            glBindVertexArray(vao);
+        }
+    }
+
+    // The element array binding is part of the vertex array, so it is shadowed per vertex array
+    void bindBuffer(GLenum target, GLuint buffer) {
+        GLuint* shadow = 0;
+        switch(target) {
+            case GL_ARRAY_BUFFER:
+            shadow = &arrayBuffer;
+            break;
+            case GL_ELEMENT_ARRAY_BUFFER:
+            if(vertexArray == UNKNOWN) {
+                break;
+            }
+            shadow = &elementBuffers.insert(std::make_pair(vertexArray, (GLuint)UNKNOWN)).first->second;
+            break;
+            case GL_UNIFORM_BUFFER:
+            shadow = &uniformBuffer;
+            break;
+        }
+        if(!shadow || set(*shadow, buffer)) {
+            if(!shadow) {
+                frameStats.calls++;
+            }
+            glBindBuffer(target, buffer);
+        }
+    }
+
+    // Binds a range of a buffer to an indexed binding point. Only the uniform buffer bindings below
+    // MAX_UNIFORM_BINDINGS are shadowed. Like GL, this also binds the buffer to target.
+    void bindBufferRange(GLenum target, uint32 index, GLuint buffer, uint64 offset, uint64 size) {
+        if(target == GL_UNIFORM_BUFFER && index < MAX_UNIFORM_BINDINGS) {
+            IndexedBinding& binding = uniformBindings[index];
+            if(binding.buffer == buffer && binding.offset == offset && binding.size == size) {
+                frameStats.skipped++;
+                return;
+            }
+            binding.buffer = buffer;
+            binding.offset = offset;
+            binding.size = size;
+        }
+        if(target == GL_UNIFORM_BUFFER) {
+            uniformBuffer = buffer;
+        }
+        frameStats.calls++;
+        glBindBufferRange(target, index, buffer, (GLintptr)offset, (GLsizeiptr)size);
+    }
+
+    void activeTexture(uint32 unit) {
+        if(set(activeUnit, unit)) {
+            glActiveTexture(GL_TEXTURE0 + unit);
+        }
+    }
+
+    // Binds a GL_TEXTURE_2D texture to a texture unit, and leaves that unit active
+    void bindTexture(uint32 unit, GLuint texture) {
+        if(unit >= MAX_TEXTURE_UNITS) {
+            activeTexture(unit);
+            frameStats.calls++;
+            glBindTexture(GL_TEXTURE_2D, texture);
+            return;
+        }
+        // Also on a skipped bind, the caller may rely on the unit being active
+        activeTexture(unit);
+        if(textures[unit] == texture) {
+            frameStats.skipped++;
+            return;
+        }
+        textures[unit] = texture;
+        frameStats.calls++;
+        glBindTexture(GL_TEXTURE_2D, texture);
+    }
+
+    void enable(GLenum capability) {
+        setCapability(capability, true);
+    }
+
+    void disable(GLenum capability) {
+        setCapability(capability, false);
+    }
+
+    void blendFunc(GLenum source, GLenum destination) {
+        if(blendSource == source && blendDestination == destination) {
+            frameStats.skipped++;
+            return;
+        }
+        blendSource = source;
+        blendDestination = destination;
+        frameStats.calls++;
+        glBlendFunc(source, destination);
+    }
+
+    void depthFunc(GLenum function) {
+        if(set(depthFunction, function)) {
+            glDepthFunc(function);
+        }
+    }
+
+    void depthMask(bool write) {
+        if(set(depthWrite, write ? 1u : 0u)) {
+            glDepthMask(write ? GL_TRUE : GL_FALSE);
+        }
+    }
+
+    // Uniforms of the current program. Locations of -1 are ignored like GL does.
+    void uniform1i(GLint location, int32 value) {
+        if(setUniform(location, &value, sizeof(value))) {
+            glUniform1i(location, value);
+        }
+    }
+
+    void uniform1f(GLint location, float value) {
+        if(setUniform(location, &value, sizeof(value))) {
+            glUniform1f(location, value);
+        }
+    }
+
+    void uniform3fv(GLint location, const float* values) {
+        if(setUniform(location, values, 3 * sizeof(float))) {
+            glUniform3fv(location, 1, values);
+        }
+    }
+
+    // One column major matrix
+    void uniformMatrix4fv(GLint location, const float* values) {
+        if(setUniform(location, values, 16 * sizeof(float))) {
+            glUniformMatrix4fv(location, 1, GL_FALSE, values);
+        }
+    }
+
+    void deleteProgram(GLuint program) {
+        if(this->program == program) {
+            this->program = UNKNOWN;
+        }
+        for(auto it = uniforms.begin(); it != uniforms.end();) {
+            it = (GLuint)(it->first >> 32) == program ? uniforms.erase(it) : std::next(it);
+        }
+        glDeleteProgram(program);
+    }
+
+    void deleteVertexArray(GLuint vao) {
+        if(vertexArray == vao) {
+            vertexArray = UNKNOWN;
+        }
+        elementBuffers.erase(vao);
+        glDeleteVertexArrays(1, &vao);
+    }
+
+    void deleteBuffer(GLuint buffer) {
+        if(arrayBuffer == buffer) {
+            arrayBuffer = UNKNOWN;
+        }
+        if(uniformBuffer == buffer) {
+            uniformBuffer = UNKNOWN;
+        }
+        for(IndexedBinding& binding : uniformBindings) {
+            if(binding.buffer == buffer) {
+                binding.buffer = UNKNOWN;
+            }
+        }
+        for(auto& elementBuffer : elementBuffers) {
+            if(elementBuffer.second == buffer) {
+                elementBuffer.second = UNKNOWN;
+            }
+        }
+        glDeleteBuffers(1, &buffer);
+    }
+
+    void deleteTexture(GLuint texture) {
+        for(GLuint& bound : textures) {
+            if(bound == texture) {
+                bound = UNKNOWN;
+            }
+        }
+        glDeleteTextures(1, &texture);
+    }
+
+    // Forgets everything, for code that changed state behind the cache's back. Uniform values stay,
+    // they can only change through glUniform calls.
+    void invalidate() {
+        program = UNKNOWN;
+        vertexArray = UNKNOWN;
+        arrayBuffer = UNKNOWN;
+        uniformBuffer = UNKNOWN;
+        for(IndexedBinding& binding : uniformBindings) {
+            binding.buffer = UNKNOWN;
+        }
+        elementBuffers.clear();
+        activeUnit = UNKNOWN;
+        for(GLuint& texture : textures) {
+            texture = UNKNOWN;
+        }
+        for(int8& capability : capabilities) {
+            capability = -1;
+        }
+        blendSource = UNKNOWN;
+        blendDestination = UNKNOWN;
+        depthFunction = UNKNOWN;
+        depthWrite = UNKNOWN;
+    }
+
+    // Starts counting the next frame, getStats() then returns the frame that just ended
+    void endFrame() {
+        lastFrameStats = frameStats;
+        frameStats = GLStateStats();
+    }
+
+    const GLStateStats& getStats() {
+        return lastFrameStats;
+    }
+
+private:
+    static const GLuint UNKNOWN = 0xffffffff;
+    static const uint32 MAX_TEXTURE_UNITS = 16;
+    static const uint32 MAX_UNIFORM_BINDINGS = 8;
+
+    GLState() {
+        invalidate();
+    }
+
+    // Returns true if the call has to be made
+    bool set(GLuint& shadow, GLuint value) {
+        if(shadow == value) {
+            frameStats.skipped++;
+            return false;
+        }
+        shadow = value;
+        frameStats.calls++;
+        return true;
+    }
+
+    void setCapability(GLenum capability, bool enabled) {
+        int32 index = -1;
+        switch(capability) {
+            case GL_BLEND:
+            index = 0;
+            break;
+            case GL_CULL_FACE:
+            index = 1;
+            break;
+            case GL_DEPTH_TEST:
+            index = 2;
+            break;
+        }
+        if(index >= 0 && capabilities[index] == (int8)enabled) {
+            frameStats.skipped++;
+            return;
+        }
+        if(index >= 0) {
+            capabilities[index] = (int8)enabled;
+        }
+        frameStats.calls++;
+        if(enabled) {
+            glEnable(capability);
+        } else {
+            glDisable(capability);
+        }
+    }
+
+    bool setUniform(GLint location, const void* value, uint32 size) {
+        if(location < 0) {
+            return false;
+        }
+        if(program == UNKNOWN) {
+            frameStats.calls++;
+            return true;
+        }
+        UniformValue& shadow = uniforms[((uint64)program << 32) | (uint32)location];
+        if(shadow.size == size && memcmp(shadow.data, value, size) == 0) {
+            frameStats.skipped++;
+            return false;
+        }
+        shadow.size = size;
+        memcpy(shadow.data, value, size);
+        frameStats.calls++;
+        return true;
+    }
+
+    struct IndexedBinding {
+        GLuint buffer;
+        uint64 offset;
+        uint64 size;
+    };
+
+    struct UniformValue {
+        uint32 size = 0;
+        uint8 data[16 * sizeof(float)];
+    };
+
+    GLuint program;
+    GLuint vertexArray;
+    GLuint arrayBuffer;
+    GLuint uniformBuffer;
+    IndexedBinding uniformBindings[MAX_UNIFORM_BINDINGS];
+    // Element array binding of every vertex array that was bound through the cache
+    std::unordered_map<GLuint, GLuint> elementBuffers;
+    GLuint activeUnit;
+    GLuint textures[MAX_TEXTURE_UNITS];
+    // GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST: 1 enabled, 0 disabled, -1 unknown
+    int8 capabilities[3];
+    GLenum blendSource;
+    GLenum blendDestination;
+    GLenum depthFunction;
+    GLuint depthWrite;
+    // Keyed by program << 32 | location
+    std::unordered_map<uint64, UniformValue> uniforms;
+    GLStateStats frameStats;
+    GLStateStats lastFrameStats;
+};
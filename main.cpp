@@ -6,6 +6,8 @@
 #include <GL/glew.h>
 #define SDL_MAIN_HANDLED
 
+// Images are decoded on loader threads and the failure string is an unsynchronized global
+#define STBI_NO_FAILURE_STRINGS
 #define STB_IMAGE_IMPLEMENTATION
 #include "libs/stb_image.h"
 #undef STB_IMAGE_IMPLEMENTATION
@@ -40,11 +42,15 @@ void _GLGetError(const char* file, int line, const char* call) {
 #endif
 
 #include "defines.h"
+#include "gl_state.h"
 #include "vertex_buffer.h"
-#include "index_buffer.h"
+#include "geometry_arena.h"
 #include "shader.h"
+#include "uniform_buffer.h"
+#include "ring_buffer.h"
 #include "floating_camera.h"
 #include "mesh.h"
+#include "model_loader.h"
 #include "font.h"
 #include "framebuffer.h"
 
@@ -52,6 +58,18 @@ void openGLDebugCallback(GLenum source, GLenum type, GLuint id, GLenum severity,
 	std::cout << "[OpenGL Error] " << message << std::endl;
 }
 
+// Copies a uniform block into this frame's part of the ring buffer and binds it. If the frame ran
+// out of space, the binding keeps the block of an earlier frame until the buffer has grown.
+void bindFrameBlock(RingBuffer& frameBuffer, uint32 binding, const void* block, uint64 size) {
+	RingAllocation allocation = frameBuffer.allocate(size, UniformBuffer::getOffsetAlignment());
+	if(!allocation.data) {
+		return;
+	}
+	memcpy(allocation.data, block, size);
+	frameBuffer.flush(allocation);
+	GLState::get().bindBufferRange(GL_UNIFORM_BUFFER, binding, allocation.buffer, allocation.offset, size);
+}
+
 int main(int argc, char** argv) {
 	SDL_Window* window;
 	SDL_Init(SDL_INIT_EVERYTHING);
@@ -89,42 +107,43 @@ int main(int argc, char** argv) {
 	Shader fontShader("shaders_old/font.vs", "shaders_old/font.fs");
 	Shader shader("shaders/basic.vs", "shaders/basic.fs");
 	Shader postprocessingShader("shaders_old/postprocess.vs", "shaders_old/postprocess.fs");
-	shader.bind();
-	int directionLocation = GLCALL(glGetUniformLocation(shader.getShaderId(), "u_directional_light.direction"));
+	// Lights and camera are shared by every program through fixed uniform buffer bindings
+	LightsBlock lights = {};
 	glm::vec3 sunColor = glm::vec3(0.0f);
 	glm::vec3 sunDirection = glm::vec3(-1.0f);
-	GLCALL(glUniform3fv(glGetUniformLocation(shader.getShaderId(), "u_directional_light.diffuse"), 1, (float*)&sunColor.data));
-	GLCALL(glUniform3fv(glGetUniformLocation(shader.getShaderId(), "u_directional_light.specular"), 1, (float*)&sunColor.data));
-	sunColor *= 0.4f;
-	GLCALL(glUniform3fv(glGetUniformLocation(shader.getShaderId(), "u_directional_light.ambient"), 1, (float*)&sunColor.data));
+	lights.directional.diffuse = sunColor;
+	lights.directional.specular = sunColor;
+	lights.directional.ambient = sunColor * 0.4f;
 
 	glm::vec3 pointLightColor = glm::vec3(0.0f, 0.0f, 0.0f);
-	GLCALL(glUniform3fv(glGetUniformLocation(shader.getShaderId(), "u_point_light.diffuse"), 1, (float*)&pointLightColor.data));
-	GLCALL(glUniform3fv(glGetUniformLocation(shader.getShaderId(), "u_point_light.specular"), 1, (float*)&pointLightColor.data));
-	pointLightColor *= 0.2f;
-	GLCALL(glUniform3fv(glGetUniformLocation(shader.getShaderId(), "u_point_light.ambient"), 1, (float*)&pointLightColor.data));
-	GLCALL(glUniform1f(glGetUniformLocation(shader.getShaderId(), "u_point_light.linear"), 0.027f));
-	GLCALL(glUniform1f(glGetUniformLocation(shader.getShaderId(), "u_point_light.quadratic"), 0.0028f));
+	lights.point.diffuse = pointLightColor;
+	lights.point.specular = pointLightColor;
+	lights.point.ambient = pointLightColor * 0.2f;
+	lights.point.linear = 0.027f;
+	lights.point.quadratic = 0.0028f;
 	glm::vec4 pointLightPosition = glm::vec4(0.0f, 0.0f, 10.0f, 1.0f);
-	int positionLocation = GLCALL(glGetUniformLocation(shader.getShaderId(), "u_point_light.position"));
 
 	glm::vec3 spotLightColor = glm::vec3(1.0f);
-	GLCALL(glUniform3fv(glGetUniformLocation(shader.getShaderId(), "u_spot_light.diffuse"), 1, (float*)&spotLightColor.data));
-	GLCALL(glUniform3fv(glGetUniformLocation(shader.getShaderId(), "u_spot_light.specular"), 1, (float*)&spotLightColor.data));
-	spotLightColor *= 0.2f;
-	GLCALL(glUniform3fv(glGetUniformLocation(shader.getShaderId(), "u_spot_light.ambient"), 1, (float*)&spotLightColor.data));
-	glm::vec3 spotLightPosition = glm::vec3(0.0f);
-	GLCALL(glUniform3fv(glGetUniformLocation(shader.getShaderId(), "u_spot_light.position"), 1, (float*)&spotLightPosition.data));
-	spotLightPosition.z = 1.0f;
-	GLCALL(glUniform3fv(glGetUniformLocation(shader.getShaderId(), "u_spot_light.direction"), 1, (float*)&spotLightPosition.data));
-	GLCALL(glUniform1f(glGetUniformLocation(shader.getShaderId(), "u_spot_light.innerCone"), 0.95f));
-	GLCALL(glUniform1f(glGetUniformLocation(shader.getShaderId(), "u_spot_light.outerCone"), 0.80f));
+	lights.spot.diffuse = spotLightColor;
+	lights.spot.specular = spotLightColor;
+	lights.spot.ambient = spotLightColor * 0.2f;
+	lights.spot.position = glm::vec3(0.0f);
+	lights.spot.direction = glm::vec3(0.0f, 0.0f, 1.0f);
+	lights.spot.innerCone = 0.95f;
+	lights.spot.outerCone = 0.80f;
+
+	CameraBlock cameraBlock;
+
+	// Per frame data: the camera and light blocks and the text vertices
+	RingBuffer frameBuffer(64 * 1024);
 	
 	Font font;
-	font.initFont("fonts/OpenSans-Regular.ttf");
+	font.initFont("fonts/OpenSans-Regular.ttf", &frameBuffer, &fontShader);
 
-	Model monkey;
-	monkey.init("models/fern.bmf", &shader);
+	// Deleted before the stats are printed, the loader first since it may still hold the model
+	Model* monkey = new Model();
+	ModelLoader* modelLoader = new ModelLoader();
+	modelLoader->load(monkey, "models/fern.bmf", &shader);
 
 	uint64 perfCounterFrequency = SDL_GetPerformanceFrequency();
 	uint64 lastCounter = SDL_GetPerformanceCounter();
@@ -137,11 +156,8 @@ int main(int argc, char** argv) {
 	camera.translate(glm::vec3(0.0f, 0.0f, 5.0f));
 	camera.update();
 
-	glm::mat4 modelViewProj = camera.getViewProj() * model;
-
-	int modelViewProjMatrixLocation = GLCALL(glGetUniformLocation(shader.getShaderId(), "u_modelViewProj"));
-	int modelViewLocation = GLCALL(glGetUniformLocation(shader.getShaderId(), "u_modelView"));
-	int invModelViewLocation = GLCALL(glGetUniformLocation(shader.getShaderId(), "u_invModelView"));
+	Uniform<int32> postprocessingTextureUniform = postprocessingShader.getUniform<int32>(uniformHash("u_texture"));
+	Uniform<glm::mat4> fontModelViewProjUniform = fontShader.getUniform<glm::mat4>(uniformHash("u_modelViewProj"));
 
 	// Wireframe
 	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
@@ -158,8 +174,9 @@ int main(int argc, char** argv) {
 	bool close = false;
 	uint32 FPS = 0;
 	SDL_SetRelativeMouseMode(SDL_TRUE);
-	GLCALL(glEnable(GL_CULL_FACE));
-	GLCALL(glEnable(GL_DEPTH_TEST));
+	GLState& glState = GLState::get();
+	glState.enable(GL_CULL_FACE);
+	glState.enable(GL_DEPTH_TEST);
 
 	Framebuffer framebuffer;
 	int w, h;
@@ -227,6 +244,7 @@ int main(int argc, char** argv) {
 			}
 		}
 
+		frameBuffer.beginFrame();
 		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 		time += delta;
@@ -248,34 +266,30 @@ int main(int argc, char** argv) {
 
 		camera.update();
 
+		modelLoader->processUploads();
+
 		framebuffer.bind();
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 		shader.bind();
 		model = glm::rotate(model, 1.0f*delta, glm::vec3(0, 1, 0));
-		modelViewProj = camera.getViewProj() * model;
-		glm::mat4 modelView = camera.getView() * model;
-		glm::mat4 invModelView = glm::transpose(glm::inverse(modelView));
-		
-		glm::vec4 transformedSunDirection = glm::transpose(glm::inverse(camera.getView())) * glm::vec4(sunDirection, 1.0f);
-		glUniform3fv(directionLocation, 1, (float*)&transformedSunDirection.data);
+		cameraBlock.modelViewProj = camera.getViewProj() * model;
+		cameraBlock.modelView = camera.getView() * model;
+		cameraBlock.invModelView = glm::transpose(glm::inverse(cameraBlock.modelView));
+		bindFrameBlock(frameBuffer, UNIFORM_BINDING_CAMERA, &cameraBlock, sizeof(CameraBlock));
 
+		lights.directional.direction = glm::vec3(glm::transpose(glm::inverse(camera.getView())) * glm::vec4(sunDirection, 1.0f));
 		glm::mat4 pointLightMatrix = glm::rotate(glm::mat4(1.0f), -delta, {0.0f, 1.0f, 0.0f});
 		pointLightPosition = pointLightMatrix * pointLightPosition;
-		glm::vec3 transformedPointLightPosition = (glm::vec3) (camera.getView() * pointLightPosition);
-		glUniform3fv(positionLocation, 1, (float*)&transformedPointLightPosition.data);
-
-		GLCALL(glUniformMatrix4fv(modelViewProjMatrixLocation, 1, GL_FALSE, &modelViewProj[0][0]));
-		GLCALL(glUniformMatrix4fv(modelViewLocation, 1, GL_FALSE, &modelView[0][0]));
-		GLCALL(glUniformMatrix4fv(invModelViewLocation, 1, GL_FALSE, &invModelView[0][0]));
-		monkey.render();
+		lights.point.position = glm::vec3(camera.getView() * pointLightPosition);
+		bindFrameBlock(frameBuffer, UNIFORM_BINDING_LIGHTS, &lights, sizeof(LightsBlock));
+		monkey->render(camera, model);
 		shader.unbind();
 		framebuffer.unbind();
 
 		// Postprocessing
 		postprocessingShader.bind();
-		GLCALL(glActiveTexture(GL_TEXTURE0));
-		GLCALL(glBindTexture(GL_TEXTURE_2D, framebuffer.getTextureId()));
-		GLCALL(glUniform1i(glGetUniformLocation(postprocessingShader.getShaderId(), "u_texture"), 0));
+		glState.bindTexture(0, framebuffer.getTextureId());
+		glState.uniform1i(postprocessingTextureUniform.location, 0);
 		glDrawArrays(GL_TRIANGLES, 0, 3);
 		postprocessingShader.unbind();
 
@@ -284,20 +298,29 @@ int main(int argc, char** argv) {
 		int w, h;
 		SDL_GetWindowSize(window, &w, &h);
 		glm::mat4 ortho = glm::ortho(0.0f, (float)w, (float)h, 0.0f);
-		GLCALL(glUniformMatrix4fv(glGetUniformLocation(fontShader.getShaderId(), "u_modelViewProj"), 1, GL_FALSE, &ortho[0][0]));
-		GLCALL(glDisable(GL_CULL_FACE));
-		GLCALL(glEnable(GL_BLEND));
-		GLCALL(glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA));
-		GLCALL(glDisable(GL_DEPTH_TEST));
+		glState.uniformMatrix4fv(fontModelViewProjUniform.location, &ortho[0][0]);
+		glState.disable(GL_CULL_FACE);
+		glState.enable(GL_BLEND);
+		glState.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glState.disable(GL_DEPTH_TEST);
 
-		font.drawString(100.0f, 100.0f, "Ganymede", &fontShader);
+		font.drawString(100.0f, 100.0f, "Ganymede");
 		std::string fpsString = "FPS: ";
 		fpsString.append(std::to_string(FPS));
-		font.drawString(20.0f, 20.0f, fpsString.c_str(), &fontShader);
+		font.drawString(20.0f, 20.0f, fpsString.c_str());
+		const GLStateStats& glStats = glState.getStats();
+		std::string glStatsString = "GL calls: " + std::to_string(glStats.calls) + ", skipped: " + std::to_string(glStats.skipped);
+		font.drawString(20.0f, 560.0f, glStatsString.c_str());
+		const RingBufferStats& ringStats = frameBuffer.getStats();
+		std::string ringStatsString = "Frame buffer: " + std::to_string(ringStats.frameBytes / 1024) + "/" + std::to_string(ringStats.frameSize / 1024)
+			+ " KB, stalls: " + std::to_string(ringStats.stalls) + ", overflows: " + std::to_string(ringStats.overflows);
+		font.drawString(20.0f, 530.0f, ringStatsString.c_str());
 
 		fontShader.unbind();
-		GLCALL(glEnable(GL_CULL_FACE));
-		GLCALL(glEnable(GL_DEPTH_TEST));
+		glState.enable(GL_CULL_FACE);
+		glState.enable(GL_DEPTH_TEST);
+		glState.endFrame();
+		frameBuffer.endFrame();
 
 		SDL_GL_SwapWindow(window);
 
@@ -309,6 +332,11 @@ int main(int argc, char** argv) {
 	}
 
 	framebuffer.destroy();
+	GeometryArena::get().printStats();
+	delete modelLoader;
+	delete monkey;
+	// Every model released its textures, anything still resident is a leak
+	TextureCache::get().printStats();
 
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,151 @@
+#pragma once
+#include <cstdio>
+
+#include "defines.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file. Uses the OS memory mapping if possible and falls back to reading
+// the file into one heap buffer in large chunks.
+struct MappedFile {
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    bool open(const char* filename) {
+        close();
+#ifdef _WIN32
+        fileHandle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+        if(fileHandle == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        if(!GetFileSizeEx(fileHandle, &fileSize)) {
+            close();
+            return false;
+        }
+        size = fileSize.QuadPart;
+        if(size > 0) {
+            mappingHandle = CreateFileMappingA(fileHandle, 0, PAGE_READONLY, 0, 0, 0);
+            if(mappingHandle) {
+                data = (uint8*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+            }
+        }
+#else
+        fd = ::open(filename, O_RDONLY);
+        if(fd < 0) {
+            return false;
+        }
+        struct stat fileStat;
+        if(fstat(fd, &fileStat) != 0) {
+            close();
+            return false;
+        }
+        size = fileStat.st_size;
+        if(size > 0) {
+            void* mapping = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(mapping != MAP_FAILED) {
+                data = (uint8*)mapping;
+                // Advice values are not flags, each needs its own call
+                madvise(mapping, size, MADV_SEQUENTIAL);
+                madvise(mapping, size, MADV_WILLNEED);
+            }
+        }
+#endif
+        if(!data && size > 0) {
+            return readChunked(filename);
+        }
+        return true;
+    }
+
+    void close() {
+        if(heapData) {
+            delete[] heapData;
+            heapData = 0;
+            data = 0;
+        }
+#ifdef _WIN32
+        if(data) {
+            UnmapViewOfFile(data);
+        }
+        if(mappingHandle) {
+            CloseHandle(mappingHandle);
+            mappingHandle = 0;
+        }
+        if(fileHandle != INVALID_HANDLE_VALUE) {
+            CloseHandle(fileHandle);
+            fileHandle = INVALID_HANDLE_VALUE;
+        }
+#else
+        if(data) {
+            munmap(data, size);
+        }
+        if(fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+#endif
+        data = 0;
+        size = 0;
+    }
+
+    const uint8* getData() const {
+        return data;
+    }
+
+    uint64 getSize() const {
+        return size;
+    }
+
+private:
+    // Fallback if the file could not be mapped. Fails unless the whole file could be read.
+    bool readChunked(const char* filename) {
+        FILE* file = fopen(filename, "rb");
+        if(!file) {
+            close();
+            return false;
+        }
+        const uint64 chunkSize = 4 << 20;
+        heapData = new uint8[size];
+        uint64 bytesRead = 0;
+        while(bytesRead < size) {
+            uint64 toRead = size - bytesRead < chunkSize ? size - bytesRead : chunkSize;
+            uint64 result = fread(heapData + bytesRead, 1, toRead, file);
+            if(result == 0) {
+                break;
+            }
+            bytesRead += result;
+        }
+        fclose(file);
+        data = heapData;
+        // A short read would hand out a silently truncated file
+        if(bytesRead != size) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    uint8* data = 0;
+    uint8* heapData = 0;
+    uint64 size = 0;
+#ifdef _WIN32
+    HANDLE fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE mappingHandle = 0;
+#else
+    int fd = -1;
+#endif
+};
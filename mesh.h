@@ -1,11 +1,19 @@
 #pragma once
 #include <vector>
-#include <fstream>
+#include <chrono>
+#include <cstring>
+#include <unordered_set>
+#include <atomic>
 
 #include "libs/glm/glm.hpp"
+#include "camera.h"
 #include "shader.h"
+#include "uniform_buffer.h"
 #include "vertex_buffer.h"
-#include "index_buffer.h"
+#include "geometry_arena.h"
+#include "bmf_file.h"
+#include "texture_cache.h"
+#include "thread_pool.h"
 #include "libs/stb_image.h"
 
 struct BMFMaterial {
@@ -19,187 +27,727 @@ struct Material {
     BMFMaterial material;
     GLuint diffuseMap;
     GLuint normalMap;
+    // BMFSpecularChannel
+    uint32 specularChannel;
+};
+
+// Meshlets and their triangles that were drawn or culled, counted over a frame
+struct MeshletStats {
+    uint64 meshlets = 0;
+    uint64 triangles = 0;
+    uint64 culledMeshlets = 0;
+    uint64 culledTriangles = 0;
 };
 
 class Mesh {
 public:
-    Mesh(std::vector<Vertex>& vertices, uint64 numVertices, std::vector<uint32>& indices, uint64 numIndices, Material material, Shader* shader) {
+    // Instances of the full detail level that are culled one by one, see drawLevel
+    static const uint32 MAX_CULLED_INSTANCES = 4;
+
+    // Quantized positions (see BMF_MESH_QUANTIZED_VERTICES) are decoded as positionOffset + position * positionScale.
+    // The mesh is drawn once per instance transform.
+    Mesh(const void* vertices, uint64 numVertices, const void* indices, uint64 numIndices, Material material, Shader* shader,
+        uint32 meshFlags = 0, glm::vec3 positionOffset = glm::vec3(0.0f), glm::vec3 positionScale = glm::vec3(1.0f),
+        const std::vector<glm::mat4>& transforms = std::vector<glm::mat4>(1, glm::mat4(1.0f))) {
         this->material = material;
         this->shader = shader;
         this->numIndices = numIndices;
+        materialBlock = {};
+        materialBlock.diffuse = material.material.diffuse;
+        materialBlock.specular = material.material.specular;
+        materialBlock.emissive = material.material.emissive;
+        materialBlock.shininess = material.material.shininess;
+        materialBlock.specularChannel = material.specularChannel;
+        materialBlock.octahedralNormals = (meshFlags & BMF_MESH_QUANTIZED_VERTICES) != 0;
+        materialBlock.positionOffset = positionOffset;
+        materialBlock.positionScale = positionScale;
+        this->indexType = (meshFlags & BMF_MESH_INDEX16) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
 
-        vertexBuffer = new VertexBuffer(vertices.data(), numVertices);
-        indexBuffer = new IndexBuffer(indices.data(), numIndices, sizeof(indices[0]));
+        geometry = GeometryArena::get().allocate(vertices, numVertices, indices, numIndices, meshFlags);
+
+        instances.resize(transforms.size());
+        for(uint64 i = 0; i < transforms.size(); i++) {
+            instances[i].transform = transforms[i];
+            instances[i].normalMatrix = glm::transpose(glm::inverse(glm::mat3(transforms[i])));
+        }
+        instanceBuffer = new InstanceBuffer(instances.data(), (uint32)instances.size());
+        numInstances = (uint32)instances.size();
 
-        diffuseLocation = GLCALL(glGetUniformLocation(shader->getShaderId(), "u_material.diffuse"));
-        specularLocation = GLCALL(glGetUniformLocation(shader->getShaderId(), "u_material.specular"));
-        emissiveLocation = GLCALL(glGetUniformLocation(shader->getShaderId(), "u_material.emissive"));
-        shininessLocation = GLCALL(glGetUniformLocation(shader->getShaderId(), "u_material.shininess"));
-        diffuseMapLocation = GLCALL(glGetUniformLocation(shader->getShaderId(), "u_diffuse_map"));
-        normalMapLocation = GLCALL(glGetUniformLocation(shader->getShaderId(), "u_normal_map"));
+        diffuseMapUniform = shader->getUniform<int32>(uniformHash("u_diffuse_map"));
+        normalMapUniform = shader->getUniform<int32>(uniformHash("u_normal_map"));
     }
     ~Mesh() {
-        delete vertexBuffer;
-        delete indexBuffer;
+        GeometryArena::get().free(geometry);
+        delete instanceBuffer;
     }
+    // Stores the MaterialBlock of the mesh at offset in buffer, which draws then bind. The buffer
+    // must outlive the mesh.
+    void setMaterialBuffer(UniformBuffer* buffer, uint64 offset) {
+        materialBuffer = buffer;
+        materialOffset = offset;
+        buffer->update(&materialBlock, offset, sizeof(MaterialBlock));
+    }
+
+    // Levels of detail as index ranges, the first one is the full detail mesh. center and radius
+    // bound the mesh in model space.
+    void setLods(const BMFLodRecord* lods, uint32 numLods, glm::vec3 center, float radius) {
+        this->lods.assign(lods, lods + numLods);
+        boundsCenter = center;
+        boundsRadius = radius;
+        instanceLods.assign(numInstances, ~0u);
+        lodInstances.resize(numInstances);
+        lodFirstInstance.assign(numLods + 1, 0);
+    }
+
+    // Draws every instance in full detail
     inline void render() {
-        vertexBuffer->bind();
-        indexBuffer->bind();
-        glUniform3fv(diffuseLocation, 1, (float*)&material.material.diffuse.data);
-        glUniform3fv(specularLocation, 1, (float*)&material.material.specular.data);
-        glUniform3fv(emissiveLocation, 1, (float*)&material.material.emissive.data);
-        glUniform1f(shininessLocation, material.material.shininess);
-        GLCALL(glBindTexture(GL_TEXTURE_2D, material.diffuseMap));
-        GLCALL(glUniform1i(diffuseMapLocation, 0));
-        GLCALL(glActiveTexture(GL_TEXTURE1));
-        GLCALL(glBindTexture(GL_TEXTURE_2D, material.normalMap));
-        GLCALL(glActiveTexture(GL_TEXTURE0));
-        GLCALL(glUniform1i(normalMapLocation, 1));
-        GLCALL(glDrawElements(GL_TRIANGLES, numIndices, GL_UNSIGNED_INT, 0));
+        bindMaterial();
+        uint64 count = lods.empty() ? numIndices : lods[0].numIndices;
+        instanceBuffer->bind(0);
+        GLCALL(glDrawElementsInstancedBaseVertex(GL_TRIANGLES, count, indexType, (void*)geometry.indexOffset, numInstances, geometry.baseVertex));
+    }
+
+    // Clusters of the full detail level, see BMFMeshletRecord
+    void setMeshlets(const BMFMeshletRecord* meshlets, uint32 numMeshlets) {
+        this->meshlets.assign(meshlets, meshlets + numMeshlets);
+    }
+
+    const std::vector<BMFMeshletRecord>& getMeshlets() {
+        return meshlets;
+    }
+
+    // Draws every instance with the coarsest level of detail whose error covers at most
+    // maxPixelError pixels on screen. Instances are grouped by level, one instanced draw per level.
+    // Instances drawn in full detail skip the meshlets that are outside the view or face away.
+    void render(Camera& camera, const glm::mat4& model, float maxPixelError, MeshletStats& stats) {
+        if(lods.size() > 1) {
+            selectLods(camera.getView() * model, camera.getPixelsPerUnit(), maxPixelError);
+        }
+        bindMaterial();
+        if(lods.size() <= 1) {
+            drawLevel(0, lods.empty() ? numIndices : lods[0].numIndices, instances, 0, numInstances, camera, model, stats);
+            return;
+        }
+        for(uint64 i = 0; i < lods.size(); i++) {
+            uint32 count = lodFirstInstance[i + 1] - lodFirstInstance[i];
+            if(count > 0) {
+                drawLevel(i, lods[i].numIndices, lodInstances, lodFirstInstance[i], count, camera, model, stats);
+            }
+        }
     }
 private:
-    VertexBuffer* vertexBuffer;
-    IndexBuffer* indexBuffer;
+    void selectLods(const glm::mat4& modelView, float pixelsPerUnit, float maxPixelError) {
+        bool changed = false;
+        for(uint32 i = 0; i < numInstances; i++) {
+            uint32 lod = selectLod(modelView * instances[i].transform, pixelsPerUnit, maxPixelError);
+            changed = changed || lod != instanceLods[i];
+            instanceLods[i] = lod;
+        }
+        if(!changed) {
+            return;
+        }
+        // Counting sort of the instances by level, uploaded only when an instance switched
+        std::fill(lodFirstInstance.begin(), lodFirstInstance.end(), 0);
+        for(uint32 lod : instanceLods) {
+            lodFirstInstance[lod + 1]++;
+        }
+        for(uint64 i = 0; i < lods.size(); i++) {
+            lodFirstInstance[i + 1] += lodFirstInstance[i];
+        }
+        std::vector<uint32> fill(lodFirstInstance.begin(), lodFirstInstance.end() - 1);
+        for(uint32 i = 0; i < numInstances; i++) {
+            lodInstances[fill[instanceLods[i]]++] = instances[i];
+        }
+        instanceBuffer->update(lodInstances.data(), numInstances);
+    }
+
+    uint32 selectLod(const glm::mat4& modelView, float pixelsPerUnit, float maxPixelError) {
+        glm::vec3 center = glm::vec3(modelView * glm::vec4(boundsCenter, 1.0f));
+        // The largest axis scale keeps the estimate conservative for non uniform scales
+        float scale = glm::sqrt(glm::max(glm::dot(modelView[0], modelView[0]), glm::max(glm::dot(modelView[1], modelView[1]), glm::dot(modelView[2], modelView[2]))));
+        float distance = glm::length(center) - boundsRadius * scale;
+        if(distance <= 0.0f) {
+            return 0;
+        }
+        float pixelsPerModelUnit = pixelsPerUnit * scale / distance;
+        uint32 result = 0;
+        for(uint32 i = 1; i < lods.size() && lods[i].error * pixelsPerModelUnit <= maxPixelError; i++) {
+            result = i;
+        }
+        return result;
+    }
+
+    // Draws the instances [firstInstance, firstInstance + count) of sortedInstances, which is the
+    // order of the instance buffer, with the given level. The full detail level of a mesh with
+    // meshlets is culled and drawn instance by instance if there are at most MAX_CULLED_INSTANCES
+    // of them. With levels of detail those are the instances close to the camera, where most
+    // meshlets are usually culled. More instances are cheaper as one instanced draw.
+    void drawLevel(uint64 lod, uint64 levelIndices, const std::vector<Instance>& sortedInstances, uint32 firstInstance, uint32 count,
+        Camera& camera, const glm::mat4& model, MeshletStats& stats) {
+        uint64 indexSize = indexType == GL_UNSIGNED_SHORT ? sizeof(uint16) : sizeof(uint32);
+        uint64 firstIndex = lods.empty() ? 0 : lods[lod].firstIndex;
+        if(lod > 0 || meshlets.empty() || count > MAX_CULLED_INSTANCES) {
+            if(lod == 0 && !meshlets.empty()) {
+                stats.meshlets += meshlets.size() * count;
+                stats.triangles += levelIndices / 3 * count;
+            }
+            instanceBuffer->bind(firstInstance);
+            GLCALL(glDrawElementsInstancedBaseVertex(GL_TRIANGLES, levelIndices, indexType, (void*)(geometry.indexOffset + firstIndex * indexSize), count, geometry.baseVertex));
+            return;
+        }
+        for(uint32 i = firstInstance; i < firstInstance + count; i++) {
+            glm::mat4 instanceModel = model * sortedInstances[i].transform;
+            cullMeshlets(camera.getViewProj() * instanceModel, glm::inverse(camera.getView() * instanceModel), stats);
+            if(drawCounts.empty()) {
+                continue;
+            }
+            // Non instanced draws read the instance attributes of instance 0
+            instanceBuffer->bind(i);
+            drawBaseVertices.assign(drawCounts.size(), geometry.baseVertex);
+            GLCALL(glMultiDrawElementsBaseVertex(GL_TRIANGLES, drawCounts.data(), indexType, drawOffsets.data(), (GLsizei)drawCounts.size(), drawBaseVertices.data()));
+        }
+    }
+
+    // Fills drawCounts and drawOffsets with the index ranges of the visible meshlets. Adjacent
+    // visible meshlets are merged into one range.
+    void cullMeshlets(const glm::mat4& modelViewProj, const glm::mat4& inverseModelView, MeshletStats& stats) {
+        // Frustum planes in model space (Gribb and Hartmann), normalized so they give distances
+        glm::vec4 planes[6];
+        for(uint32 i = 0; i < 3; i++) {
+            glm::vec4 row = glm::vec4(modelViewProj[0][i], modelViewProj[1][i], modelViewProj[2][i], modelViewProj[3][i]);
+            glm::vec4 w = glm::vec4(modelViewProj[0][3], modelViewProj[1][3], modelViewProj[2][3], modelViewProj[3][3]);
+            planes[i * 2] = w + row;
+            planes[i * 2 + 1] = w - row;
+        }
+        for(glm::vec4& plane : planes) {
+            plane /= glm::length(glm::vec3(plane));
+        }
+        glm::vec3 cameraPosition = glm::vec3(inverseModelView[3]);
+        // Normal cones only survive transforms that keep angles, skip them for non uniform scales.
+        // Mirroring transforms flip the winding and with it the side the cones face.
+        float scaleX = glm::length(glm::vec3(inverseModelView[0]));
+        bool coneCulling = glm::abs(glm::length(glm::vec3(inverseModelView[1])) - scaleX) <= scaleX * 0.01f
+            && glm::abs(glm::length(glm::vec3(inverseModelView[2])) - scaleX) <= scaleX * 0.01f
+            && glm::determinant(glm::mat3(inverseModelView)) > 0.0f;
+
+        uint64 indexSize = indexType == GL_UNSIGNED_SHORT ? sizeof(uint16) : sizeof(uint32);
+        drawCounts.clear();
+        drawOffsets.clear();
+        uint64 rangeEnd = ~0ull;
+        for(const BMFMeshletRecord& meshlet : meshlets) {
+            glm::vec3 center = glm::vec3(meshlet.center[0], meshlet.center[1], meshlet.center[2]);
+            bool visible = true;
+            for(uint32 i = 0; i < 6 && visible; i++) {
+                visible = glm::dot(glm::vec3(planes[i]), center) + planes[i].w >= -meshlet.radius;
+            }
+            if(visible && coneCulling) {
+                glm::vec3 direction = center - cameraPosition;
+                glm::vec3 axis = glm::vec3(meshlet.coneAxis[0], meshlet.coneAxis[1], meshlet.coneAxis[2]);
+                visible = glm::dot(direction, axis) < meshlet.coneCutoff * glm::length(direction) + meshlet.radius;
+            }
+            if(!visible) {
+                stats.culledMeshlets++;
+                stats.culledTriangles += meshlet.numIndices / 3;
+                continue;
+            }
+            stats.meshlets++;
+            stats.triangles += meshlet.numIndices / 3;
+            if(meshlet.firstIndex == rangeEnd) {
+                drawCounts.back() += meshlet.numIndices;
+            } else {
+                drawCounts.push_back(meshlet.numIndices);
+                drawOffsets.push_back((const void*)(geometry.indexOffset + meshlet.firstIndex * indexSize));
+            }
+            rangeEnd = (uint64)meshlet.firstIndex + meshlet.numIndices;
+        }
+    }
+
+    void bindMaterial() {
+        // The material parameters are a range of the material buffer, the sampler uniforms only
+        // reach GL once per program
+        assert(materialBuffer);
+        GLState& state = GLState::get();
+        GeometryArena::get().bind(geometry);
+        materialBuffer->bind(UNIFORM_BINDING_MATERIAL, materialOffset, sizeof(MaterialBlock));
+        state.bindTexture(0, material.diffuseMap);
+        state.uniform1i(diffuseMapUniform.location, 0);
+        state.bindTexture(1, material.normalMap);
+        state.uniform1i(normalMapUniform.location, 1);
+    }
+
+    GeometryAllocation geometry;
+    InstanceBuffer* instanceBuffer;
     Shader* shader;
     Material material;
     uint64 numIndices = 0;
-    int diffuseLocation;
-    int specularLocation;
-    int emissiveLocation;
-    int shininessLocation;
-    int diffuseMapLocation;
-    int normalMapLocation;
+    uint32 numInstances = 0;
+    std::vector<Instance> instances;
+    std::vector<BMFLodRecord> lods;
+    glm::vec3 boundsCenter;
+    float boundsRadius = 0.0f;
+    // Level every instance was drawn with last, and the instances sorted by level
+    std::vector<uint32> instanceLods;
+    std::vector<Instance> lodInstances;
+    std::vector<uint32> lodFirstInstance;
+    std::vector<BMFMeshletRecord> meshlets;
+    // Index ranges of the visible meshlets, for glMultiDrawElementsBaseVertex
+    std::vector<GLsizei> drawCounts;
+    std::vector<const void*> drawOffsets;
+    std::vector<GLint> drawBaseVertices;
+    GLenum indexType;
+    MaterialBlock materialBlock;
+    UniformBuffer* materialBuffer = 0;
+    uint64 materialOffset = 0;
+    Uniform<int32> diffuseMapUniform;
+    Uniform<int32> normalMapUniform;
 };
 
+// A texture of a material. Either texture is an already cached texture that was acquired from the
+// TextureCache, or data holds the decoded image.
+struct MaterialTexture {
+    std::string key;
+    GLuint texture = 0;
+    // Texture stored in the bmf file, 0 if it is loaded from the file named by key
+    const BMFTextureRecord* embedded = 0;
+    TextureData data;
+};
+
+// CPU side of a material, produced by Model::decodeMaterials and consumed by Model::uploadMaterial
+struct MaterialData {
+    uint64 index = 0;
+    MaterialTexture diffuseMap;
+    MaterialTexture normalMap;
+};
+
+// CPU side of a mesh, produced by Model::decodeMesh and consumed by Model::uploadMesh. The vertex
+// and index pointers point either into the file mapping or into the storage vectors.
+struct MeshData {
+    uint64 index = 0;
+    uint32 meshFlags = 0;
+    const uint8* vertices = 0;
+    const uint8* indices = 0;
+    std::vector<uint8> vertexStorage;
+    std::vector<uint8> indexStorage;
+};
+
+class ModelLoader;
+
 class Model {
 public:
-    void init(const char* filename, Shader* shader) {
-        uint64 numMeshes = 0;
-        uint64 numMaterials = 0;
-        std::ifstream input = std::ifstream(filename, std::ios::in | std::ios::binary);
-        if(!input.is_open()) {
-            std::cout << "File not found" << std::endl;
+    // Opens a bmf file and loads all of its meshes. Blocks until everything is on the GPU, use
+    // ModelLoader to load a model in the background instead. Textures are decoded on pool if given.
+    void init(const char* filename, Shader* shader, ThreadPool* pool = 0) {
+        startTime = std::chrono::high_resolution_clock::now();
+        if(!open(filename, shader)) {
+            failed = true;
             return;
         }
+        // Textures of all materials are decoded up front, so a pool can decode them in parallel
+        decodeMaterials(getUsedMaterials(), materialScratch, pool);
+        for(const MaterialData& material : materialScratch) {
+            uploadMaterial(material);
+        }
+        for(uint64 i = 0; i < file.meshRecords.size(); i++) {
+            loadMesh(i);
+        }
+        printLoadTime(filename);
+    }
 
-        // Materials
-        input.read((char*)&numMaterials, sizeof(uint64));
-        for(uint64 i = 0; i < numMaterials; i++) {
-            Material material = {};
-            input.read((char*)&material, sizeof(BMFMaterial));
+    // Maps a bmf file and reads its table of contents. Nothing is uploaded yet, meshes and the
+    // materials they use are loaded on demand with loadMesh.
+    bool open(const char* filename, Shader* shader) {
+        this->shader = shader;
+        if(!file.open(filename)) {
+            return false;
+        }
+        opened.store(true, std::memory_order_release);
+        initTables();
+        return true;
+    }
 
-            uint64 diffuseMapNameLength = 0;
-            input.read((char*)&diffuseMapNameLength, sizeof(uint64));
-            std::string diffuseMapName(diffuseMapNameLength, '\0');
-            input.read((char*)&diffuseMapName[0], diffuseMapNameLength);
+    // 0 until the file is open. A ModelLoader opens it on a worker thread, the tables must not be
+    // read before that thread published them.
+    uint64 getNumMeshes() {
+        return opened.load(std::memory_order_acquire) ? file.meshRecords.size() : 0;
+    }
 
-            uint64 normalMapNameLength = 0;
-            input.read((char*)&normalMapNameLength, sizeof(uint64));
-            std::string normalMapName(normalMapNameLength, '\0');
-            input.read((char*)&normalMapName[0], normalMapNameLength);
+    const BMFBoundsRecord& getMeshBounds(uint64 index) {
+        assert(index < getNumMeshes());
+        return file.meshBounds[index];
+    }
 
-            assert(diffuseMapNameLength > 0);
-            assert(normalMapNameLength > 0);
+    bool isMeshLoaded(uint64 index) {
+        return index < meshes.size() && meshes[index] != 0;
+    }
 
-            int32 textureWidth = 0;
-            int32 textureHeight = 0;
-            int32 bitsPerPixel = 0;
-            GLCALL(glGenTextures(2, &material.diffuseMap));
-            stbi_set_flip_vertically_on_load(true);
-            {
-                auto textureBuffer = stbi_load(diffuseMapName.c_str(), &textureWidth, &textureHeight, &bitsPerPixel, 4);
-                assert(textureBuffer);
-                assert(material.diffuseMap);
+    // True once every mesh of the model is on the GPU
+    bool isReady() {
+        return ready;
+    }
 
-                GLCALL(glBindTexture(GL_TEXTURE_2D, material.diffuseMap));
+    bool hasFailed() {
+        return failed;
+    }
 
-                GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
-                GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
-                GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-                GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    // Uploads a single mesh and its material if that has not happened yet. GL thread only, for models
+    // opened with open(). Returns 0 while a ModelLoader is loading the model, its worker owns the file
+    // until the load finished.
+    Mesh* loadMesh(uint64 index) {
+        if(loading || index >= meshes.size()) {
+            return 0;
+        }
+        if(meshes[index]) {
+            return meshes[index];
+        }
+        const BMFMeshRecord& record = file.meshRecords[index];
+        if(!materialLoaded[record.materialIndex]) {
+            decodeMaterials(std::vector<uint64>(1, record.materialIndex), materialScratch, 0);
+            uploadMaterial(materialScratch[0]);
+        }
+        auto decodeStartTime = std::chrono::high_resolution_clock::now();
+        if(!decodeMesh(index, meshScratch)) {
+            return 0;
+        }
+        geometrySeconds += std::chrono::duration<float64>(std::chrono::high_resolution_clock::now() - decodeStartTime).count();
+        return uploadMesh(meshScratch);
+    }
 
-                GLCALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, textureWidth, textureHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, textureBuffer));
+    // Draws every mesh in full detail
+    void render() {
+        for(Mesh* mesh : meshes) {
+            if(mesh) {
+                mesh->render();
+            }
+        }
+    }
 
-                if(textureBuffer) {
-                    stbi_image_free(textureBuffer);
-                }
+    // Draws every mesh with the level of detail that fits its size on screen, and without the
+    // meshlets that can't be seen
+    void render(Camera& camera, const glm::mat4& model) {
+        float maxPixelError = exp2f(lodBias);
+        meshletStats = MeshletStats();
+        for(Mesh* mesh : meshes) {
+            if(mesh) {
+                mesh->render(camera, model, maxPixelError, meshletStats);
             }
+        }
+    }
 
-            {
-                auto textureBuffer = stbi_load(normalMapName.c_str(), &textureWidth, &textureHeight, &bitsPerPixel, 4);
-                assert(textureBuffer);
-                assert(material.normalMap);
+    // Meshlets drawn and culled by the last render(camera, model)
+    const MeshletStats& getMeshletStats() {
+        return meshletStats;
+    }
 
-                GLCALL(glBindTexture(GL_TEXTURE_2D, material.normalMap));
+    // A level of detail is used while its error covers at most 2^bias pixels on screen. Positive
+    // values switch to coarser levels earlier, negative ones keep the detail longer.
+    void setLodBias(float bias) {
+        lodBias = bias;
+    }
 
-                GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
-                GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
-                GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-                GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    ~Model() {
+        // Uploads queued by a ModelLoader still point to this model
+        assert(!loading);
+        for(Mesh* mesh : meshes) {
+            delete mesh;
+        }
+        delete materialBuffer;
+        for(uint64 i = 0; i < materials.size(); i++) {
+            if(materialLoaded[i]) {
+                TextureCache::get().release(materials[i].diffuseMap);
+                TextureCache::get().release(materials[i].normalMap);
+            }
+        }
+    }
 
-                GLCALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, textureWidth, textureHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, textureBuffer));
+private:
+    friend class ModelLoader;
 
-                if(textureBuffer) {
-                    stbi_image_free(textureBuffer);
-                }
+    void initTables() {
+        meshes.resize(file.meshRecords.size(), 0);
+        materials.resize(file.materialRecords.size());
+        materialLoaded.resize(file.materialRecords.size(), false);
+        ready = file.meshRecords.empty();
+        computeInstances();
+    }
+
+    // Collects the model space transform of every node that references a mesh. Files without
+    // nodes have their transforms baked into the vertices.
+    void computeInstances() {
+        meshInstances.assign(file.meshRecords.size(), std::vector<glm::mat4>());
+        if(file.nodeRecords.empty()) {
+            for(std::vector<glm::mat4>& instances : meshInstances) {
+                instances.push_back(glm::mat4(1.0f));
             }
+            return;
+        }
+        std::vector<glm::mat4> nodeTransforms(file.nodeRecords.size());
+        for(uint64 i = 0; i < file.nodeRecords.size(); i++) {
+            const BMFNodeRecord& node = file.nodeRecords[i];
+            glm::mat4 transform;
+            memcpy(&transform[0][0], node.transform, sizeof(node.transform));
+            nodeTransforms[i] = node.parent == BMF_NO_PARENT ? transform : nodeTransforms[node.parent] * transform;
+            for(uint32 j = 0; j < node.numMeshes; j++) {
+                meshInstances[file.nodeMeshes[node.firstMesh + j]].push_back(nodeTransforms[i]);
+            }
+        }
+    }
+
+    void printLoadTime(const char* filename) {
+        float64 totalSeconds = std::chrono::duration<float64>(std::chrono::high_resolution_clock::now() - startTime).count();
+        float64 meshMegabytes = (float64)loadedGeometryBytes / (1024.0 * 1024.0);
+        std::cout << "Loaded " << filename << " in " << totalSeconds * 1000.0 << " ms, geometry "
+            << meshMegabytes << " MB in " << geometrySeconds * 1000.0 << " ms ("
+            << (geometrySeconds > 0.0 ? meshMegabytes / geometrySeconds : 0.0) << " MB/s), "
+            << uploadSeconds * 1000.0 << " ms on the render thread" << std::endl;
+    }
+
+    // The decode functions only read the file and don't touch GL, so they can run on any thread
 
-            GLCALL(glBindTexture(GL_TEXTURE_2D, 0));
-            materials.push_back(material);
+    // Looks the texture up in the TextureCache. Returns false if it still has to be decoded.
+    bool acquireTexture(const BMFBlobRange& name, uint32 embeddedTexture, bool normalMap, MaterialTexture& texture) {
+        texture.embedded = 0;
+        if(!embeddedTexture && name.size == 0) {
+            // The material has no such map
+            texture.key = normalMap ? "fallback:normal" : "fallback:diffuse";
+        } else if(embeddedTexture) {
+            texture.embedded = &file.textureRecords[embeddedTexture - 1];
+            char key[32];
+            snprintf(key, sizeof(key), "embedded:%016llx", (unsigned long long)texture.embedded->hash);
+            texture.key = key;
+        } else {
+            texture.key = TextureCache::getKey(file.getString(name));
         }
+        texture.texture = TextureCache::get().acquire(texture.key);
+        texture.data = TextureData();
+        return texture.texture != 0;
+    }
 
-        // Meshes
-        input.read((char*)&numMeshes, sizeof(uint64));
-        
-        for(uint64 i = 0; i < numMeshes; i++) {
-            std::vector<Vertex> vertices;
-            uint64 numVertices = 0;
-            std::vector<uint32> indices;
-            uint64 numIndices = 0;
-            uint64 materialIndex = 0;
+    bool decodeTexture(MaterialTexture& materialTexture) {
+        TextureData& texture = materialTexture.data;
+        const BMFTextureRecord* embedded = materialTexture.embedded;
+        if(embedded && embedded->format >= BMF_TEXTURE_RGBA8 && embedded->format <= BMF_TEXTURE_RG8) {
+            // Already in the final layout with all mips, uploaded straight from the mapping
+            texture.width = embedded->width;
+            texture.height = embedded->height;
+            texture.format = embedded->format;
+            texture.numMips = embedded->numMips > 0 ? embedded->numMips : 1;
+            texture.pixels = file.getData(embedded->data);
+            texture.size = BMFFile::getTextureSize(*embedded);
+            return true;
+        }
+        if(embedded && embedded->format != BMF_TEXTURE_ENCODED) {
+            std::cout << "Unknown texture format " << embedded->format << std::endl;
+            return false;
+        }
 
-            input.read((char*)&materialIndex, sizeof(uint64));
-            input.read((char*)&numVertices, sizeof(uint64));
-            input.read((char*)&numIndices, sizeof(uint64));
+        int32 bitsPerPixel = 0;
+        uint8* textureBuffer = embedded
+            ? stbi_load_from_memory(file.getData(embedded->data), (int)embedded->data.size, &texture.width, &texture.height, &bitsPerPixel, 4)
+            : stbi_load(materialTexture.key.c_str(), &texture.width, &texture.height, &bitsPerPixel, 4);
+        if(!textureBuffer) {
+            std::cout << "Could not load texture " << materialTexture.key << std::endl;
+            return false;
+        }
 
-            for(uint64 i = 0; i < numVertices; i++) {
-                Vertex vertex;
-                input.read((char*)&vertex.position.x, sizeof(float));
-                input.read((char*)&vertex.position.y, sizeof(float));
-                input.read((char*)&vertex.position.z, sizeof(float));
-                input.read((char*)&vertex.normal.x, sizeof(float));
-                input.read((char*)&vertex.normal.y, sizeof(float));
-                input.read((char*)&vertex.normal.z, sizeof(float));
-                input.read((char*)&vertex.tangent.x, sizeof(float));
-                input.read((char*)&vertex.tangent.y, sizeof(float));
-                input.read((char*)&vertex.tangent.z, sizeof(float));
-                input.read((char*)&vertex.textureCoord.x, sizeof(float));
-                input.read((char*)&vertex.textureCoord.y, sizeof(float));
-                vertices.push_back(vertex);
+        // Flipped here instead of with stbi_set_flip_vertically_on_load, which is global state
+        uint64 rowSize = (uint64)texture.width * 4;
+        texture.storage.resize(rowSize * texture.height);
+        for(int32 y = 0; y < texture.height; y++) {
+            memcpy(texture.storage.data() + y * rowSize, textureBuffer + (texture.height - 1 - y) * rowSize, rowSize);
+        }
+        texture.pixels = texture.storage.data();
+        texture.size = texture.storage.size();
+        stbi_image_free(textureBuffer);
+        return true;
+    }
+
+    // White for diffuse maps, a flat normal for normal maps
+    static void setFallbackTexture(TextureData& texture, bool normalMap) {
+        texture = TextureData();
+        texture.width = 1;
+        texture.height = 1;
+        if(normalMap) {
+            texture.storage = {128, 128, 255, 255};
+        } else {
+            texture.storage = {255, 255, 255, 255};
+        }
+        texture.pixels = texture.storage.data();
+        texture.size = texture.storage.size();
+    }
+
+    // Materials in the order the meshes first use them
+    std::vector<uint64> getUsedMaterials() {
+        std::vector<uint64> result;
+        std::vector<bool> used(file.materialRecords.size(), false);
+        for(const BMFMeshRecord& record : file.meshRecords) {
+            if(!used[record.materialIndex]) {
+                used[record.materialIndex] = true;
+                result.push_back(record.materialIndex);
+            }
+        }
+        return result;
+    }
+
+    // Collects the textures of all given materials first and then decodes them, on the threads of
+    // pool if there is one. An image that several materials use is decoded once; the other
+    // materials get its texture from the TextureCache when the first one is uploaded, so the
+    // results must be uploaded in order.
+    void decodeMaterials(const std::vector<uint64>& indices, std::vector<MaterialData>& result, ThreadPool* pool) {
+        result.resize(indices.size());
+        std::vector<MaterialTexture*> pending;
+        std::vector<bool> pendingNormalMaps;
+        std::unordered_set<std::string> pendingKeys;
+        for(uint64 i = 0; i < indices.size(); i++) {
+            MaterialData& data = result[i];
+            data.index = indices[i];
+            const BMFMaterialRecord& record = file.materialRecords[data.index];
+            if(!acquireTexture(record.diffuseMapName, record.diffuseMapTexture, false, data.diffuseMap) && pendingKeys.insert(data.diffuseMap.key).second) {
+                pending.push_back(&data.diffuseMap);
+                pendingNormalMaps.push_back(false);
             }
-            for(uint64 i = 0; i < numIndices; i++) {
-                uint32 index;
-                input.read((char*)&index, sizeof(uint32));
-                indices.push_back(index);
+            if(!acquireTexture(record.normalMapName, record.normalMapTexture, true, data.normalMap) && pendingKeys.insert(data.normalMap.key).second) {
+                pending.push_back(&data.normalMap);
+                pendingNormalMaps.push_back(true);
             }
+        }
 
-            Mesh* mesh = new Mesh(vertices, numVertices, indices, numIndices, materials[materialIndex], shader);
-            meshes.push_back(mesh);
+        // A texture that is missing or can't be decoded is replaced by a 1x1 texture that leaves
+        // the material unchanged, instead of uploading an empty image
+        auto decode = [this, &pending, &pendingNormalMaps](uint64 i) {
+            bool missing = !pending[i]->embedded && pending[i]->key.compare(0, 9, "fallback:") == 0;
+            if(missing || !decodeTexture(*pending[i])) {
+                setFallbackTexture(pending[i]->data, pendingNormalMaps[i]);
+            }
+        };
+        if(pool) {
+            pool->parallelFor(pending.size(), decode);
+        } else {
+            for(uint64 i = 0; i < pending.size(); i++) {
+                decode(i);
+            }
         }
     }
 
-    void render() {
-        for(Mesh* mesh : meshes) {
-            mesh->render();
+    bool decodeMesh(uint64 index, MeshData& data) {
+        const BMFMeshRecord& record = file.meshRecords[index];
+        data.index = index;
+        data.meshFlags = record.flags;
+
+        // Uncompressed vertex and index data is stored tightly packed, so it is handed to GL straight from the mapping
+        if(!file.getMeshData(index, data.vertexStorage, data.indexStorage, &data.vertices, &data.indices)) {
+            std::cout << "Could not decode mesh " << index << std::endl;
+            return false;
         }
+
+        // 32 bit indices that are not needed (v1 files or older exports) are narrowed before the upload
+        if(!(data.meshFlags & BMF_MESH_INDEX16) && record.numVertices <= 65536) {
+            const uint8* wideIndices = data.indices;
+            if(wideIndices != data.indexStorage.data()) {
+                data.indexStorage.resize(record.numIndices * sizeof(uint16));
+            }
+            // Narrowing in place works because every index is read before its slot is overwritten
+            uint16* narrowIndices = (uint16*)data.indexStorage.data();
+            for(uint64 i = 0; i < record.numIndices; i++) {
+                uint32 wideIndex;
+                memcpy(&wideIndex, wideIndices + i * sizeof(uint32), sizeof(uint32));
+                narrowIndices[i] = (uint16)wideIndex;
+            }
+            data.indices = data.indexStorage.data();
+            data.meshFlags |= BMF_MESH_INDEX16;
+        }
+        return true;
     }
 
-    ~Model() {
-        for(Mesh* mesh : meshes) {
-            delete mesh;
+    // The upload functions have to run on the GL thread
+
+    GLuint uploadTexture(const MaterialTexture& texture) {
+        if(texture.texture) {
+            return texture.texture;
         }
+        return TextureCache::get().insert(texture.key, texture.data);
     }
-private:
+
+    void uploadMaterial(const MaterialData& data) {
+        auto uploadStartTime = std::chrono::high_resolution_clock::now();
+        const BMFMaterialRecord& record = file.materialRecords[data.index];
+        Material& material = materials[data.index];
+        material = {};
+        material.material.diffuse = glm::vec3(record.diffuse[0], record.diffuse[1], record.diffuse[2]);
+        material.material.specular = glm::vec3(record.specular[0], record.specular[1], record.specular[2]);
+        material.material.emissive = glm::vec3(record.emissive[0], record.emissive[1], record.emissive[2]);
+        material.material.shininess = record.shininess;
+        material.specularChannel = record.specularChannel;
+
+        material.diffuseMap = uploadTexture(data.diffuseMap);
+        material.normalMap = uploadTexture(data.normalMap);
+
+        materialLoaded[data.index] = true;
+        uploadSeconds += std::chrono::duration<float64>(std::chrono::high_resolution_clock::now() - uploadStartTime).count();
+    }
+
+    Mesh* uploadMesh(const MeshData& data) {
+        auto uploadStartTime = std::chrono::high_resolution_clock::now();
+        const BMFMeshRecord& record = file.meshRecords[data.index];
+        assert(materialLoaded[record.materialIndex]);
+        // A second upload would leak the first mesh and count it twice towards releasing the file
+        assert(!meshes[data.index]);
+
+        const BMFBoundsRecord& bounds = file.meshBounds[data.index];
+        glm::vec3 boundsMin = glm::vec3(bounds.min[0], bounds.min[1], bounds.min[2]);
+        glm::vec3 boundsMax = glm::vec3(bounds.max[0], bounds.max[1], bounds.max[2]);
+        bool quantized = (record.flags & BMF_MESH_QUANTIZED_VERTICES) != 0;
+
+        Mesh* mesh = new Mesh(data.vertices, record.numVertices, data.indices, record.numIndices, materials[record.materialIndex], shader,
+            data.meshFlags, quantized ? boundsMin : glm::vec3(0.0f), quantized ? boundsMax - boundsMin : glm::vec3(1.0f),
+            meshInstances[data.index]);
+        // One MaterialBlock per mesh, so every draw binds its own range
+        uint64 materialStride = UniformBuffer::getStride(sizeof(MaterialBlock));
+        if(!materialBuffer) {
+            materialBuffer = new UniformBuffer(file.meshRecords.size() * materialStride);
+        }
+        mesh->setMaterialBuffer(materialBuffer, data.index * materialStride);
+        if(record.numLods > 0) {
+            mesh->setLods(&file.lodRecords[record.firstLod], record.numLods, (boundsMin + boundsMax) * 0.5f, glm::length(boundsMax - boundsMin) * 0.5f);
+        }
+        if(record.numMeshlets > 0) {
+            mesh->setMeshlets(&file.meshletRecords[record.firstMeshlet], record.numMeshlets);
+        }
+        meshes[data.index] = mesh;
+
+        loadedGeometryBytes += record.vertices.size + record.indices.size;
+        float64 seconds = std::chrono::duration<float64>(std::chrono::high_resolution_clock::now() - uploadStartTime).count();
+        geometrySeconds += seconds;
+        uploadSeconds += seconds;
+
+        // The mapping is not needed anymore once everything lives on the GPU
+        if(++numLoadedMeshes == file.meshRecords.size()) {
+            file.releaseData();
+            meshScratch = MeshData();
+            materialScratch = std::vector<MaterialData>();
+            ready = true;
+        }
+        return mesh;
+    }
+
+    Shader* shader = 0;
+    BMFFile file;
+    MeshData meshScratch;
+    std::vector<MaterialData> materialScratch;
     std::vector<Mesh*> meshes;
+    UniformBuffer* materialBuffer = 0;
+    std::vector<std::vector<glm::mat4>> meshInstances;
     std::vector<Material> materials;
-};
\ No newline at end of file
+    std::vector<bool> materialLoaded;
+    uint64 numLoadedMeshes = 0;
+    uint64 loadedGeometryBytes = 0;
+    float64 geometrySeconds = 0.0;
+    float64 uploadSeconds = 0.0;
+    std::chrono::high_resolution_clock::time_point startTime;
+    float lodBias = 0.0f;
+    MeshletStats meshletStats;
+    bool ready = false;
+    bool failed = false;
+    bool loading = false;
+    // Set once the file and its tables are open, by whichever thread opened it
+    std::atomic<bool> opened{false};
+};
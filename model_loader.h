@@ -0,0 +1,157 @@
+#pragma once
+#include <string>
+#include <functional>
+
+#include "mesh.h"
+#include "thread_pool.h"
+#include "mpsc_queue.h"
+
+// One step of an asynchronous model load, sent from a loader thread to the GL thread
+struct ModelUpload {
+    enum Type {
+        OPENED,
+        MATERIAL,
+        MESH,
+        FINISHED,
+        FAILED,
+    };
+
+    Type type = FINISHED;
+    Model* model = 0;
+    // Bytes that go to the GPU, used for the per frame upload budget
+    uint64 size = 0;
+    MaterialData material;
+    MeshData mesh;
+    std::string filename;
+    std::function<void(Model*)> onFinished;
+};
+
+// Loads models in the background. File reading, mesh decoding and image decoding happen on worker
+// threads, the decoded data is handed to the GL thread through a lock-free queue and uploaded by
+// processUploads, which the render loop calls once per frame.
+class ModelLoader {
+public:
+    // At least one thread, the loads are submitted as jobs
+    ModelLoader(uint32 numThreads = ThreadPool::HARDWARE_THREADS) : pool(numThreads) {
+        assert(pool.getNumThreads() > 0);
+    }
+
+    // Pending uploads are dropped. Models that were still loading keep what has been uploaded so far.
+    ~ModelLoader() {
+        pool.waitIdle();
+        ModelUpload upload;
+        while(uploads.pop(upload)) {
+            if(upload.type == ModelUpload::FINISHED || upload.type == ModelUpload::FAILED) {
+                upload.model->loading = false;
+            }
+            // Drop the references the loader thread took on already cached textures
+            if(upload.type == ModelUpload::MATERIAL) {
+                TextureCache::get().release(upload.material.diffuseMap.texture);
+                TextureCache::get().release(upload.material.normalMap.texture);
+            }
+        }
+    }
+
+    // Starts loading a model. Must be called on the GL thread. The model renders whatever has been
+    // uploaded so far and must stay alive until it is ready or has failed. onFinished is called on
+    // the GL thread in both cases.
+    void load(Model* model, const char* filename, Shader* shader, std::function<void(Model*)> onFinished = nullptr) {
+        assert(!model->loading);
+        model->shader = shader;
+        model->startTime = std::chrono::high_resolution_clock::now();
+        model->loading = true;
+        model->opened = false;
+        std::string name = filename;
+        pool.submit([this, model, name, onFinished] {
+            decodeModel(model, name, onFinished);
+        });
+    }
+
+    // Uploads queued data until about byteBudget bytes went to the GPU. Returns the number of bytes
+    // uploaded.
+    uint64 processUploads(uint64 byteBudget = 8 << 20) {
+        uint64 uploadedBytes = 0;
+        ModelUpload upload;
+        while(uploadedBytes < byteBudget && uploads.pop(upload)) {
+            Model* model = upload.model;
+            switch(upload.type) {
+                case ModelUpload::OPENED:
+                model->initTables();
+                break;
+                case ModelUpload::MATERIAL:
+                model->uploadMaterial(upload.material);
+                break;
+                case ModelUpload::MESH:
+                model->uploadMesh(upload.mesh);
+                break;
+                case ModelUpload::FINISHED:
+                model->loading = false;
+                model->printLoadTime(upload.filename.c_str());
+                break;
+                case ModelUpload::FAILED:
+                std::cout << "Could not load " << upload.filename << std::endl;
+                model->loading = false;
+                model->failed = true;
+                break;
+            }
+            if((upload.type == ModelUpload::FINISHED || upload.type == ModelUpload::FAILED) && upload.onFinished) {
+                upload.onFinished(model);
+            }
+            uploadedBytes += upload.size;
+        }
+        return uploadedBytes;
+    }
+
+private:
+    // Runs on a worker thread. Only the bmf file and the decode functions of the model are touched
+    // here, everything else belongs to the GL thread.
+    void decodeModel(Model* model, const std::string& filename, const std::function<void(Model*)>& onFinished) {
+        BMFFile& file = model->file;
+        if(!file.open(filename.c_str())) {
+            push(ModelUpload::FAILED, model, filename, onFinished);
+            return;
+        }
+        model->opened.store(true, std::memory_order_release);
+        push(ModelUpload::OPENED, model, filename, onFinished);
+
+        // Textures are decoded in parallel on the pool, this thread included
+        std::vector<MaterialData> materials;
+        model->decodeMaterials(model->getUsedMaterials(), materials, &pool);
+        for(MaterialData& material : materials) {
+            ModelUpload upload;
+            upload.type = ModelUpload::MATERIAL;
+            upload.model = model;
+            upload.size = material.diffuseMap.data.size + material.normalMap.data.size;
+            upload.material = std::move(material);
+            uploads.push(std::move(upload));
+        }
+
+        for(uint64 i = 0; i < file.meshRecords.size(); i++) {
+            const BMFMeshRecord& record = file.meshRecords[i];
+            ModelUpload upload;
+            upload.type = ModelUpload::MESH;
+            upload.model = model;
+            upload.size = record.numVertices * bmfVertexSize(record.flags) + record.numIndices * bmfIndexSize(record.flags);
+            if(!model->decodeMesh(i, upload.mesh)) {
+                push(ModelUpload::FAILED, model, filename, onFinished);
+                return;
+            }
+            // The last mesh upload releases the file mapping, its data must not be read after this
+            uploads.push(std::move(upload));
+        }
+        push(ModelUpload::FINISHED, model, filename, onFinished);
+    }
+
+    void push(ModelUpload::Type type, Model* model, const std::string& filename, const std::function<void(Model*)>& onFinished) {
+        ModelUpload upload;
+        upload.type = type;
+        upload.model = model;
+        upload.filename = filename;
+        upload.onFinished = onFinished;
+        uploads.push(std::move(upload));
+    }
+
+    // Declared before the pool, so the workers are joined before the queue goes away
+    MPSCQueue<ModelUpload> uploads;
+    ThreadPool pool;
+};
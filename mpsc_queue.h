@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free queue with any number of producers and a single consumer. Pushing never
+// blocks and items from one producer are popped in the order they were pushed. The consumer keeps
+// one already popped node around as the list head, so T must be default constructible.
+template<typename T>
+struct MPSCQueue {
+    MPSCQueue() {
+        Node* stub = new Node();
+        head.store(stub, std::memory_order_relaxed);
+        tail = stub;
+    }
+
+    MPSCQueue(const MPSCQueue&) = delete;
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+    ~MPSCQueue() {
+        T value;
+        while(pop(value)) {
+        }
+        delete tail;
+    }
+
+    // Can be called from any thread
+    void push(T&& value) {
+        Node* node = new Node();
+        node->value = std::move(value);
+        Node* previous = head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // Only called from the consumer thread. Returns false if the queue is empty, or if a producer
+    // is in the middle of a push; that item shows up on the next call.
+    bool pop(T& value) {
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if(!next) {
+            return false;
+        }
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node*> next{0};
+        T value;
+    };
+
+    std::atomic<Node*> head;
+    Node* tail;
+};
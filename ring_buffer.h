@@ -0,0 +1,167 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <GL/glew.h>
+
+#include "defines.h"
+#include "gl_state.h"
+
+// Range of a RingBuffer that is valid until the end of the frame. data is 0 if the frame ran out of
+// space, the caller has to skip or fall back then.
+struct RingAllocation {
+    uint8* data = 0;
+    GLuint buffer = 0;
+    uint64 offset = 0;
+    uint64 size = 0;
+};
+
+struct RingBufferStats {
+    // Frames that had to wait for the GPU before their part of the buffer could be reused
+    uint64 stalls = 0;
+    // Allocations that did not fit, the buffer grows at the start of the next frame
+    uint64 overflows = 0;
+    // Bytes allocated in the last frame
+    uint64 frameBytes = 0;
+    uint64 frameSize = 0;
+};
+
+// Buffer for data that only lives for one frame (uniform blocks, dynamic vertices), written directly
+// into a persistently mapped buffer instead of with glBufferSubData. The buffer is split into
+// NUM_FRAMES parts used round robin, and a fence per part makes sure the GPU is done with a part
+// before the CPU writes it again. The same buffer can be bound to any target by range.
+//
+// Without GL_ARB_buffer_storage, allocations are written to CPU memory and uploaded by flush().
+// GL thread only.
+class RingBuffer {
+public:
+    static const uint32 NUM_FRAMES = 3;
+
+    RingBuffer(uint64 frameSize) {
+        create(frameSize);
+    }
+
+    virtual ~RingBuffer() {
+        destroy();
+    }
+
+    // Waits until the GPU has finished the frame that used this part of the buffer NUM_FRAMES
+    // frames ago, and grows the buffer if the last frame overflowed
+    void beginFrame() {
+        if(requiredSize > frameSize) {
+            uint64 size = frameSize * 2;
+            while(size < requiredSize) {
+                size *= 2;
+            }
+            destroy();
+            create(size);
+            std::cout << "Ring buffer grown to " << NUM_FRAMES << " x " << size / 1024 << " KB" << std::endl;
+        }
+        requiredSize = 0;
+        if(fences[frame]) {
+            if(glClientWaitSync(fences[frame], 0, 0) == GL_TIMEOUT_EXPIRED) {
+                stats.stalls++;
+                while(glClientWaitSync(fences[frame], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+            }
+            glDeleteSync(fences[frame]);
+            fences[frame] = 0;
+        }
+        head = frame * frameSize;
+    }
+
+    // Returns size bytes at an offset that is a multiple of alignment (a power of two)
+    RingAllocation allocate(uint64 size, uint64 alignment = 16) {
+        RingAllocation result;
+        uint64 offset = (head + alignment - 1) & ~(alignment - 1);
+        uint64 used = offset + size - frame * frameSize;
+        if(used > frameSize) {
+            stats.overflows++;
+            requiredSize = std::max(requiredSize, used);
+            return result;
+        }
+        head = offset + size;
+        result.data = (mapped ? mapped : staging.data()) + offset;
+        result.buffer = bufferId;
+        result.offset = offset;
+        result.size = size;
+        return result;
+    }
+
+    // Makes the written allocation visible to GL. Only uploads anything without persistent mapping.
+    void flush(const RingAllocation& allocation) {
+        if(!mapped && allocation.data) {
+            GLState::get().bindBuffer(GL_COPY_WRITE_BUFFER, bufferId);
+            glBufferSubData(GL_COPY_WRITE_BUFFER, allocation.offset, allocation.size, allocation.data);
+        }
+    }
+
+    // Fences the commands that read this frame's part of the buffer. Call after the last draw.
+    void endFrame() {
+        fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        stats.frameBytes = head - frame * frameSize;
+        frame = (frame + 1) % NUM_FRAMES;
+    }
+
+    GLuint getBufferId() {
+        return bufferId;
+    }
+
+    // Changes whenever the buffer is replaced. Vertex arrays that point into the buffer have to be
+    // updated then, the new buffer may even have the old name.
+    uint32 getGeneration() {
+        return generation;
+    }
+
+    const RingBufferStats& getStats() {
+        return stats;
+    }
+
+private:
+    void create(uint64 frameSize) {
+        // Parts start at offsets that any binding alignment divides
+        this->frameSize = (frameSize + 255) & ~(uint64)255;
+        stats.frameSize = this->frameSize;
+        generation++;
+        uint64 size = this->frameSize * NUM_FRAMES;
+        glGenBuffers(1, &bufferId);
+        GLState::get().bindBuffer(GL_COPY_WRITE_BUFFER, bufferId);
+        if(GLEW_ARB_buffer_storage || GLEW_VERSION_4_4) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_COPY_WRITE_BUFFER, size, 0, flags);
+            mapped = (uint8*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags);
+        } else {
+            glBufferData(GL_COPY_WRITE_BUFFER, size, 0, GL_STREAM_DRAW);
+            staging.resize(size);
+        }
+    }
+
+    // Waits for every frame in flight, the buffer may still be read
+    void destroy() {
+        for(GLsync& fence : fences) {
+            if(fence) {
+                while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+                glDeleteSync(fence);
+                fence = 0;
+            }
+        }
+        if(mapped) {
+            GLState::get().bindBuffer(GL_COPY_WRITE_BUFFER, bufferId);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            mapped = 0;
+        }
+        GLState::get().deleteBuffer(bufferId);
+        staging = std::vector<uint8>();
+    }
+
+    GLuint bufferId = 0;
+    uint8* mapped = 0;
+    std::vector<uint8> staging;
+    GLsync fences[NUM_FRAMES] = {};
+    uint64 frameSize = 0;
+    uint32 generation = 0;
+    uint32 frame = 0;
+    uint64 head = 0;
+    // Largest size a part needed in the current frame
+    uint64 requiredSize = 0;
+    RingBufferStats stats;
+};
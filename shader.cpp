@@ -1,21 +1,25 @@
 #include "shader.h"
+#include "uniform_buffer.h"
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <cassert>
 
 Shader::Shader(const char* vertexShaderFilename, const char* fragmentShaderFilename) {
     shaderId = createShader(vertexShaderFilename, fragmentShaderFilename);
+    reflect();
 }
 
 Shader::~Shader() {
-    glDeleteProgram(shaderId);
+    GLState::get().deleteProgram(shaderId);
 }
 
 void Shader::bind() {
-    glUseProgram(shaderId);
+    GLState::get().useProgram(shaderId);
 }
 
 void Shader::unbind() {
-    glUseProgram(0);
+    GLState::get().useProgram(0);
 }
 
 
@@ -87,4 +91,80 @@ GLuint Shader::createShader(const char* vertexShaderFilename, const char* fragme
     #endif
 
     return program;
-}
\ No newline at end of file
+}
+
+// Builds the uniform table from the active uniforms and uniform blocks of the linked program, and
+// binds the blocks every program shares to their UniformBinding
+void Shader::reflect() {
+    GLint numUniforms = 0;
+    GLint numBlocks = 0;
+    GLint maxNameLength = 0;
+    GLint maxBlockNameLength = 0;
+    glGetProgramiv(shaderId, GL_ACTIVE_UNIFORMS, &numUniforms);
+    glGetProgramiv(shaderId, GL_ACTIVE_UNIFORM_BLOCKS, &numBlocks);
+    glGetProgramiv(shaderId, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+    glGetProgramiv(shaderId, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxBlockNameLength);
+
+    uint32 capacity = 16;
+    while(capacity < (uint32)(numUniforms + numBlocks) * 2) {
+        capacity *= 2;
+    }
+    uniforms.assign(capacity, ShaderUniform());
+
+    std::vector<char> name(std::max(std::max(maxNameLength, maxBlockNameLength), 1));
+    for(GLint i = 0; i < numUniforms; i++) {
+        GLsizei length = 0;
+        GLint size = 0;
+        ShaderUniform uniform;
+        glGetActiveUniform(shaderId, i, (GLsizei)name.size(), &length, &size, &uniform.type, name.data());
+        uniform.name.assign(name.data(), length);
+        // Members of uniform blocks have no location and are set through the buffer
+        uniform.location = glGetUniformLocation(shaderId, uniform.name.c_str());
+        if(uniform.location < 0) {
+            continue;
+        }
+        if(uniform.name.size() > 3 && uniform.name.compare(uniform.name.size() - 3, 3, "[0]") == 0) {
+            uniform.name.resize(uniform.name.size() - 3);
+        }
+        uniform.hash = uniformHash(uniform.name.c_str());
+        insert(uniform);
+    }
+    for(GLint i = 0; i < numBlocks; i++) {
+        GLsizei length = 0;
+        ShaderUniform uniform;
+        glGetActiveUniformBlockName(shaderId, i, (GLsizei)name.size(), &length, name.data());
+        uniform.name.assign(name.data(), length);
+        uniform.type = GL_UNIFORM_BLOCK;
+        uniform.location = i;
+        uniform.hash = uniformHash(uniform.name.c_str());
+        insert(uniform);
+        switch(uniform.hash) {
+            case uniformHash("Camera"):
+            glUniformBlockBinding(shaderId, i, UNIFORM_BINDING_CAMERA);
+            break;
+            case uniformHash("Lights"):
+            glUniformBlockBinding(shaderId, i, UNIFORM_BINDING_LIGHTS);
+            break;
+            case uniformHash("Material"):
+            glUniformBlockBinding(shaderId, i, UNIFORM_BINDING_MATERIAL);
+            break;
+        }
+    }
+}
+
+void Shader::insert(const ShaderUniform& uniform) {
+    uint32 mask = (uint32)uniforms.size() - 1;
+    uint32 i = uniform.hash & mask;
+    for(; uniforms[i].type != 0; i = (i + 1) & mask) {
+        if(uniforms[i].hash == uniform.hash) {
+            // Keeping either one would hand its location to the lookups of the other. Both stay
+            // unset instead, which GL ignores, and debug builds stop here.
+            std::cout << "Uniforms " << uniforms[i].name << " and " << uniform.name << " have the same hash" << std::endl;
+            assert(!"Uniform names with the same hash");
+            uniforms[i].location = -1;
+            uniforms[i].name += " / " + uniform.name;
+            return;
+        }
+    }
+    uniforms[i] = uniform;
+}
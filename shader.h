@@ -1,7 +1,46 @@
 #pragma once
 #include <GL/glew.h>
 #include <string>
+#include <vector>
+#include <iostream>
 #include "defines.h"
+#include "gl_state.h"
+
+// 32 bit FNV-1a of a uniform name. constexpr, so handles can be looked up with hashes the compiler
+// computed instead of strings.
+constexpr uint32 uniformHash(const char* name, uint32 hash = 0x811c9dc5) {
+    return *name ? uniformHash(name + 1, (hash ^ (uint8)*name) * 0x01000193) : hash;
+}
+
+// GL types a uniform handle of type T can point at
+template<typename T> struct UniformType;
+template<> struct UniformType<int32> {
+    static bool matches(GLenum type) {
+        return type == GL_INT || type == GL_BOOL || type == GL_SAMPLER_2D;
+    }
+};
+template<> struct UniformType<float> {
+    static bool matches(GLenum type) {
+        return type == GL_FLOAT;
+    }
+};
+template<> struct UniformType<glm::vec3> {
+    static bool matches(GLenum type) {
+        return type == GL_FLOAT_VEC3;
+    }
+};
+template<> struct UniformType<glm::mat4> {
+    static bool matches(GLenum type) {
+        return type == GL_FLOAT_MAT4;
+    }
+};
+
+// Location of a uniform of type T. Uniforms the program does not use have a location of -1, which
+// GL ignores like it does for glGetUniformLocation.
+template<typename T>
+struct Uniform {
+    GLint location = -1;
+};
 
 struct Shader {
     Shader(const char* vertexShaderFilename, const char* fragmentShaderFilename);
@@ -14,11 +53,58 @@ struct Shader {
         return shaderId;
     }
 
+    // Looks up an active uniform by uniformHash of its name, without calling GL. Members of struct
+    // uniforms are named like "u_material.diffuse", arrays by their name without "[0]".
+    template<typename T>
+    Uniform<T> getUniform(uint32 nameHash) {
+        Uniform<T> result;
+        const ShaderUniform* uniform = find(nameHash);
+        if(uniform && uniform->type != GL_UNIFORM_BLOCK) {
+            if(UniformType<T>::matches(uniform->type)) {
+                result.location = uniform->location;
+            } else {
+                std::cout << "Uniform " << uniform->name << " is used with the wrong type" << std::endl;
+            }
+        }
+        return result;
+    }
+
+    // Index of an active uniform block, GL_INVALID_INDEX if the program has none of that name
+    GLuint getUniformBlock(uint32 nameHash) {
+        const ShaderUniform* uniform = find(nameHash);
+        return uniform && uniform->type == GL_UNIFORM_BLOCK ? (GLuint)uniform->location : GL_INVALID_INDEX;
+    }
+
 private:
+    // Active uniform or uniform block (type GL_UNIFORM_BLOCK, location is the block index)
+    struct ShaderUniform {
+        uint32 hash = 0;
+        // 0 for empty slots
+        GLenum type = 0;
+        GLint location = -1;
+        std::string name;
+    };
 
     GLuint compile(std::string shaderSource, GLenum type);
     std::string parse(const char* filename);
     GLuint createShader(const char* vertexShaderFilename, const char* fragmentShaderFilename);
+    void reflect();
+    void insert(const ShaderUniform& uniform);
+
+    const ShaderUniform* find(uint32 nameHash) {
+        if(uniforms.empty()) {
+            return 0;
+        }
+        uint32 mask = (uint32)uniforms.size() - 1;
+        for(uint32 i = nameHash & mask; uniforms[i].type != 0; i = (i + 1) & mask) {
+            if(uniforms[i].hash == nameHash) {
+                return &uniforms[i];
+            }
+        }
+        return 0;
+    }
 
     GLuint shaderId;
-};
\ No newline at end of file
+    // Open addressing with linear probing, the size is a power of two and at most half full
+    std::vector<ShaderUniform> uniforms;
+};
@@ -5,14 +5,9 @@ layout(location = 0) out vec4 f_color;
 in vec3 v_position;
 in vec2 v_tex_coord;
 in mat3 v_tbn;
+in float v_occlusion;
 
-struct Material {
-    vec3 diffuse;
-    vec3 specular;
-    vec3 emissive;
-    float shininess;
-};
-
+// Lights are in std140 blocks, the order of the members packs floats after the vec3s
 struct DirectionalLight {
     vec3 direction;
 
@@ -23,21 +18,19 @@ struct DirectionalLight {
 
 struct PointLight {
     vec3 position;
+    float linear;
 
     vec3 diffuse;
+    float quadratic;
     vec3 specular;
     vec3 ambient;
-
-    float linear;
-    float quadratic;
 };
 
 struct SpotLight {
     vec3 position;
+    float innerCone;
     // Must be a normalized vector
     vec3 direction;
-
-    float innerCone;
     float outerCone;
 
     vec3 diffuse;
@@ -45,10 +38,26 @@ struct SpotLight {
     vec3 ambient;
 };
 
-uniform Material u_material;
-uniform DirectionalLight u_directional_light;
-uniform PointLight u_point_light;
-uniform SpotLight u_spot_light;
+layout(std140) uniform Lights {
+    DirectionalLight u_directional_light;
+    PointLight u_point_light;
+    SpotLight u_spot_light;
+};
+
+// Per draw, declared the same in basic.vs and basic.fs. Quantized meshes store positions relative
+// to their bounds and octahedral encoded normals and tangents.
+layout(std140) uniform Material {
+    vec3 diffuse;
+    float shininess;
+    vec3 specular;
+    // 0: no specular map, 1: specular intensity in the diffuse alpha, 2: in the normal map blue
+    int specularChannel;
+    vec3 emissive;
+    bool octahedralNormals;
+    vec3 positionOffset;
+    vec3 positionScale;
+} u_material;
+
 uniform sampler2D u_diffuse_map;
 uniform sampler2D u_normal_map;
 
@@ -57,29 +66,42 @@ void main()
     // Vector from fragment to camera (camera always at 0,0,0)
     vec3 view = normalize(-v_position);
 
-    // Normal from normal map
-    vec3 normal = texture(u_normal_map, v_tex_coord).rgb;
-    normal = normalize(normal * 2.0 - 1.0f);
+    // Normal from normal map. Only X and Y are read, Z is not stored in BC5 and RG8 normal maps and
+    // blue may hold the specular intensity.
+    vec4 normalSample = texture(u_normal_map, v_tex_coord);
+    vec3 normal;
+    normal.xy = normalSample.rg * 2.0 - 1.0;
+    normal.z = sqrt(max(1.0 - dot(normal.xy, normal.xy), 0.0));
     normal = normalize(v_tbn * normal);
 
     vec4 diffuseColor = texture(u_diffuse_map, v_tex_coord);
-    if(diffuseColor.w < 0.9) {
-        discard;
+    float specularIntensity = 1.0;
+    if(u_material.specularChannel == 1) {
+        // Diffuse maps with a specular map in alpha are never alpha tested
+        specularIntensity = diffuseColor.w;
+    } else {
+        if(diffuseColor.w < 0.9) {
+            discard;
+        }
+        if(u_material.specularChannel == 2) {
+            specularIntensity = normalSample.b;
+        }
     }
+    vec3 materialSpecular = u_material.specular * specularIntensity;
 
     vec3 light = normalize(-u_directional_light.direction);
     vec3 reflection = reflect(u_directional_light.direction, normal);
-    vec3 ambient = u_directional_light.ambient * diffuseColor.xyz;
+    vec3 ambient = u_directional_light.ambient * diffuseColor.xyz * v_occlusion;
     vec3 diffuse = u_directional_light.diffuse * max(dot(normal, light), 0.0) * diffuseColor.xyz;
-    vec3 specular = u_directional_light.specular * pow(max(dot(reflection, view), 0.000001), u_material.shininess) * u_material.specular;
+    vec3 specular = u_directional_light.specular * pow(max(dot(reflection, view), 0.000001), u_material.shininess) * materialSpecular;
 
     light = normalize(u_point_light.position - v_position);
     reflection = reflect(-light, normal);
     float distance = length(u_point_light.position - v_position);
     float attentuation = 1.0 / ((1.0) + (u_point_light.linear*distance) + (u_point_light.quadratic*distance*distance));
-    ambient += attentuation * u_point_light.ambient * diffuseColor.xyz;
+    ambient += attentuation * u_point_light.ambient * diffuseColor.xyz * v_occlusion;
     diffuse += attentuation * u_point_light.diffuse * max(dot(normal, light), 0.0) * diffuseColor.xyz;
-    specular += attentuation * u_point_light.specular * pow(max(dot(reflection, view), 0.000001), u_material.shininess) * u_material.specular;
+    specular += attentuation * u_point_light.specular * pow(max(dot(reflection, view), 0.000001), u_material.shininess) * materialSpecular;
 
     light = normalize(u_spot_light.position - v_position);
     reflection = reflect(-light, normal);
@@ -87,11 +109,11 @@ void main()
     float epsilon = u_spot_light.innerCone - u_spot_light.outerCone;
     float intensity = clamp((theta - u_spot_light.outerCone) / epsilon, 0.0f, 1.0f);
     if(theta > u_spot_light.outerCone) {
-        ambient += u_spot_light.ambient * diffuseColor.xyz;
+        ambient += u_spot_light.ambient * diffuseColor.xyz * v_occlusion;
         diffuse += intensity * u_spot_light.diffuse * max(dot(normal, light), 0.0) * diffuseColor.xyz;
-        specular += intensity * u_spot_light.specular * pow(max(dot(reflection, view), 0.000001), u_material.shininess) * u_material.specular;
+        specular += intensity * u_spot_light.specular * pow(max(dot(reflection, view), 0.000001), u_material.shininess) * materialSpecular;
     } else {
-        ambient += u_spot_light.ambient * diffuseColor.xyz;
+        ambient += u_spot_light.ambient * diffuseColor.xyz * v_occlusion;
     }
 
     f_color = vec4(ambient + diffuse + specular + u_material.emissive, 1.0f);
@@ -4,26 +4,62 @@ layout(location = 0) in vec3 a_position;
 layout(location = 1) in vec3 a_normal;
 layout(location = 2) in vec3 a_tangent;
 layout(location = 3) in vec2 a_tex_coord;
+// Baked ambient occlusion, 1 for meshes without it
+layout(location = 4) in float a_occlusion;
+// Per instance, the node transform of the instance and its inverse transpose
+layout(location = 8) in mat4 a_instance_transform;
+layout(location = 12) in mat3 a_instance_normal_matrix;
 
 out vec3 v_position;
 out vec2 v_tex_coord;
 out mat3 v_tbn;
+out float v_occlusion;
 
-uniform mat4 u_modelViewProj;
-uniform mat4 u_modelView;
-uniform mat4 u_invModelView;
+layout(std140) uniform Camera {
+    mat4 u_modelViewProj;
+    mat4 u_modelView;
+    mat4 u_invModelView;
+};
+
+// Per draw, declared the same in basic.vs and basic.fs. Quantized meshes store positions relative
+// to their bounds and octahedral encoded normals and tangents.
+layout(std140) uniform Material {
+    vec3 diffuse;
+    float shininess;
+    vec3 specular;
+    // 0: no specular map, 1: specular intensity in the diffuse alpha, 2: in the normal map blue
+    int specularChannel;
+    vec3 emissive;
+    bool octahedralNormals;
+    vec3 positionOffset;
+    vec3 positionScale;
+} u_material;
+
+vec3 octahedralDecode(vec2 e)
+{
+    vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if(v.z < 0.0) {
+        v.xy = (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+    }
+    return normalize(v);
+}
 
 void main()
 {
-    gl_Position = u_modelViewProj * vec4(a_position, 1.0f);
+    vec3 position = vec3(a_instance_transform * vec4(u_material.positionOffset + a_position * u_material.positionScale, 1.0f));
+    vec3 normal = a_instance_normal_matrix * (u_material.octahedralNormals ? octahedralDecode(a_normal.xy) : a_normal);
+    vec3 tangent = a_instance_normal_matrix * (u_material.octahedralNormals ? octahedralDecode(a_tangent.xy) : a_tangent);
+
+    gl_Position = u_modelViewProj * vec4(position, 1.0f);
 
-    vec3 t = normalize(mat3(u_invModelView) * a_tangent);
-    vec3 n = normalize(mat3(u_invModelView) * a_normal);
+    vec3 t = normalize(mat3(u_invModelView) * tangent);
+    vec3 n = normalize(mat3(u_invModelView) * normal);
     t = normalize(t - dot(t, n) * n); // Reorthogonalize with Gram-Schmidt process
     vec3 b = normalize(mat3(u_invModelView) * cross(n, t));
     mat3 tbn = transpose(mat3(t, b, n)); // transpose is equal to inverse in this case
     v_tbn = tbn;
 
-    v_position = vec3(u_modelView * vec4(a_position, 1.0f));
+    v_position = vec3(u_modelView * vec4(position, 1.0f));
     v_tex_coord = a_tex_coord;
+    v_occlusion = a_occlusion;
 }
@@ -0,0 +1,146 @@
+#include <vector>
+#include <cstdint>
+
+#include "../bmf_codec.h"
+#include "../bmf_file.h"
+#include "test.h"
+
+// Small deterministic generator, so failures reproduce
+static uint32 nextRandom(uint32& state) {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+// Encodes and decodes the vertices and checks that the result is bit exact. Returns the encoded size.
+static uint64 roundtripVertices(const uint8* vertices, uint64 numVertices, uint64 vertexSize) {
+    uint64 vertexBytes = numVertices * vertexSize;
+    std::vector<uint8> encoded;
+    bmfEncodeVertexBuffer(encoded, vertices, numVertices, vertexSize);
+    std::vector<uint8> decoded(vertexBytes + 1, 0xcd);
+    CHECK(bmfDecodeVertexBuffer(decoded.data(), numVertices, vertexSize, encoded.data(), encoded.size()));
+    CHECK(memcmp(decoded.data(), vertices, vertexBytes) == 0);
+    // Nothing past the vertices is written
+    CHECK(decoded[vertexBytes] == 0xcd);
+    // Cut off data is an error, not a read past the end
+    if(!encoded.empty()) {
+        CHECK(!bmfDecodeVertexBuffer(decoded.data(), numVertices, vertexSize, encoded.data(), encoded.size() - 1));
+    }
+    return encoded.size();
+}
+
+// Smooth data changes slowly from vertex to vertex like the attributes of a real mesh, otherwise
+// every byte is random
+static void testVertices(uint64 numVertices, uint64 vertexSize, bool smooth) {
+    uint32 state = (uint32)(numVertices * 31 + vertexSize);
+    std::vector<uint8> vertices(numVertices * vertexSize);
+    for(uint64 i = 0; i < numVertices; i++) {
+        for(uint64 k = 0; k < vertexSize; k++) {
+            uint8 previous = i > 0 ? vertices[(i - 1) * vertexSize + k] : (uint8)k;
+            vertices[i * vertexSize + k] = smooth ? (uint8)(previous + nextRandom(state) % 5 - 2) : (uint8)nextRandom(state);
+        }
+    }
+    uint64 encodedSize = roundtripVertices(vertices.data(), numVertices, vertexSize);
+    if(smooth && numVertices >= BMF_VERTEX_CODEC_BLOCK_SIZE) {
+        CHECK(encodedSize < vertices.size());
+    }
+}
+
+// Grid of width x height quads, two triangles each, in row order like an optimized mesh
+template<typename T>
+static std::vector<T> gridIndices(uint32 width, uint32 height) {
+    std::vector<T> indices;
+    for(uint32 y = 0; y < height; y++) {
+        for(uint32 x = 0; x < width; x++) {
+            T corner = (T)(y * (width + 1) + x);
+            T right = (T)(corner + 1);
+            T below = (T)(corner + width + 1);
+            T diagonal = (T)(below + 1);
+            T quad[6] = {corner, below, right, right, below, diagonal};
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    return indices;
+}
+
+template<typename T>
+static void roundtripIndices(const T* indices, uint64 numIndices) {
+    std::vector<uint8> encoded;
+    bmfEncodeIndexBuffer(encoded, indices, numIndices);
+    std::vector<T> decoded(numIndices + 1, (T)0xcdcd);
+    CHECK(bmfDecodeIndexBuffer(decoded.data(), numIndices, encoded.data(), encoded.size()));
+    CHECK(std::equal(indices, indices + numIndices, decoded.begin()));
+    CHECK(decoded[numIndices] == (T)0xcdcd);
+    if(!encoded.empty()) {
+        CHECK(!bmfDecodeIndexBuffer(decoded.data(), numIndices, encoded.data(), encoded.size() - 1));
+    }
+}
+
+template<typename T>
+static void testIndices(const std::vector<T>& indices) {
+    roundtripIndices(indices.data(), indices.size());
+}
+
+// Round trips the streams of every mesh of the bmf files. Files that can't be opened, like the
+// models that predate the format, are skipped. Returns the number of meshes tested.
+static uint64 testFiles(int argc, char** argv) {
+    uint64 numMeshes = 0;
+    std::vector<uint8> vertexScratch;
+    std::vector<uint8> indexScratch;
+    for(int i = 1; i < argc; i++) {
+        BMFFile file;
+        if(!file.open(argv[i])) {
+            std::cout << argv[i] << ": skipped" << std::endl;
+            continue;
+        }
+        for(uint64 m = 0; m < file.meshRecords.size(); m++) {
+            const BMFMeshRecord& record = file.meshRecords[m];
+            const uint8* vertices = 0;
+            const uint8* indices = 0;
+            CHECK(file.getMeshData(m, vertexScratch, indexScratch, &vertices, &indices));
+            if(!vertices || !indices) {
+                continue;
+            }
+            roundtripVertices(vertices, record.numVertices, bmfVertexSize(record.flags));
+            if(record.flags & BMF_MESH_INDEX16) {
+                roundtripIndices((const uint16*)indices, record.numIndices);
+            } else {
+                roundtripIndices((const uint32*)indices, record.numIndices);
+            }
+            numMeshes++;
+        }
+    }
+    return numMeshes;
+}
+
+// Arguments are bmf files whose meshes are round tripped as well
+int main(int argc, char** argv) {
+    // Block and group boundaries, and vertex sizes of the bmf layouts and odd ones
+    uint64 counts[] = {0, 1, 15, 16, 17, 255, 256, 257, 1000};
+    uint64 sizes[] = {1, 4, 7, 20, 48, 52, BMF_VERTEX_CODEC_MAX_VERTEX_SIZE};
+    for(uint64 count : counts) {
+        for(uint64 size : sizes) {
+            testVertices(count, size, true);
+            testVertices(count, size, false);
+        }
+    }
+
+    testIndices(std::vector<uint16>());
+    testIndices(gridIndices<uint16>(1, 1));
+    testIndices(gridIndices<uint16>(100, 100));
+    testIndices(gridIndices<uint32>(300, 300));
+    // Triangles without shared edges or any order
+    uint32 state = 1;
+    std::vector<uint32> scattered(3000);
+    for(uint32& index : scattered) {
+        index = nextRandom(state) % 100000;
+    }
+    testIndices(scattered);
+    std::vector<uint16> scattered16(scattered.begin(), scattered.end());
+    testIndices(scattered16);
+
+    if(argc > 1) {
+        CHECK(testFiles(argc, argv) > 0);
+    }
+
+    return testResult("bmf_codec_test");
+}
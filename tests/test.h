@@ -0,0 +1,19 @@
+#pragma once
+#include <iostream>
+
+// Minimal checks for the tests in this directory. A failed check prints its location and the test
+// exits with 1 at the end of main.
+
+static int testFailures = 0;
+
+#define CHECK(condition) do { \
+    if(!(condition)) { \
+        std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+        testFailures++; \
+    } \
+} while(0)
+
+inline int testResult(const char* name) {
+    std::cout << name << ": " << (testFailures ? "failed" : "passed") << std::endl;
+    return testFailures ? 1 : 0;
+}
@@ -0,0 +1,118 @@
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+
+#include "../tools/texture_compressor.h"
+#include "test.h"
+
+// Largest difference of a channel between the block and its BC1 encoding, decoded the way GL
+// decodes BC1
+static int bc1Error(const uint8_t* pixels) {
+    uint8_t block[8];
+    uint8_t decoded[16 * 4];
+    encodeBC1Block(pixels, block);
+    bmfDecodeBC1Block(block, decoded, false);
+    int result = 0;
+    for(uint32_t i = 0; i < 16; i++) {
+        for(uint32_t c = 0; c < 3; c++) {
+            result = std::max(result, abs(decoded[i * 4 + c] - pixels[i * 4 + c]));
+        }
+        // Opaque blocks must not pick the transparent color of the three color mode
+        CHECK(decoded[i * 4 + 3] == 255);
+    }
+    return result;
+}
+
+static int bc4Error(const uint8_t* values) {
+    uint8_t block[8];
+    uint8_t decoded[16];
+    encodeBC4Block(values, 1, block);
+    bmfDecodeBC4Block(block, decoded, 1);
+    int result = 0;
+    for(uint32_t i = 0; i < 16; i++) {
+        result = std::max(result, abs(decoded[i] - values[i]));
+    }
+    return result;
+}
+
+static void setPixel(uint8_t* pixels, uint32_t i, uint8_t r, uint8_t g, uint8_t b) {
+    pixels[i * 4] = r;
+    pixels[i * 4 + 1] = g;
+    pixels[i * 4 + 2] = b;
+    pixels[i * 4 + 3] = 255;
+}
+
+int main() {
+    uint8_t pixels[16 * 4];
+
+    // Solid colors only lose the 565 quantization, the interpolated colors reach within a third of
+    // a step of any value
+    uint8_t solids[][3] = {{0, 0, 0}, {255, 255, 255}, {255, 0, 0}, {12, 200, 77}, {128, 128, 128}};
+    for(const uint8_t* solid : solids) {
+        for(uint32_t i = 0; i < 16; i++) {
+            setPixel(pixels, i, solid[0], solid[1], solid[2]);
+        }
+        CHECK(bc1Error(pixels) <= 8);
+    }
+
+    // A full gray ramp lies on one line. Four colors for 16 values leave an error of about a sixth of
+    // the range.
+    for(uint32_t i = 0; i < 16; i++) {
+        setPixel(pixels, i, (uint8_t)(i * 17), (uint8_t)(i * 17), (uint8_t)(i * 17));
+    }
+    CHECK(bc1Error(pixels) <= 48);
+
+    // Red and green halves: the axis between them is orthogonal to the one a power iteration seeded
+    // with (1, 1, 1) converges to, which used to leave an error of 240
+    for(uint32_t i = 0; i < 16; i++) {
+        setPixel(pixels, i, i < 8 ? 255 : 0, i < 8 ? 0 : 255, 0);
+    }
+    CHECK(bc1Error(pixels) <= 8);
+    for(uint32_t i = 0; i < 16; i++) {
+        setPixel(pixels, i, (uint8_t)(i * 17), (uint8_t)(255 - i * 17), 0);
+    }
+    CHECK(bc1Error(pixels) <= 48);
+
+    // Two colors of a block are always representable as the endpoints
+    for(uint32_t i = 0; i < 16; i++) {
+        setPixel(pixels, i, i % 3 ? 30 : 220, i % 3 ? 60 : 10, i % 3 ? 200 : 90);
+    }
+    CHECK(bc1Error(pixels) <= 8);
+
+    uint8_t values[16];
+    for(uint32_t i = 0; i < 16; i++) {
+        values[i] = 77;
+    }
+    CHECK(bc4Error(values) == 0);
+    // Eight levels between the extremes, the steps are at most 255 / 7 apart
+    for(uint32_t i = 0; i < 16; i++) {
+        values[i] = (uint8_t)(i * 17);
+    }
+    CHECK(bc4Error(values) <= 19);
+    for(uint32_t i = 0; i < 16; i++) {
+        values[i] = i % 2 ? 0 : 255;
+    }
+    CHECK(bc4Error(values) == 0);
+    for(uint32_t i = 0; i < 16; i++) {
+        values[i] = (uint8_t)(100 + i);
+    }
+    CHECK(bc4Error(values) <= 2);
+
+    // Whole images go through compressImage, BC5 is two BC4 blocks of red and green
+    TextureImage image;
+    image.width = 6;
+    image.height = 5;
+    image.pixels.resize(image.width * image.height * 4);
+    for(uint32_t i = 0; i < image.width * image.height; i++) {
+        setPixel(image.pixels.data(), i, (uint8_t)(i * 8), (uint8_t)(255 - i * 8), 0);
+    }
+    std::vector<uint8_t> compressed;
+    compressImage(image, BMF_TEXTURE_BC5, compressed);
+    CHECK(compressed.size() == 4 * 16);
+    uint8_t red[16];
+    bmfDecodeBC4Block(compressed.data(), red, 1);
+    // Pixel (1, 1) is the sixth of the first block
+    CHECK(abs(red[5] - image.pixels[(1 * image.width + 1) * 4]) <= 19);
+
+    return testResult("texture_compressor_test");
+}
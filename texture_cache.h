@@ -0,0 +1,259 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <cstdlib>
+#include <climits>
+#include <cassert>
+#include <iostream>
+#include <GL/glew.h>
+
+#include "defines.h"
+#include "bmf.h"
+#include "gl_state.h"
+
+// CPU side of a texture with the bottom row first. pixels points to the start of storage, or
+// straight into a mapped file for embedded textures that need no decoding. Holds numMips levels in
+// format (RGBA8, RG8 or one of the block compressed BMFTextureFormats), largest first.
+struct TextureData {
+    int32 width = 0;
+    int32 height = 0;
+    uint32 format = BMF_TEXTURE_RGBA8;
+    uint32 numMips = 1;
+    const uint8* pixels = 0;
+    uint64 size = 0;
+    std::vector<uint8> storage;
+
+    TextureData() {}
+
+    TextureData(const TextureData& other) {
+        *this = other;
+    }
+
+    TextureData(TextureData&& other) {
+        *this = std::move(other);
+    }
+
+    // pixels follows storage into the copy, a pointer into a mapping is kept as it is
+    TextureData& operator=(const TextureData& other) {
+        if(this != &other) {
+            copyHeader(other);
+            storage = other.storage;
+            pixels = other.ownsPixels() ? storage.data() : other.pixels;
+        }
+        return *this;
+    }
+
+    TextureData& operator=(TextureData&& other) {
+        if(this != &other) {
+            copyHeader(other);
+            bool owned = other.ownsPixels();
+            storage = std::move(other.storage);
+            pixels = owned ? storage.data() : other.pixels;
+            other.pixels = 0;
+            other.size = 0;
+        }
+        return *this;
+    }
+
+private:
+    bool ownsPixels() const {
+        return !storage.empty() && pixels == storage.data();
+    }
+
+    void copyHeader(const TextureData& other) {
+        width = other.width;
+        height = other.height;
+        format = other.format;
+        numMips = other.numMips;
+        size = other.size;
+    }
+};
+
+struct TextureCacheStats {
+    uint64 hits = 0;
+    uint64 misses = 0;
+    // Decoded bytes that did not have to be decoded and uploaded again because of hits
+    uint64 bytesSaved = 0;
+    uint64 numTextures = 0;
+    uint64 residentBytes = 0;
+};
+
+// Process wide cache of GL textures, keyed by the canonical path of the image file or the hash of
+// an embedded image, so materials and models that use the same image share one texture. Textures
+// are reference counted and deleted when the last user releases them.
+//
+// The map is guarded by a mutex, so lookups can happen on loader threads. Everything that touches
+// GL (insert, release) must happen on the GL thread.
+class TextureCache {
+public:
+    static TextureCache& get() {
+        static TextureCache cache;
+        return cache;
+    }
+
+    // Resolves relative paths, "." and ".." so different spellings of a path hit the same entry
+    static std::string getKey(const std::string& path) {
+#ifdef _WIN32
+        char buffer[_MAX_PATH];
+        if(_fullpath(buffer, path.c_str(), _MAX_PATH)) {
+            return buffer;
+        }
+#else
+        char buffer[PATH_MAX];
+        if(realpath(path.c_str(), buffer)) {
+            return buffer;
+        }
+#endif
+        return path;
+    }
+
+    // Returns the texture for key with its reference count increased, or 0 if it is not cached
+    // yet. Can be called from any thread.
+    GLuint acquire(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        if(it == entries.end()) {
+            return 0;
+        }
+        Entry& entry = it->second;
+        entry.refCount++;
+        stats.hits++;
+        stats.bytesSaved += entry.size;
+        return entry.texture;
+    }
+
+    // Uploads a decoded texture and returns it with a reference count of one. If another load
+    // inserted the same key in the meantime, that texture is shared instead. data without pixels
+    // expects an earlier insert of the same key. GL thread only.
+    GLuint insert(const std::string& key, const TextureData& data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        if(it != entries.end()) {
+            Entry& entry = it->second;
+            entry.refCount++;
+            // Only a hit if nothing was decoded for it, a load that lost the race to insert the
+            // same image decoded it for nothing
+            if(!data.pixels) {
+                stats.hits++;
+                stats.bytesSaved += entry.size;
+            }
+            return entry.texture;
+        }
+
+        Entry entry;
+        GLCALL(glGenTextures(1, &entry.texture));
+        entry.size = upload(entry.texture, data);
+        entries[key] = entry;
+        keys[entry.texture] = key;
+        stats.misses++;
+        stats.numTextures++;
+        stats.residentBytes += entry.size;
+        return entry.texture;
+    }
+
+    // Drops one reference and deletes the texture with the last one. GL thread only.
+    void release(GLuint texture) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto keyIt = keys.find(texture);
+        if(keyIt == keys.end()) {
+            return;
+        }
+        auto it = entries.find(keyIt->second);
+        Entry& entry = it->second;
+        assert(entry.refCount > 0);
+        if(--entry.refCount == 0) {
+            GLState::get().deleteTexture(entry.texture);
+            stats.numTextures--;
+            stats.residentBytes -= entry.size;
+            entries.erase(it);
+            keys.erase(keyIt);
+        }
+    }
+
+    TextureCacheStats getStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    void printStats() {
+        TextureCacheStats current = getStats();
+        std::cout << "Texture cache: " << current.hits << " hits, " << current.misses << " misses, "
+            << current.bytesSaved / (1024.0 * 1024.0) << " MB saved, " << current.numTextures << " textures ("
+            << current.residentBytes / (1024.0 * 1024.0) << " MB) resident" << std::endl;
+    }
+
+private:
+    struct Entry {
+        GLuint texture = 0;
+        uint64 size = 0;
+        uint32 refCount = 1;
+    };
+
+    // Uploads every mip level of data, or generates the mips if it only has one. Returns the bytes
+    // the texture occupies on the GPU.
+    uint64 upload(GLuint texture, const TextureData& data) {
+        GLState& state = GLState::get();
+        state.bindTexture(0, texture);
+
+        GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR));
+        GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+        GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+        GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+        if(data.numMips > 1) {
+            GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, data.numMips - 1));
+        }
+
+        // S3TC is an extension in GL 3.3, without it BC1 and BC3 are decoded to RGBA8
+        bool decodeS3TC = (data.format == BMF_TEXTURE_BC1 || data.format == BMF_TEXTURE_BC3) && !GLEW_EXT_texture_compression_s3tc;
+        std::vector<uint8> decoded;
+        uint64 residentSize = 0;
+        GLenum internalFormat = 0;
+        switch(decodeS3TC ? 0 : data.format) {
+            case BMF_TEXTURE_BC1:
+            internalFormat = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+            break;
+            case BMF_TEXTURE_BC3:
+            internalFormat = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+            break;
+            case BMF_TEXTURE_BC5:
+            internalFormat = GL_COMPRESSED_RG_RGTC2;
+            break;
+        }
+        uint64 offset = 0;
+        for(uint32 level = 0; level < data.numMips; level++) {
+            int32 width = data.width >> level > 0 ? data.width >> level : 1;
+            int32 height = data.height >> level > 0 ? data.height >> level : 1;
+            uint64 levelSize = bmfTextureLevelSize(data.format, width, height);
+            residentSize += decodeS3TC ? (uint64)width * height * 4 : levelSize;
+            if(decodeS3TC) {
+                decoded.resize((uint64)width * height * 4);
+                bmfDecodeBCLevel(data.format, width, height, data.pixels + offset, decoded.data());
+                GLCALL(glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, decoded.data()));
+            } else if(internalFormat) {
+                GLCALL(glCompressedTexImage2D(GL_TEXTURE_2D, level, internalFormat, width, height, 0, (GLsizei)levelSize, data.pixels + offset));
+            } else if(data.format == BMF_TEXTURE_RG8) {
+                // Rows of odd widths are not 4 byte aligned
+                GLCALL(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+                GLCALL(glTexImage2D(GL_TEXTURE_2D, level, GL_RG8, width, height, 0, GL_RG, GL_UNSIGNED_BYTE, data.pixels + offset));
+                GLCALL(glPixelStorei(GL_UNPACK_ALIGNMENT, 4));
+            } else {
+                GLCALL(glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data.pixels + offset));
+            }
+            offset += levelSize;
+        }
+        if(data.numMips <= 1) {
+            GLCALL(glGenerateMipmap(GL_TEXTURE_2D));
+            // A full chain adds a third
+            residentSize += residentSize / 3;
+        }
+        state.bindTexture(0, 0);
+        return residentSize;
+    }
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    std::unordered_map<GLuint, std::string> keys;
+    TextureCacheStats stats;
+};
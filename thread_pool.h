@@ -0,0 +1,133 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+
+#include "defines.h"
+
+// Fixed set of worker threads that run jobs in submission order. Used for work that must not block
+// the render thread, like reading and decoding models.
+struct ThreadPool {
+    static const uint32 HARDWARE_THREADS = ~0u;
+
+    // HARDWARE_THREADS means one per hardware thread, minus one for the render thread. A pool
+    // without threads runs parallelFor on the calling thread alone, submitted jobs never run.
+    ThreadPool(uint32 numThreads = HARDWARE_THREADS) {
+        if(numThreads == HARDWARE_THREADS) {
+            uint32 hardwareThreads = std::thread::hardware_concurrency();
+            numThreads = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+        }
+        for(uint32 i = 0; i < numThreads; i++) {
+            threads.push_back(std::thread(&ThreadPool::workerLoop, this));
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Finishes all queued jobs before returning
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobAvailable.notify_all();
+        for(std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        jobAvailable.notify_one();
+    }
+
+    // Runs body(i) for every i in [0, count) on the workers and the calling thread and returns when
+    // all of them are done. The calling thread takes part, so this can also be called from a job
+    // without deadlocking when every worker is busy.
+    void parallelFor(uint64 count, std::function<void(uint64)> body) {
+        struct Batch {
+            std::function<void(uint64)> body;
+            uint64 count = 0;
+            std::atomic<uint64> next{0};
+            std::atomic<uint64> done{0};
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        // Shared with the helper jobs, some of which may only start after everything is done
+        std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+        batch->body = std::move(body);
+        batch->count = count;
+        auto run = [batch] {
+            for(;;) {
+                uint64 i = batch->next.fetch_add(1);
+                if(i >= batch->count) {
+                    return;
+                }
+                batch->body(i);
+                if(batch->done.fetch_add(1) + 1 == batch->count) {
+                    std::lock_guard<std::mutex> lock(batch->mutex);
+                    batch->finished.notify_all();
+                }
+            }
+        };
+
+        uint64 numHelpers = count > 1 ? count - 1 : 0;
+        numHelpers = numHelpers < threads.size() ? numHelpers : threads.size();
+        for(uint64 i = 0; i < numHelpers; i++) {
+            submit(run);
+        }
+        run();
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->finished.wait(lock, [&batch] { return batch->done.load() == batch->count; });
+    }
+
+    // Blocks until the queue is empty and no job is running
+    void waitIdle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return jobs.empty() && numRunningJobs == 0; });
+    }
+
+    uint32 getNumThreads() {
+        return (uint32)threads.size();
+    }
+
+private:
+    void workerLoop() {
+        for(;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobAvailable.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if(jobs.empty()) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                numRunningJobs++;
+            }
+            job();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                numRunningJobs--;
+            }
+            idle.notify_all();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::condition_variable idle;
+    uint32 numRunningJobs = 0;
+    bool stopping = false;
+};
@@ -0,0 +1,183 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <sys/stat.h>
+
+#include "../bmf.h"
+#include "../mapped_file.h"
+
+// Records which files and settings every cooked output was built from, so a later run can skip
+// outputs whose inputs did not change. Inputs are compared by content hash. The size and
+// modification time are stored as well, and if both still match the file is not hashed again.
+//
+// The manifest is a text file:
+//     bmfcook 1
+//     output <exporter version> <options hash> <output size> <output path>
+//     input <content hash> <size> <modification time in nanoseconds> <input path>
+//     ...
+// Every output line is followed by the input lines of the files it was built from. An input that
+// did not exist when the output was cooked has the size -1, so it triggers a rebuild once it appears.
+
+struct CookInput {
+    std::string path;
+    uint64_t hash = 0;
+    int64_t size = -1;
+    int64_t modifiedTime = 0;
+};
+
+struct CookEntry {
+    uint32_t exporterVersion = 0;
+    uint64_t optionsHash = 0;
+    uint64_t outputSize = 0;
+    std::vector<CookInput> inputs;
+};
+
+// Modification time in nanoseconds. Seconds would miss an edit that keeps the size within the same
+// second.
+inline int64_t getModifiedTime(const struct stat& info) {
+#if defined(_WIN32)
+    return (int64_t)info.st_mtime * 1000000000;
+#elif defined(__APPLE__)
+    return (int64_t)info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    return (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+}
+
+// Fills in the size, modification time and content hash of path. The hash of previous is reused if
+// the size and modification time did not change.
+inline void hashCookInput(const std::string& path, CookInput& result, const CookInput* previous = 0) {
+    result.path = path;
+    result.hash = 0;
+    result.size = -1;
+    result.modifiedTime = 0;
+    struct stat info;
+    if(stat(path.c_str(), &info) != 0) {
+        return;
+    }
+    result.size = (int64_t)info.st_size;
+    result.modifiedTime = getModifiedTime(info);
+    if(previous && previous->size == result.size && previous->modifiedTime == result.modifiedTime) {
+        result.hash = previous->hash;
+        return;
+    }
+    MappedFile file;
+    if(!file.open(path.c_str())) {
+        result.size = -1;
+        return;
+    }
+    result.hash = bmfHash(file.getData(), file.getSize());
+}
+
+class CookManifest {
+public:
+    // A missing manifest is an empty one, everything gets cooked
+    bool load(const std::string& filename) {
+        entries.clear();
+        std::ifstream input(filename);
+        if(!input.is_open()) {
+            return true;
+        }
+        std::string line;
+        std::getline(input, line);
+        if(line != "bmfcook 1") {
+            std::cout << filename << " is not a cook manifest" << std::endl;
+            return false;
+        }
+        CookEntry* entry = 0;
+        while(std::getline(input, line)) {
+            std::istringstream fields(line);
+            std::string type;
+            fields >> type;
+            if(type == "output") {
+                CookEntry newEntry;
+                std::string path;
+                fields >> newEntry.exporterVersion >> std::hex >> newEntry.optionsHash >> std::dec >> newEntry.outputSize;
+                fields.get();
+                std::getline(fields, path);
+                if(!fields.fail()) {
+                    entry = &(entries[path] = newEntry);
+                    continue;
+                }
+            } else if(type == "input" && entry) {
+                CookInput input;
+                fields >> std::hex >> input.hash >> std::dec >> input.size >> input.modifiedTime;
+                fields.get();
+                std::getline(fields, input.path);
+                if(!fields.fail()) {
+                    entry->inputs.push_back(input);
+                    continue;
+                }
+            } else if(type.empty()) {
+                continue;
+            }
+            std::cout << filename << ": invalid line \"" << line << "\"" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Written next to filename and renamed over it once complete, so an interrupted save keeps the
+    // previous manifest
+    bool save(const std::string& filename) const {
+        std::string tempFilename = filename + ".tmp";
+        std::ofstream output(tempFilename);
+        if(!output.is_open()) {
+            return false;
+        }
+        output << "bmfcook 1\n";
+        for(const auto& it : entries) {
+            const CookEntry& entry = it.second;
+            output << "output " << entry.exporterVersion << " " << std::hex << entry.optionsHash << std::dec << " "
+                << entry.outputSize << " " << it.first << "\n";
+            for(const CookInput& input : entry.inputs) {
+                output << "input " << std::hex << input.hash << std::dec << " " << input.size << " " << input.modifiedTime << " "
+                    << input.path << "\n";
+            }
+        }
+        output.close();
+        if(output.fail()) {
+            std::remove(tempFilename.c_str());
+            return false;
+        }
+#ifdef _WIN32
+        // rename does not replace an existing file on Windows
+        std::remove(filename.c_str());
+#endif
+        return std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+    }
+
+    // Returns true if output exists and was cooked by the same exporter version and options from
+    // inputs that still have the same content. refreshed gets the current state of the inputs, which
+    // only differs in modification times if the inputs were touched but not changed. Only reads the
+    // manifest, so several threads can check at once.
+    bool isUpToDate(const std::string& output, uint32_t exporterVersion, uint64_t optionsHash, CookEntry& refreshed) const {
+        auto it = entries.find(output);
+        if(it == entries.end()) {
+            return false;
+        }
+        const CookEntry& entry = it->second;
+        struct stat info;
+        if(entry.exporterVersion != exporterVersion || entry.optionsHash != optionsHash
+            || stat(output.c_str(), &info) != 0 || (uint64_t)info.st_size != entry.outputSize) {
+            return false;
+        }
+        refreshed = entry;
+        for(uint64_t i = 0; i < entry.inputs.size(); i++) {
+            const CookInput& previous = entry.inputs[i];
+            hashCookInput(previous.path, refreshed.inputs[i], &previous);
+            if(refreshed.inputs[i].size != previous.size || refreshed.inputs[i].hash != previous.hash) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::map<std::string, CookEntry> entries;
+};
@@ -0,0 +1,400 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// Triangle and vertex reordering passes of the model exporter, plus the metrics to judge them.
+//
+// optimizeVertexCache reorders triangles for the post transform vertex cache (Tipsify, Sander et
+// al. 2007, "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"). optimizeOverdraw
+// then sorts the clusters Tipsify produced front to back as seen from outside the mesh, which keeps
+// most of the cache locality. optimizeVertexFetch finally renumbers the vertices in the order the
+// index buffer first uses them, so vertex fetches walk memory linearly.
+//
+// Positions are tightly packed float triples.
+
+struct VertexCacheStats {
+    // Average cache miss ratio: transformed vertices per triangle, 0.5 is ideal for a regular grid
+    float acmr;
+    // Average transform to vertex ratio: transformed vertices per unique vertex, 1 is ideal
+    float atvr;
+};
+
+// Simulates a FIFO post transform cache of cacheSize entries
+inline VertexCacheStats analyzeVertexCache(const uint32_t* indices, uint64_t numIndices, uint64_t numVertices, uint32_t cacheSize) {
+    std::vector<uint32_t> timestamps(numVertices, 0);
+    uint32_t time = cacheSize + 1;
+    uint64_t misses = 0;
+    for(uint64_t i = 0; i < numIndices; i++) {
+        uint32_t index = indices[i];
+        if(time - timestamps[index] > cacheSize) {
+            timestamps[index] = time++;
+            misses++;
+        }
+    }
+    std::vector<bool> used(numVertices, false);
+    uint64_t numUsed = 0;
+    for(uint64_t i = 0; i < numIndices; i++) {
+        numUsed += used[indices[i]] ? 0 : 1;
+        used[indices[i]] = true;
+    }
+    VertexCacheStats stats;
+    stats.acmr = numIndices > 0 ? (float)misses / (numIndices / 3) : 0.0f;
+    stats.atvr = numUsed > 0 ? (float)misses / numUsed : 0.0f;
+    return stats;
+}
+
+// Bytes read from memory per byte of referenced vertex data, for the vertices that miss a 16 entry
+// post transform cache, through a 4 KB FIFO cache of 64 byte lines. 1 is ideal.
+inline float analyzeVertexFetch(const uint32_t* indices, uint64_t numIndices, uint64_t numVertices, uint64_t vertexSize) {
+    const uint32_t transformCacheSize = 16;
+    const uint64_t lineSize = 64;
+    const uint32_t numLines = 64;
+    std::vector<uint32_t> vertexTimestamps(numVertices, 0);
+    uint32_t vertexTime = transformCacheSize + 1;
+    std::vector<uint32_t> lineTimestamps((numVertices * vertexSize + lineSize - 1) / lineSize, 0);
+    uint32_t lineTime = numLines + 1;
+    std::vector<bool> used(numVertices, false);
+    uint64_t numUsed = 0;
+    uint64_t bytesFetched = 0;
+    for(uint64_t i = 0; i < numIndices; i++) {
+        uint32_t index = indices[i];
+        numUsed += used[index] ? 0 : 1;
+        used[index] = true;
+        if(vertexTime - vertexTimestamps[index] <= transformCacheSize) {
+            continue;
+        }
+        vertexTimestamps[index] = vertexTime++;
+        uint64_t firstLine = index * vertexSize / lineSize;
+        uint64_t lastLine = (index * vertexSize + vertexSize - 1) / lineSize;
+        for(uint64_t line = firstLine; line <= lastLine; line++) {
+            if(lineTime - lineTimestamps[line] > numLines) {
+                lineTimestamps[line] = lineTime++;
+                bytesFetched += lineSize;
+            }
+        }
+    }
+    return numUsed > 0 ? (float)bytesFetched / (numUsed * vertexSize) : 0.0f;
+}
+
+// Rasterizes the mesh in index order from the six axis directions with back face culling and a
+// depth test, and returns shaded fragments per covered pixel. 1 means no overdraw.
+inline float analyzeOverdraw(const uint32_t* indices, uint64_t numIndices, const float* positions, uint64_t numVertices) {
+    const int32_t resolution = 256;
+    if(numVertices == 0) {
+        return 0.0f;
+    }
+    float boundsMin[3] = {positions[0], positions[1], positions[2]};
+    float boundsMax[3] = {positions[0], positions[1], positions[2]};
+    for(uint64_t i = 0; i < numVertices; i++) {
+        for(int k = 0; k < 3; k++) {
+            boundsMin[k] = std::min(boundsMin[k], positions[i * 3 + k]);
+            boundsMax[k] = std::max(boundsMax[k], positions[i * 3 + k]);
+        }
+    }
+    float extent = std::max(boundsMax[0] - boundsMin[0], std::max(boundsMax[1] - boundsMin[1], boundsMax[2] - boundsMin[2]));
+    float scale = extent > 0.0f ? (resolution - 1) / extent : 0.0f;
+
+    std::vector<float> depthBuffer(resolution * resolution);
+    uint64_t shaded = 0;
+    uint64_t covered = 0;
+    for(int axis = 0; axis < 3; axis++) {
+        for(int direction = 0; direction < 2; direction++) {
+            std::fill(depthBuffer.begin(), depthBuffer.end(), 1e30f);
+            // Cyclic axis order keeps the winding, looking from the other side mirrors u
+            int u = axis;
+            int v = (axis + 1) % 3;
+            int w = (axis + 2) % 3;
+            float mirror = direction == 0 ? 1.0f : -1.0f;
+            for(uint64_t i = 0; i + 2 < numIndices; i += 3) {
+                float screen[3][3];
+                for(int corner = 0; corner < 3; corner++) {
+                    const float* p = positions + indices[i + corner] * 3;
+                    float x = (p[u] - boundsMin[u]) * scale;
+                    screen[corner][0] = direction == 0 ? x : (resolution - 1) - x;
+                    screen[corner][1] = (p[v] - boundsMin[v]) * scale;
+                    // Smaller is closer
+                    screen[corner][2] = -mirror * p[w];
+                }
+                float area = (screen[1][0] - screen[0][0]) * (screen[2][1] - screen[0][1]) - (screen[2][0] - screen[0][0]) * (screen[1][1] - screen[0][1]);
+                if(area <= 0.0f) {
+                    continue;
+                }
+                int32_t minX = std::max(0, (int32_t)floorf(std::min(screen[0][0], std::min(screen[1][0], screen[2][0]))));
+                int32_t maxX = std::min(resolution - 1, (int32_t)ceilf(std::max(screen[0][0], std::max(screen[1][0], screen[2][0]))));
+                int32_t minY = std::max(0, (int32_t)floorf(std::min(screen[0][1], std::min(screen[1][1], screen[2][1]))));
+                int32_t maxY = std::min(resolution - 1, (int32_t)ceilf(std::max(screen[0][1], std::max(screen[1][1], screen[2][1]))));
+                for(int32_t y = minY; y <= maxY; y++) {
+                    for(int32_t x = minX; x <= maxX; x++) {
+                        float px = x + 0.5f;
+                        float py = y + 0.5f;
+                        float w0 = (screen[2][0] - screen[1][0]) * (py - screen[1][1]) - (screen[2][1] - screen[1][1]) * (px - screen[1][0]);
+                        float w1 = (screen[0][0] - screen[2][0]) * (py - screen[2][1]) - (screen[0][1] - screen[2][1]) * (px - screen[2][0]);
+                        float w2 = (screen[1][0] - screen[0][0]) * (py - screen[0][1]) - (screen[1][1] - screen[0][1]) * (px - screen[0][0]);
+                        if(w0 < 0.0f || w1 < 0.0f || w2 < 0.0f) {
+                            continue;
+                        }
+                        float depth = (w0 * screen[0][2] + w1 * screen[1][2] + w2 * screen[2][2]) / area;
+                        float& stored = depthBuffer[y * resolution + x];
+                        if(depth < stored) {
+                            covered += stored == 1e30f ? 1 : 0;
+                            stored = depth;
+                            shaded++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return covered > 0 ? (float)shaded / covered : 0.0f;
+}
+
+// Tipsify. Writes the reordered triangles to result. If clusters is given, it receives the index
+// of the first triangle of every cluster, a new cluster starts whenever the fan had to jump to an
+// unrelated vertex.
+inline void optimizeVertexCache(std::vector<uint32_t>& result, const uint32_t* indices, uint64_t numIndices, uint64_t numVertices,
+    uint32_t cacheSize, std::vector<uint32_t>* clusters = 0) {
+    uint64_t numTriangles = numIndices / 3;
+    result.clear();
+    result.reserve(numIndices);
+    if(clusters) {
+        clusters->clear();
+    }
+    if(numTriangles == 0) {
+        return;
+    }
+
+    // Triangles adjacent to every vertex
+    std::vector<uint32_t> liveTriangles(numVertices, 0);
+    for(uint64_t i = 0; i < numTriangles * 3; i++) {
+        liveTriangles[indices[i]]++;
+    }
+    std::vector<uint32_t> adjacencyOffsets(numVertices + 1, 0);
+    for(uint64_t i = 0; i < numVertices; i++) {
+        adjacencyOffsets[i + 1] = adjacencyOffsets[i] + liveTriangles[i];
+    }
+    std::vector<uint32_t> adjacency(numTriangles * 3);
+    std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+    for(uint64_t i = 0; i < numTriangles * 3; i++) {
+        adjacency[fill[indices[i]]++] = (uint32_t)(i / 3);
+    }
+
+    std::vector<uint32_t> timestamps(numVertices, 0);
+    std::vector<bool> emitted(numTriangles, false);
+    std::vector<uint32_t> deadEnds;
+    std::vector<uint32_t> candidates;
+    uint32_t time = cacheSize + 1;
+    uint64_t cursor = 0;
+    int64_t fanningVertex = 0;
+    while(fanningVertex < (int64_t)numVertices && liveTriangles[fanningVertex] == 0) {
+        fanningVertex++;
+    }
+    bool newCluster = true;
+
+    while(fanningVertex >= 0 && fanningVertex < (int64_t)numVertices) {
+        candidates.clear();
+        for(uint32_t a = adjacencyOffsets[fanningVertex]; a < adjacencyOffsets[fanningVertex + 1]; a++) {
+            uint32_t triangle = adjacency[a];
+            if(emitted[triangle]) {
+                continue;
+            }
+            if(newCluster && clusters) {
+                clusters->push_back((uint32_t)(result.size() / 3));
+            }
+            newCluster = false;
+            for(int corner = 0; corner < 3; corner++) {
+                uint32_t vertex = indices[triangle * 3 + corner];
+                result.push_back(vertex);
+                deadEnds.push_back(vertex);
+                candidates.push_back(vertex);
+                liveTriangles[vertex]--;
+                if(time - timestamps[vertex] > cacheSize) {
+                    timestamps[vertex] = time++;
+                }
+            }
+            emitted[triangle] = true;
+        }
+
+        // Next fanning vertex: the oldest vertex that stays in the cache while its remaining
+        // triangles are emitted. Live candidates that would fall out of the cache have priority 0
+        // but still beat a dead end.
+        int64_t next = -1;
+        int64_t bestPriority = -1;
+        for(uint32_t vertex : candidates) {
+            if(liveTriangles[vertex] == 0) {
+                continue;
+            }
+            int64_t priority = 0;
+            if(time - timestamps[vertex] + 2 * liveTriangles[vertex] <= cacheSize) {
+                priority = time - timestamps[vertex];
+            }
+            if(priority > bestPriority) {
+                bestPriority = priority;
+                next = vertex;
+            }
+        }
+
+        if(next < 0) {
+            // Dead end, try recently used vertices first and then scan for any vertex with live triangles
+            while(!deadEnds.empty() && next < 0) {
+                uint32_t vertex = deadEnds.back();
+                deadEnds.pop_back();
+                if(liveTriangles[vertex] > 0) {
+                    next = vertex;
+                }
+            }
+            while(next < 0 && cursor < numVertices) {
+                if(liveTriangles[cursor] > 0) {
+                    next = (int64_t)cursor;
+                }
+                cursor++;
+            }
+            newCluster = true;
+        }
+        fanningVertex = next;
+    }
+}
+
+// Concatenates the triangle ranges starting at boundaries, ordered so that ranges facing away from
+// the center of the mesh come first
+inline void sortClustersOutward(std::vector<uint32_t>& result, const uint32_t* indices, uint64_t numIndices, const float* positions,
+    const std::vector<uint32_t>& boundaries) {
+    uint64_t numTriangles = numIndices / 3;
+    float meshCentroid[3] = {};
+    for(uint64_t i = 0; i < numIndices; i++) {
+        for(int k = 0; k < 3; k++) {
+            meshCentroid[k] += positions[indices[i] * 3 + k] / numIndices;
+        }
+    }
+
+    std::vector<std::pair<float, uint32_t>> sortKeys(boundaries.size());
+    for(uint64_t b = 0; b < boundaries.size(); b++) {
+        uint64_t begin = boundaries[b];
+        uint64_t end = b + 1 < boundaries.size() ? boundaries[b + 1] : numTriangles;
+        float centroid[3] = {};
+        float normal[3] = {};
+        float totalArea = 0.0f;
+        for(uint64_t t = begin; t < end; t++) {
+            const float* p0 = positions + indices[t * 3 + 0] * 3;
+            const float* p1 = positions + indices[t * 3 + 1] * 3;
+            const float* p2 = positions + indices[t * 3 + 2] * 3;
+            float e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+            float e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+            float cross[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+            float area = sqrtf(cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]);
+            for(int k = 0; k < 3; k++) {
+                centroid[k] += (p0[k] + p1[k] + p2[k]) / 3.0f * area;
+                normal[k] += cross[k];
+            }
+            totalArea += area;
+        }
+        float normalLength = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        float key = 0.0f;
+        for(int k = 0; k < 3; k++) {
+            float c = totalArea > 0.0f ? centroid[k] / totalArea : 0.0f;
+            float n = normalLength > 0.0f ? normal[k] / normalLength : 0.0f;
+            key += (c - meshCentroid[k]) * n;
+        }
+        // Descending, outward facing clusters first
+        sortKeys[b] = std::make_pair(-key, (uint32_t)b);
+    }
+    std::stable_sort(sortKeys.begin(), sortKeys.end());
+
+    result.clear();
+    for(const std::pair<float, uint32_t>& sortKey : sortKeys) {
+        uint64_t b = sortKey.second;
+        uint64_t begin = boundaries[b];
+        uint64_t end = b + 1 < boundaries.size() ? boundaries[b + 1] : numTriangles;
+        result.insert(result.end(), indices + begin * 3, indices + end * 3);
+    }
+}
+
+// Sorts the clusters of optimizeVertexCache so that triangles facing away from the center of the
+// mesh are drawn first. Clusters are split further where the cache miss ratio so far is within
+// threshold of the ratio of the whole cluster, a larger threshold gives less overdraw and more
+// cache misses.
+inline void optimizeOverdraw(std::vector<uint32_t>& result, const uint32_t* indices, uint64_t numIndices, const float* positions, uint64_t numVertices,
+    const std::vector<uint32_t>& clusters, uint32_t cacheSize, float threshold) {
+    uint64_t numTriangles = numIndices / 3;
+    result.assign(indices, indices + numIndices);
+    if(numTriangles == 0 || clusters.empty()) {
+        return;
+    }
+
+    std::vector<uint32_t> timestamps(numVertices, 0);
+    uint32_t time = cacheSize + 1;
+    auto countMisses = [&](uint64_t triangle) {
+        uint32_t misses = 0;
+        for(int corner = 0; corner < 3; corner++) {
+            uint32_t vertex = indices[triangle * 3 + corner];
+            if(time - timestamps[vertex] > cacheSize) {
+                timestamps[vertex] = time++;
+                misses++;
+            }
+        }
+        return misses;
+    };
+    auto resetCache = [&]() {
+        time += cacheSize + 1;
+    };
+
+    std::vector<uint32_t> boundaries;
+    for(uint64_t c = 0; c < clusters.size(); c++) {
+        uint64_t begin = clusters[c];
+        uint64_t end = c + 1 < clusters.size() ? clusters[c + 1] : numTriangles;
+        resetCache();
+        uint64_t clusterMisses = 0;
+        for(uint64_t t = begin; t < end; t++) {
+            clusterMisses += countMisses(t);
+        }
+        float clusterThreshold = threshold * (float)clusterMisses / (end - begin);
+
+        resetCache();
+        boundaries.push_back((uint32_t)begin);
+        uint64_t start = begin;
+        uint64_t misses = 0;
+        for(uint64_t t = begin; t < end; t++) {
+            misses += countMisses(t);
+            if(t + 1 < end && (float)misses / (t - start + 1) <= clusterThreshold) {
+                boundaries.push_back((uint32_t)(t + 1));
+                start = t + 1;
+                misses = 0;
+                resetCache();
+            }
+        }
+    }
+
+    // Splitting and reordering loses the cache contents across cluster boundaries, which can cost
+    // more than the threshold allows. Fall back to sorting whole clusters, then to the input order.
+    float maxAcmr = threshold * analyzeVertexCache(indices, numIndices, numVertices, cacheSize).acmr;
+    sortClustersOutward(result, indices, numIndices, positions, boundaries);
+    if(analyzeVertexCache(result.data(), numIndices, numVertices, cacheSize).acmr <= maxAcmr) {
+        return;
+    }
+    sortClustersOutward(result, indices, numIndices, positions, clusters);
+    if(analyzeVertexCache(result.data(), numIndices, numVertices, cacheSize).acmr <= maxAcmr) {
+        return;
+    }
+    result.assign(indices, indices + numIndices);
+}
+
+// Returns the new position of every vertex, in the order of first use. Unused vertices are moved to
+// the end. Returns the number of used vertices.
+inline uint64_t optimizeVertexFetch(std::vector<uint32_t>& remap, const uint32_t* indices, uint64_t numIndices, uint64_t numVertices) {
+    remap.assign(numVertices, ~0u);
+    uint32_t next = 0;
+    for(uint64_t i = 0; i < numIndices; i++) {
+        if(remap[indices[i]] == ~0u) {
+            remap[indices[i]] = next++;
+        }
+    }
+    uint64_t numUsed = next;
+    for(uint64_t i = 0; i < numVertices; i++) {
+        if(remap[i] == ~0u) {
+            remap[i] = next++;
+        }
+    }
+    return numUsed;
+}
@@ -0,0 +1,406 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+// Edge collapse simplification with quadric error metrics (Garland and Heckbert 1997, "Surface
+// Simplification Using Quadric Error Metrics"), extended to vertex attributes as in Garland and
+// Heckbert 1998, "Simplifying Surfaces with Color and Texture using Quadric Error Metrics".
+//
+// Vertices are rows of vertexSize floats (at most SIMPLIFY_MAX_VERTEX_SIZE), the first three are
+// the position and the rest are attributes, scaled by the caller to weigh them against position
+// error in a mesh that is one unit large. Edges are always collapsed onto one of their vertices,
+// so the result indexes the original vertices and can share their vertex buffer.
+//
+// Vertices that share their position with other vertices (attribute seams) and non-manifold
+// vertices never move. Vertices on an open border only collapse along the border, and the border
+// is kept in place by additional planes through the border edges.
+
+const uint32_t SIMPLIFY_MAX_VERTEX_SIZE = 8;
+
+struct SimplifyQuadric {
+    // Upper triangle of the symmetric matrix, row by row
+    float a[SIMPLIFY_MAX_VERTEX_SIZE * (SIMPLIFY_MAX_VERTEX_SIZE + 1) / 2];
+    float b[SIMPLIFY_MAX_VERTEX_SIZE];
+    float c;
+    float weight;
+};
+
+inline void addQuadric(SimplifyQuadric& result, const SimplifyQuadric& quadric) {
+    for(uint32_t i = 0; i < sizeof(result.a) / sizeof(float); i++) {
+        result.a[i] += quadric.a[i];
+    }
+    for(uint32_t i = 0; i < SIMPLIFY_MAX_VERTEX_SIZE; i++) {
+        result.b[i] += quadric.b[i];
+    }
+    result.c += quadric.c;
+    result.weight += quadric.weight;
+}
+
+// Weighted average squared distance of v to the planes the quadric was built from
+inline float evaluateQuadric(const SimplifyQuadric& quadric, const float* v, uint32_t vertexSize) {
+    float result = quadric.c;
+    uint32_t k = 0;
+    for(uint32_t i = 0; i < vertexSize; i++) {
+        float row = quadric.a[k++] * v[i];
+        for(uint32_t j = i + 1; j < vertexSize; j++) {
+            row += 2.0f * quadric.a[k++] * v[j];
+        }
+        result += v[i] * (row + 2.0f * quadric.b[i]);
+    }
+    return quadric.weight > 0.0f ? fabsf(result) / quadric.weight : 0.0f;
+}
+
+// Squared distance to the plane of a triangle in vertexSize dimensions, weighted by its area
+inline void triangleQuadric(SimplifyQuadric& quadric, const float* p0, const float* p1, const float* p2, uint32_t vertexSize, float weight) {
+    memset(&quadric, 0, sizeof(SimplifyQuadric));
+    float e1[SIMPLIFY_MAX_VERTEX_SIZE];
+    float e2[SIMPLIFY_MAX_VERTEX_SIZE];
+    float e1Length = 0.0f;
+    for(uint32_t i = 0; i < vertexSize; i++) {
+        e1[i] = p1[i] - p0[i];
+        e2[i] = p2[i] - p0[i];
+        e1Length += e1[i] * e1[i];
+    }
+    e1Length = sqrtf(e1Length);
+    if(e1Length == 0.0f) {
+        return;
+    }
+    float projection = 0.0f;
+    for(uint32_t i = 0; i < vertexSize; i++) {
+        e1[i] /= e1Length;
+        projection += e2[i] * e1[i];
+    }
+    float e2Length = 0.0f;
+    for(uint32_t i = 0; i < vertexSize; i++) {
+        e2[i] -= projection * e1[i];
+        e2Length += e2[i] * e2[i];
+    }
+    e2Length = sqrtf(e2Length);
+    if(e2Length == 0.0f) {
+        return;
+    }
+    float p0e1 = 0.0f;
+    float p0e2 = 0.0f;
+    float p0p0 = 0.0f;
+    for(uint32_t i = 0; i < vertexSize; i++) {
+        e2[i] /= e2Length;
+        p0e1 += p0[i] * e1[i];
+        p0e2 += p0[i] * e2[i];
+        p0p0 += p0[i] * p0[i];
+    }
+
+    // A = I - e1 e1^T - e2 e2^T, b = (p0.e1) e1 + (p0.e2) e2 - p0, c = p0.p0 - (p0.e1)^2 - (p0.e2)^2
+    uint32_t k = 0;
+    for(uint32_t i = 0; i < vertexSize; i++) {
+        for(uint32_t j = i; j < vertexSize; j++) {
+            quadric.a[k++] = ((i == j ? 1.0f : 0.0f) - e1[i] * e1[j] - e2[i] * e2[j]) * weight;
+        }
+        quadric.b[i] = (p0e1 * e1[i] + p0e2 * e2[i] - p0[i]) * weight;
+    }
+    quadric.c = (p0p0 - p0e1 * p0e1 - p0e2 * p0e2) * weight;
+    quadric.weight = weight;
+}
+
+// Squared distance to a plane through point with the given unit normal, only involves the position
+inline void planeQuadric(SimplifyQuadric& quadric, const float* point, const float* normal, uint32_t vertexSize, float weight) {
+    memset(&quadric, 0, sizeof(SimplifyQuadric));
+    float d = -(normal[0] * point[0] + normal[1] * point[1] + normal[2] * point[2]);
+    uint32_t k = 0;
+    for(uint32_t i = 0; i < vertexSize; i++) {
+        for(uint32_t j = i; j < vertexSize; j++) {
+            quadric.a[k++] = i < 3 && j < 3 ? normal[i] * normal[j] * weight : 0.0f;
+        }
+        quadric.b[i] = i < 3 ? d * normal[i] * weight : 0.0f;
+    }
+    quadric.c = d * d * weight;
+    quadric.weight = weight;
+}
+
+inline void triangleNormal(const float* p0, const float* p1, const float* p2, float* result) {
+    float e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+    float e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+    result[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    result[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    result[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+// Collapses edges in order of increasing error until at most targetNumIndices indices are left or
+// the next collapse would exceed maxError. Returns the largest error of a collapse that was done,
+// as a distance in the units of the positions.
+inline float simplifyMesh(std::vector<uint32_t>& result, const uint32_t* indices, uint64_t numIndices, const float* vertices,
+    uint64_t numVertices, uint32_t vertexSize, uint64_t targetNumIndices, float maxError = FLT_MAX) {
+    result.assign(indices, indices + numIndices);
+    if(numIndices == 0 || vertexSize < 3 || vertexSize > SIMPLIFY_MAX_VERTEX_SIZE) {
+        return 0.0f;
+    }
+
+    // Positions are scaled to a unit box, so the attribute weights mean the same for every mesh
+    float boundsMin[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float boundsMax[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for(uint64_t i = 0; i < numVertices; i++) {
+        for(int k = 0; k < 3; k++) {
+            boundsMin[k] = std::min(boundsMin[k], vertices[i * vertexSize + k]);
+            boundsMax[k] = std::max(boundsMax[k], vertices[i * vertexSize + k]);
+        }
+    }
+    float extent = std::max(boundsMax[0] - boundsMin[0], std::max(boundsMax[1] - boundsMin[1], boundsMax[2] - boundsMin[2]));
+    float scale = extent > 0.0f ? 1.0f / extent : 1.0f;
+    std::vector<float> data(vertices, vertices + numVertices * vertexSize);
+    for(uint64_t i = 0; i < numVertices; i++) {
+        for(int k = 0; k < 3; k++) {
+            data[i * vertexSize + k] = (data[i * vertexSize + k] - boundsMin[k]) * scale;
+        }
+    }
+    auto vertex = [&](uint32_t index) {
+        return &data[(uint64_t)index * vertexSize];
+    };
+
+    // Vertices with the same position, only the first one of each group is used as its id
+    std::vector<uint32_t> positionIds(numVertices);
+    std::vector<uint32_t> numWedges(numVertices, 0);
+    {
+        struct PositionHash {
+            size_t operator()(const std::vector<float>::const_iterator& position) const {
+                uint32_t bits[3];
+                memcpy(bits, &position[0], sizeof(bits));
+                return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+            }
+        };
+        struct PositionEqual {
+            bool operator()(const std::vector<float>::const_iterator& a, const std::vector<float>::const_iterator& b) const {
+                return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+            }
+        };
+        std::unordered_map<std::vector<float>::const_iterator, uint32_t, PositionHash, PositionEqual> firstVertices;
+        std::vector<bool> used(numVertices, false);
+        for(uint64_t i = 0; i < numIndices; i++) {
+            used[indices[i]] = true;
+        }
+        for(uint32_t i = 0; i < numVertices; i++) {
+            positionIds[i] = firstVertices.insert(std::make_pair(data.cbegin() + (uint64_t)i * vertexSize, i)).first->second;
+            numWedges[positionIds[i]] += used[i] ? 1 : 0;
+        }
+    }
+
+    // Border edges are half edges between two positions without a twin in the opposite direction
+    enum VertexKind { MANIFOLD, BORDER, LOCKED };
+    std::vector<uint8_t> kinds(numVertices, MANIFOLD);
+    std::vector<uint32_t> borderNext(numVertices, ~0u);
+    std::vector<uint32_t> borderPrev(numVertices, ~0u);
+    std::vector<SimplifyQuadric> quadrics(numVertices);
+    memset(quadrics.data(), 0, quadrics.size() * sizeof(SimplifyQuadric));
+    {
+        std::unordered_map<uint64_t, uint32_t> halfEdges;
+        for(uint64_t i = 0; i < numIndices; i += 3) {
+            for(int e = 0; e < 3; e++) {
+                uint64_t from = positionIds[indices[i + e]];
+                uint64_t to = positionIds[indices[i + (e + 1) % 3]];
+                halfEdges[(from << 32) | to]++;
+            }
+        }
+        // Counted per position
+        std::vector<uint32_t> numBorderOut(numVertices, 0);
+        std::vector<uint32_t> numBorderIn(numVertices, 0);
+        std::vector<bool> nonManifold(numVertices, false);
+        for(uint64_t i = 0; i < numIndices; i += 3) {
+            const float* p[3] = {vertex(indices[i]), vertex(indices[i + 1]), vertex(indices[i + 2])};
+            float normal[3];
+            triangleNormal(p[0], p[1], p[2], normal);
+            float area = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+
+            SimplifyQuadric quadric;
+            triangleQuadric(quadric, p[0], p[1], p[2], vertexSize, area);
+            for(int e = 0; e < 3; e++) {
+                addQuadric(quadrics[indices[i + e]], quadric);
+            }
+
+            for(int e = 0; e < 3; e++) {
+                uint32_t from = indices[i + e];
+                uint32_t to = indices[i + (e + 1) % 3];
+                uint64_t fromId = positionIds[from];
+                uint64_t toId = positionIds[to];
+                if(halfEdges[(fromId << 32) | toId] > 1) {
+                    nonManifold[fromId] = true;
+                    nonManifold[toId] = true;
+                }
+                if(halfEdges.count((toId << 32) | fromId)) {
+                    continue;
+                }
+                numBorderOut[fromId]++;
+                numBorderIn[toId]++;
+                borderNext[from] = to;
+                borderPrev[to] = from;
+
+                // Plane through the border edge, perpendicular to the triangle, keeps the outline
+                const float* p0 = vertex(from);
+                const float* p1 = vertex(to);
+                float edge[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+                float planeNormal[3] = {edge[1] * normal[2] - edge[2] * normal[1], edge[2] * normal[0] - edge[0] * normal[2], edge[0] * normal[1] - edge[1] * normal[0]};
+                float planeLength = sqrtf(planeNormal[0] * planeNormal[0] + planeNormal[1] * planeNormal[1] + planeNormal[2] * planeNormal[2]);
+                if(planeLength > 0.0f) {
+                    const float borderWeight = 10.0f;
+                    float edgeLengthSquared = edge[0] * edge[0] + edge[1] * edge[1] + edge[2] * edge[2];
+                    for(int k = 0; k < 3; k++) {
+                        planeNormal[k] /= planeLength;
+                    }
+                    planeQuadric(quadric, p0, planeNormal, vertexSize, borderWeight * edgeLengthSquared);
+                    addQuadric(quadrics[from], quadric);
+                    addQuadric(quadrics[to], quadric);
+                }
+            }
+        }
+        for(uint32_t i = 0; i < numVertices; i++) {
+            uint32_t id = positionIds[i];
+            if(numWedges[id] > 1 || nonManifold[id] || numBorderOut[id] > 1 || numBorderOut[id] != numBorderIn[id]) {
+                kinds[i] = LOCKED;
+            } else {
+                kinds[i] = numBorderOut[id] ? BORDER : MANIFOLD;
+            }
+        }
+    }
+
+    struct Collapse {
+        float error;
+        uint32_t from;
+        uint32_t to;
+        bool operator<(const Collapse& other) const {
+            return error < other.error;
+        }
+    };
+    auto canCollapse = [&](uint32_t from, uint32_t to) {
+        return kinds[from] == MANIFOLD || (kinds[from] == BORDER && (borderNext[from] == to || borderPrev[from] == to));
+    };
+    auto collapseError = [&](uint32_t from, uint32_t to) {
+        SimplifyQuadric quadric = quadrics[from];
+        addQuadric(quadric, quadrics[to]);
+        return evaluateQuadric(quadric, vertex(to), vertexSize);
+    };
+
+    float maxNormalizedError = maxError < FLT_MAX ? maxError * scale * maxError * scale : FLT_MAX;
+    float resultError = 0.0f;
+    std::vector<uint32_t> remap(numVertices);
+    std::vector<bool> touched(numVertices);
+    std::vector<uint32_t> firstTriangle(numVertices + 1);
+    std::vector<uint32_t> vertexTriangles;
+    std::vector<Collapse> collapses;
+    while(result.size() > targetNumIndices) {
+        uint64_t numTriangles = result.size() / 3;
+
+        // Triangles around every vertex
+        std::fill(firstTriangle.begin(), firstTriangle.end(), 0);
+        for(uint32_t index : result) {
+            firstTriangle[index + 1]++;
+        }
+        for(uint64_t i = 0; i < numVertices; i++) {
+            firstTriangle[i + 1] += firstTriangle[i];
+        }
+        vertexTriangles.resize(result.size());
+        std::vector<uint32_t> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+        for(uint64_t i = 0; i < result.size(); i++) {
+            vertexTriangles[fill[result[i]]++] = (uint32_t)(i / 3);
+        }
+
+        collapses.clear();
+        for(uint64_t i = 0; i < result.size(); i += 3) {
+            for(int e = 0; e < 3; e++) {
+                uint32_t v0 = result[i + e];
+                uint32_t v1 = result[i + (e + 1) % 3];
+                // Every interior edge is seen from both of its triangles, only take it once
+                if(v0 > v1 && kinds[v0] != BORDER && kinds[v1] != BORDER) {
+                    continue;
+                }
+                float error01 = canCollapse(v0, v1) ? collapseError(v0, v1) : FLT_MAX;
+                float error10 = canCollapse(v1, v0) ? collapseError(v1, v0) : FLT_MAX;
+                if(error01 == FLT_MAX && error10 == FLT_MAX) {
+                    continue;
+                }
+                Collapse collapse = error01 <= error10 ? Collapse{error01, v0, v1} : Collapse{error10, v1, v0};
+                collapses.push_back(collapse);
+            }
+        }
+        std::sort(collapses.begin(), collapses.end());
+
+        for(uint32_t i = 0; i < numVertices; i++) {
+            remap[i] = i;
+        }
+        std::fill(touched.begin(), touched.end(), false);
+        uint64_t trianglesToRemove = numTriangles - targetNumIndices / 3;
+        uint64_t trianglesRemoved = 0;
+        uint64_t numCollapses = 0;
+        for(const Collapse& collapse : collapses) {
+            if(trianglesRemoved >= trianglesToRemove || collapse.error > maxNormalizedError) {
+                break;
+            }
+            uint32_t from = collapse.from;
+            uint32_t to = collapse.to;
+            if(touched[from] || touched[to]) {
+                continue;
+            }
+
+            // Reject collapses that flip a triangle around the vertex that moves
+            bool flips = false;
+            for(uint32_t t = firstTriangle[from]; t < firstTriangle[from + 1] && !flips; t++) {
+                const uint32_t* triangle = &result[vertexTriangles[t] * 3];
+                if(triangle[0] == to || triangle[1] == to || triangle[2] == to) {
+                    continue;
+                }
+                const float* before[3] = {vertex(triangle[0]), vertex(triangle[1]), vertex(triangle[2])};
+                const float* after[3] = {before[0], before[1], before[2]};
+                for(int k = 0; k < 3; k++) {
+                    after[k] = triangle[k] == from ? vertex(to) : before[k];
+                }
+                float normalBefore[3];
+                float normalAfter[3];
+                triangleNormal(before[0], before[1], before[2], normalBefore);
+                triangleNormal(after[0], after[1], after[2], normalAfter);
+                flips = normalBefore[0] * normalAfter[0] + normalBefore[1] * normalAfter[1] + normalBefore[2] * normalAfter[2] <= 0.0f;
+            }
+            if(flips) {
+                continue;
+            }
+
+            remap[from] = to;
+            addQuadric(quadrics[to], quadrics[from]);
+            // The neighborhood changes, so it is not touched again until the next pass
+            for(uint32_t t = firstTriangle[from]; t < firstTriangle[from + 1]; t++) {
+                const uint32_t* triangle = &result[vertexTriangles[t] * 3];
+                touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = true;
+            }
+            if(kinds[from] == BORDER) {
+                // Take the border edge of the removed vertex over
+                if(borderNext[from] == to) {
+                    borderPrev[to] = borderPrev[from];
+                    borderNext[borderPrev[from]] = to;
+                } else {
+                    borderNext[to] = borderNext[from];
+                    borderPrev[borderNext[from]] = to;
+                }
+            }
+            resultError = std::max(resultError, collapse.error);
+            trianglesRemoved += kinds[from] == BORDER ? 1 : 2;
+            numCollapses++;
+        }
+        if(numCollapses == 0) {
+            break;
+        }
+
+        uint64_t numResultIndices = 0;
+        for(uint64_t i = 0; i < result.size(); i += 3) {
+            uint32_t a = remap[result[i]];
+            uint32_t b = remap[result[i + 1]];
+            uint32_t c = remap[result[i + 2]];
+            if(a != b && a != c && b != c) {
+                result[numResultIndices++] = a;
+                result[numResultIndices++] = b;
+                result[numResultIndices++] = c;
+            }
+        }
+        result.resize(numResultIndices);
+    }
+    return sqrtf(resultError) / scale;
+}
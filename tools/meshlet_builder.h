@@ -0,0 +1,219 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cfloat>
+
+// Splits the triangles of a mesh into meshlets, small clusters that the renderer culls as a whole.
+// Every meshlet gets a bounding sphere and a normal cone that bounds the normals of its triangles,
+// so meshlets outside the view or facing away from the camera can be skipped before they are drawn.
+//
+// Meshlets are grown greedily. A meshlet starts with the first triangle left in index order and
+// then takes the adjacent triangle that adds the fewest new vertices, and of those the one closest
+// to its center, until it is full. If no adjacent triangle fits, the next triangle in index order is
+// taken, so on a cache optimized index buffer the meshlets follow the Tipsify clusters. Triangles
+// keep their relative order inside a meshlet, which preserves most of the vertex cache locality.
+//
+// Positions are tightly packed float triples.
+
+struct Meshlet {
+    // Range of the reordered index buffer
+    uint32_t firstIndex;
+    uint32_t numIndices;
+    uint32_t numVertices;
+    float center[3];
+    float radius;
+    // The meshlet faces away from a camera at p if
+    // dot(center - p, coneAxis) >= coneCutoff * length(center - p) + radius. A cutoff of 1 never culls.
+    float coneAxis[3];
+    float coneCutoff;
+};
+
+// Bounding sphere around the center of the bounding box, and the normal cone. The cone is only
+// useful while the normals spread less than about 84 degrees from the axis, wider cones never cull.
+inline void computeMeshletBounds(Meshlet& meshlet, const uint32_t* indices, const float* positions) {
+    float min[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float max[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    float normalSum[3] = {0.0f, 0.0f, 0.0f};
+    std::vector<float> normals;
+    for(uint32_t i = 0; i < meshlet.numIndices; i += 3) {
+        const float* p[3];
+        for(uint32_t corner = 0; corner < 3; corner++) {
+            p[corner] = positions + indices[i + corner] * 3;
+            for(uint32_t k = 0; k < 3; k++) {
+                min[k] = std::min(min[k], p[corner][k]);
+                max[k] = std::max(max[k], p[corner][k]);
+            }
+        }
+        float e1[3] = {p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2]};
+        float e2[3] = {p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2]};
+        float normal[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+        float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        // Degenerate triangles are never visible and don't constrain the cone
+        if(length == 0.0f) {
+            continue;
+        }
+        for(uint32_t k = 0; k < 3; k++) {
+            normals.push_back(normal[k] / length);
+            normalSum[k] += normal[k] / length;
+        }
+    }
+
+    float radiusSquared = 0.0f;
+    for(uint32_t k = 0; k < 3; k++) {
+        meshlet.center[k] = (min[k] + max[k]) * 0.5f;
+    }
+    for(uint32_t i = 0; i < meshlet.numIndices; i++) {
+        const float* p = positions + indices[i] * 3;
+        float d[3] = {p[0] - meshlet.center[0], p[1] - meshlet.center[1], p[2] - meshlet.center[2]};
+        radiusSquared = std::max(radiusSquared, d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    }
+    meshlet.radius = sqrtf(radiusSquared);
+
+    float axisLength = sqrtf(normalSum[0] * normalSum[0] + normalSum[1] * normalSum[1] + normalSum[2] * normalSum[2]);
+    meshlet.coneAxis[0] = 0.0f;
+    meshlet.coneAxis[1] = 0.0f;
+    meshlet.coneAxis[2] = 1.0f;
+    meshlet.coneCutoff = 1.0f;
+    if(axisLength == 0.0f) {
+        return;
+    }
+    float axis[3] = {normalSum[0] / axisLength, normalSum[1] / axisLength, normalSum[2] / axisLength};
+    float minDot = 1.0f;
+    for(uint64_t i = 0; i < normals.size(); i += 3) {
+        minDot = std::min(minDot, axis[0] * normals[i] + axis[1] * normals[i + 1] + axis[2] * normals[i + 2]);
+    }
+    if(minDot <= 0.1f) {
+        return;
+    }
+    meshlet.coneAxis[0] = axis[0];
+    meshlet.coneAxis[1] = axis[1];
+    meshlet.coneAxis[2] = axis[2];
+    // Sine of the cone angle: the view direction must be within 90 degrees minus that angle of the axis
+    meshlet.coneCutoff = sqrtf(1.0f - minDot * minDot);
+}
+
+// Writes the triangles ordered by meshlet to result and the meshlets to meshlets. Every meshlet has
+// at most maxVertices unique vertices and maxTriangles triangles.
+inline void buildMeshlets(std::vector<Meshlet>& meshlets, std::vector<uint32_t>& result, const uint32_t* indices, uint64_t numIndices,
+    const float* positions, uint64_t numVertices, uint32_t maxVertices = 64, uint32_t maxTriangles = 124) {
+    uint64_t numTriangles = numIndices / 3;
+    meshlets.clear();
+    result.clear();
+    result.reserve(numTriangles * 3);
+
+    // Triangles adjacent to every vertex
+    std::vector<uint32_t> liveTriangles(numVertices, 0);
+    for(uint64_t i = 0; i < numTriangles * 3; i++) {
+        liveTriangles[indices[i]]++;
+    }
+    std::vector<uint32_t> adjacencyOffsets(numVertices + 1, 0);
+    for(uint64_t i = 0; i < numVertices; i++) {
+        adjacencyOffsets[i + 1] = adjacencyOffsets[i] + liveTriangles[i];
+    }
+    std::vector<uint32_t> adjacency(numTriangles * 3);
+    std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+    for(uint64_t i = 0; i < numTriangles * 3; i++) {
+        adjacency[fill[indices[i]]++] = (uint32_t)(i / 3);
+    }
+
+    std::vector<bool> emitted(numTriangles, false);
+    // Meshlet index + 1 of the meshlet that used every vertex last
+    std::vector<uint32_t> vertexMeshlet(numVertices, 0);
+    std::vector<uint32_t> meshletVertices;
+    std::vector<uint32_t> meshletTriangles;
+    uint64_t cursor = 0;
+    while(true) {
+        while(cursor < numTriangles && emitted[cursor]) {
+            cursor++;
+        }
+        if(cursor == numTriangles) {
+            break;
+        }
+        uint32_t stamp = (uint32_t)meshlets.size() + 1;
+        meshletVertices.clear();
+        meshletTriangles.clear();
+        float positionSum[3] = {0.0f, 0.0f, 0.0f};
+        auto newVertices = [&](uint64_t triangle) {
+            uint32_t count = 0;
+            for(uint32_t corner = 0; corner < 3; corner++) {
+                count += vertexMeshlet[indices[triangle * 3 + corner]] != stamp ? 1 : 0;
+            }
+            return count;
+        };
+
+        int64_t triangle = (int64_t)cursor;
+        while(triangle >= 0) {
+            emitted[triangle] = true;
+            meshletTriangles.push_back((uint32_t)triangle);
+            for(uint32_t corner = 0; corner < 3; corner++) {
+                uint32_t vertex = indices[triangle * 3 + corner];
+                liveTriangles[vertex]--;
+                if(vertexMeshlet[vertex] != stamp) {
+                    vertexMeshlet[vertex] = stamp;
+                    meshletVertices.push_back(vertex);
+                    for(uint32_t k = 0; k < 3; k++) {
+                        positionSum[k] += positions[vertex * 3 + k];
+                    }
+                }
+            }
+            if(meshletTriangles.size() >= maxTriangles) {
+                break;
+            }
+
+            float center[3];
+            for(uint32_t k = 0; k < 3; k++) {
+                center[k] = positionSum[k] / meshletVertices.size();
+            }
+            triangle = -1;
+            uint32_t bestNewVertices = 3;
+            float bestDistance = FLT_MAX;
+            for(uint32_t vertex : meshletVertices) {
+                if(liveTriangles[vertex] == 0) {
+                    continue;
+                }
+                for(uint32_t a = adjacencyOffsets[vertex]; a < adjacencyOffsets[vertex + 1]; a++) {
+                    uint32_t candidate = adjacency[a];
+                    if(emitted[candidate]) {
+                        continue;
+                    }
+                    uint32_t count = newVertices(candidate);
+                    if(meshletVertices.size() + count > maxVertices || count > bestNewVertices) {
+                        continue;
+                    }
+                    float distance = 0.0f;
+                    for(uint32_t k = 0; k < 3; k++) {
+                        float d = (positions[indices[candidate * 3] * 3 + k] + positions[indices[candidate * 3 + 1] * 3 + k]
+                            + positions[indices[candidate * 3 + 2] * 3 + k]) / 3.0f - center[k];
+                        distance += d * d;
+                    }
+                    if(count < bestNewVertices || distance < bestDistance) {
+                        bestNewVertices = count;
+                        bestDistance = distance;
+                        triangle = candidate;
+                    }
+                }
+            }
+            if(triangle < 0) {
+                while(cursor < numTriangles && emitted[cursor]) {
+                    cursor++;
+                }
+                if(cursor < numTriangles && meshletVertices.size() + newVertices(cursor) <= maxVertices) {
+                    triangle = (int64_t)cursor;
+                }
+            }
+        }
+
+        std::sort(meshletTriangles.begin(), meshletTriangles.end());
+        Meshlet meshlet;
+        meshlet.firstIndex = (uint32_t)result.size();
+        meshlet.numIndices = (uint32_t)meshletTriangles.size() * 3;
+        meshlet.numVertices = (uint32_t)meshletVertices.size();
+        for(uint64_t t : meshletTriangles) {
+            result.insert(result.end(), indices + t * 3, indices + t * 3 + 3);
+        }
+        computeMeshletBounds(meshlet, result.data() + meshlet.firstIndex, positions);
+        meshlets.push_back(meshlet);
+    }
+}
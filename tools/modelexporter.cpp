@@ -1,12 +1,47 @@
 #include <iostream>
 #include <vector>
 #include <cassert>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
 #include <string>
 #include <fstream>
+#include <chrono>
+#include <map>
+#include <set>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
+#include "../bmf.h"
+#include "../bmf_codec.h"
+#include "../bmf_file.h"
+#include "mesh_optimizer.h"
+#include "mesh_simplifier.h"
+#include "meshlet_builder.h"
+#include "texture_compressor.h"
+#include "occlusion_baker.h"
+#include "../thread_pool.h"
+#include "cook_manifest.h"
+#include "../libs/glm/glm.hpp"
+#include "../libs/glm/gtc/packing.hpp"
+#include "../libs/glm/gtc/matrix_inverse.hpp"
+// Textures of several files are decoded at once and the failure string is an unsynchronized global
+#define STBI_NO_FAILURE_STRINGS
+#define STB_IMAGE_IMPLEMENTATION
+#include "../libs/stb_image.h"
+
 struct Position {
     float x, y, z;
 };
@@ -22,6 +57,8 @@ struct Material {
     float shininess;
     aiString diffuseMapName;
     aiString normalMapName;
+    // Empty if the material has no specular map
+    aiString specularMapName;
 };
 
 struct BMFMaterial {
@@ -31,6 +68,13 @@ struct BMFMaterial {
     float shininess;
 };
 
+// Range of the full detail indices of a merged mesh that came from one source mesh
+struct Submesh {
+    uint32_t firstIndex;
+    uint32_t numIndices;
+    uint32_t sourceMesh;
+};
+
 struct Mesh {
     std::vector<Position> positions;
     std::vector<Position> normals;
@@ -38,12 +82,68 @@ struct Mesh {
     std::vector<Position2D> uvs;
     std::vector<uint32_t> indices;
     int materialIndex;
+    // Coarser levels of detail, indexing the same vertices
+    std::vector<std::vector<uint32_t>> lods;
+    std::vector<float> lodErrors;
+    // Clusters of the full detail indices
+    std::vector<Meshlet> meshlets;
+    // Empty unless several source meshes were merged into this one
+    std::vector<Submesh> submeshes;
+    // Baked ambient occlusion per vertex, empty if it was not baked
+    std::vector<float> occlusion;
+};
+
+struct ExportOptions {
+    bool quantize = false;
+    bool compress = false;
+    bool split16 = false;
+    // 0 to reference the texture files by name, otherwise a BMFTextureFormat. BMF_TEXTURE_BC1
+    // stands for block compression, which picks BC1, BC3 or BC5 per texture.
+    uint32_t embedTextures = 0;
+    bool optimize = false;
+    uint32_t cacheSize = 16;
+    float overdrawThreshold = 1.05f;
+    // Levels of detail per mesh, including the full detail one
+    uint32_t numLods = 1;
+    bool meshlets = false;
+    bool merge = false;
+    // Write every mesh as soon as it is processed instead of keeping them all in memory
+    bool stream = false;
+    // Ambient occlusion rays per vertex, 0 to not bake it
+    uint32_t occlusionRays = 0;
+    // Length of the occlusion rays, 0 for a tenth of the scene size
+    float occlusionDistance = 0.0f;
+};
+
+// Everything imported from one model file
+struct ExportScene {
+    std::vector<Mesh> meshes;
+    std::vector<Material> materials;
+    std::vector<BMFNodeRecord> nodes;
+    std::vector<uint32_t> nodeMeshes;
 };
 
-std::vector<Mesh> meshes;
-std::vector<Material> materials;
+// Set once from the command line, read by all export threads
+ExportOptions options;
+
+// Increase when the exporter writes different output for the same input and options, so cooked
+// files are rebuilt
+const uint32_t EXPORTER_VERSION = 4;
 
-void processMesh(aiMesh* mesh, const aiScene* scene) {
+// Alpha below which basic.fs discards diffuse texels, the mips keep the coverage of this test
+const float ALPHA_TEST_THRESHOLD = 0.9f;
+
+// Everything in ExportOptions that changes the output
+uint64_t hashOptions() {
+    std::ostringstream text;
+    text << BMF_VERSION << " " << options.quantize << " " << options.compress << " " << options.split16 << " "
+        << options.embedTextures << " " << options.optimize << " " << options.cacheSize << " " << options.overdrawThreshold << " "
+        << options.numLods << " " << options.meshlets << " " << options.merge << " " << options.occlusionRays << " " << options.occlusionDistance;
+    std::string optionsText = text.str();
+    return bmfHash(optionsText.data(), optionsText.size());
+}
+
+void processMesh(aiMesh* mesh, const aiScene* scene, ExportScene& result) {
     Mesh m;
     for(unsigned int i = 0; i < mesh->mNumVertices; i++) {
         Position position;
@@ -65,7 +165,7 @@ void processMesh(aiMesh* mesh, const aiScene* scene) {
         m.tangents.push_back(tangent);
 
         Position2D uv;
-        assert(mesh->mNumUVComponents > 0);
+        assert(mesh->mNumUVComponents[0] > 0);
         uv.x = mesh->mTextureCoords[0][i].x;
         uv.y = mesh->mTextureCoords[0][i].y;
         m.uvs.push_back(uv);
@@ -80,18 +180,32 @@ void processMesh(aiMesh* mesh, const aiScene* scene) {
     }
 
     m.materialIndex = mesh->mMaterialIndex;
-    meshes.push_back(m);
+    result.meshes.push_back(m);
 }
 
-void processNode(aiNode* node, const aiScene* scene) {
-
+// Meshes are written once in scene order, nodes only reference them, so a mesh used by many nodes
+// is stored once and drawn instanced
+void processNode(aiNode* node, const aiScene* scene, uint32_t parent, ExportScene& result) {
+    BMFNodeRecord record = {};
+    const aiMatrix4x4& m = node->mTransformation;
+    float transform[16] = {
+        m.a1, m.b1, m.c1, m.d1,
+        m.a2, m.b2, m.c2, m.d2,
+        m.a3, m.b3, m.c3, m.d3,
+        m.a4, m.b4, m.c4, m.d4
+    };
+    memcpy(record.transform, transform, sizeof(transform));
+    record.parent = parent;
+    record.firstMesh = (uint32_t)result.nodeMeshes.size();
+    record.numMeshes = node->mNumMeshes;
     for(unsigned int i = 0; i < node->mNumMeshes; i++) {
-        aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-        processMesh(mesh, scene);
+        result.nodeMeshes.push_back(node->mMeshes[i]);
     }
+    uint32_t index = (uint32_t)result.nodes.size();
+    result.nodes.push_back(record);
 
     for(unsigned int i = 0; i < node->mNumChildren; i++) {
-        processNode(node->mChildren[i], scene);
+        processNode(node->mChildren[i], scene, index, result);
     }
 }
 
@@ -106,7 +220,700 @@ char* getFilename(char* filename) {
     return lastSlash;
 }
 
-void processMaterials(const aiScene* scene) {
+BMFBoundsRecord computeBounds(const Mesh& mesh) {
+    BMFBoundsRecord bounds = {};
+    for(uint64_t i = 0; i < mesh.positions.size(); i++) {
+        const float* position = &mesh.positions[i].x;
+        for(int k = 0; k < 3; k++) {
+            bounds.min[k] = (i == 0 || position[k] < bounds.min[k]) ? position[k] : bounds.min[k];
+            bounds.max[k] = (i == 0 || position[k] > bounds.max[k]) ? position[k] : bounds.max[k];
+        }
+    }
+    return bounds;
+}
+
+int16_t quantizeSnorm16(float value) {
+    value = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+    return (int16_t)roundf(value * 32767.0f);
+}
+
+// Maps a unit vector onto the octahedron unfolded into the [-1, 1] square
+void octahedralEncode(const Position& v, int16_t* result) {
+    float length = fabsf(v.x) + fabsf(v.y) + fabsf(v.z);
+    float x = length > 0.0f ? v.x / length : 0.0f;
+    float y = length > 0.0f ? v.y / length : 0.0f;
+    if(v.z < 0.0f) {
+        float foldedX = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float foldedY = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = foldedX;
+        y = foldedY;
+    }
+    result[0] = quantizeSnorm16(x);
+    result[1] = quantizeSnorm16(y);
+}
+
+// Converts the vertices of a mesh into the interleaved layout of the bmf file
+void encodeVertices(const Mesh& mesh, const BMFBoundsRecord& bounds, std::vector<uint8_t>& data) {
+    uint64_t numVertices = mesh.positions.size();
+    bool hasOcclusion = !mesh.occlusion.empty();
+    if(!options.quantize) {
+        uint64_t vertexSize = hasOcclusion ? 12 : 11;
+        data.resize(numVertices * vertexSize * sizeof(float));
+        float* vertex = (float*)data.data();
+        for(uint64_t i = 0; i < numVertices; i++) {
+            float values[12] = {
+                mesh.positions[i].x, mesh.positions[i].y, mesh.positions[i].z,
+                mesh.normals[i].x, mesh.normals[i].y, mesh.normals[i].z,
+                mesh.tangents[i].x, mesh.tangents[i].y, mesh.tangents[i].z,
+                mesh.uvs[i].x, mesh.uvs[i].y, hasOcclusion ? mesh.occlusion[i] : 1.0f
+            };
+            memcpy(vertex, values, vertexSize * sizeof(float));
+            vertex += vertexSize;
+        }
+        return;
+    }
+
+    data.resize(numVertices * sizeof(BMFQuantizedVertex));
+    BMFQuantizedVertex* vertices = (BMFQuantizedVertex*)data.data();
+    for(uint64_t i = 0; i < numVertices; i++) {
+        BMFQuantizedVertex& vertex = vertices[i];
+        const float* position = &mesh.positions[i].x;
+        for(int k = 0; k < 3; k++) {
+            float extent = bounds.max[k] - bounds.min[k];
+            float normalized = extent > 0.0f ? (position[k] - bounds.min[k]) / extent : 0.0f;
+            vertex.position[k] = (uint16_t)(normalized * 65535.0f + 0.5f);
+        }
+        vertex.position[3] = hasOcclusion ? (uint16_t)(mesh.occlusion[i] * 65535.0f + 0.5f) : 0;
+        octahedralEncode(mesh.normals[i], vertex.normal);
+        octahedralEncode(mesh.tangents[i], vertex.tangent);
+        vertex.textureCoord[0] = glm::packHalf1x16(mesh.uvs[i].x);
+        vertex.textureCoord[1] = glm::packHalf1x16(mesh.uvs[i].y);
+    }
+}
+
+bool isSamePosition(const Position& a, const Position& b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+bool isSameMaterial(const Material& a, const Material& b) {
+    return isSamePosition(a.diffuse, b.diffuse) && isSamePosition(a.specular, b.specular) && isSamePosition(a.emissive, b.emissive)
+        && a.shininess == b.shininess && a.diffuseMapName == b.diffuseMapName && a.normalMapName == b.normalMapName
+        && a.specularMapName == b.specularMapName;
+}
+
+// Replaces materials with the same colors and textures as an earlier material by that material
+void mergeMaterials(ExportScene& scene, std::ostream& log) {
+    std::vector<Material> materials;
+    std::vector<uint32_t> remap(scene.materials.size());
+    for(uint64_t i = 0; i < scene.materials.size(); i++) {
+        uint32_t index = 0;
+        while(index < materials.size() && !isSameMaterial(materials[index], scene.materials[i])) {
+            index++;
+        }
+        if(index == materials.size()) {
+            materials.push_back(scene.materials[i]);
+        }
+        remap[i] = index;
+    }
+    for(Mesh& mesh : scene.meshes) {
+        mesh.materialIndex = remap[mesh.materialIndex];
+    }
+    log << "Merged " << scene.materials.size() << " materials into " << materials.size() << std::endl;
+    scene.materials.swap(materials);
+}
+
+// Concatenates meshes that use the same material and are referenced by the same nodes, so they are
+// drawn with a single call. Merged meshes are kept at 65536 vertices or less, so they still get 16
+// bit indices. Every merged mesh remembers the index ranges of its source meshes.
+void mergeMeshes(ExportScene& scene, std::ostream& log) {
+    const uint64_t maxMergedVertices = 65536;
+    std::vector<Mesh>& meshes = scene.meshes;
+    // Nodes that reference every mesh, in node order and once per reference
+    std::vector<std::vector<uint32_t>> meshNodes(meshes.size());
+    for(uint32_t i = 0; i < scene.nodes.size(); i++) {
+        const BMFNodeRecord& node = scene.nodes[i];
+        for(uint32_t j = node.firstMesh; j < node.firstMesh + node.numMeshes; j++) {
+            meshNodes[scene.nodeMeshes[j]].push_back(i);
+        }
+    }
+
+    std::vector<Mesh> merged;
+    std::vector<uint32_t> mergedIndex(meshes.size());
+    std::vector<bool> firstOfMerged(meshes.size(), false);
+    // Merged mesh that is being filled for every material and list of nodes
+    std::map<std::pair<int, std::vector<uint32_t>>, uint32_t> filling;
+    for(uint32_t i = 0; i < meshes.size(); i++) {
+        Mesh& mesh = meshes[i];
+        auto key = std::make_pair(mesh.materialIndex, meshNodes[i]);
+        auto it = filling.find(key);
+        if(it != filling.end() && merged[it->second].positions.size() + mesh.positions.size() <= maxMergedVertices) {
+            Mesh& target = merged[it->second];
+            uint32_t baseVertex = (uint32_t)target.positions.size();
+            target.submeshes.push_back({(uint32_t)target.indices.size(), (uint32_t)mesh.indices.size(), i});
+            target.positions.insert(target.positions.end(), mesh.positions.begin(), mesh.positions.end());
+            target.normals.insert(target.normals.end(), mesh.normals.begin(), mesh.normals.end());
+            target.tangents.insert(target.tangents.end(), mesh.tangents.begin(), mesh.tangents.end());
+            target.uvs.insert(target.uvs.end(), mesh.uvs.begin(), mesh.uvs.end());
+            for(uint32_t index : mesh.indices) {
+                target.indices.push_back(index + baseVertex);
+            }
+            mergedIndex[i] = it->second;
+        } else {
+            filling[key] = (uint32_t)merged.size();
+            mergedIndex[i] = (uint32_t)merged.size();
+            firstOfMerged[i] = true;
+            mesh.submeshes.push_back({0, (uint32_t)mesh.indices.size(), i});
+            merged.push_back(std::move(mesh));
+        }
+    }
+    for(Mesh& mesh : merged) {
+        if(mesh.submeshes.size() == 1) {
+            mesh.submeshes.clear();
+        }
+    }
+
+    // A node referenced all meshes of a merged mesh, the reference of the first one is kept
+    std::vector<uint32_t> nodeMeshes;
+    for(BMFNodeRecord& node : scene.nodes) {
+        uint32_t firstMesh = (uint32_t)nodeMeshes.size();
+        for(uint32_t i = node.firstMesh; i < node.firstMesh + node.numMeshes; i++) {
+            if(firstOfMerged[scene.nodeMeshes[i]]) {
+                nodeMeshes.push_back(mergedIndex[scene.nodeMeshes[i]]);
+            }
+        }
+        node.firstMesh = firstMesh;
+        node.numMeshes = (uint32_t)nodeMeshes.size() - firstMesh;
+    }
+    log << "Merged " << meshes.size() << " meshes into " << merged.size() << ", " << scene.nodeMeshes.size() << " mesh instances into "
+        << nodeMeshes.size() << std::endl;
+    meshes.swap(merged);
+    scene.nodeMeshes.swap(nodeMeshes);
+}
+
+// Full detail index ranges that the optimizations must not mix, the submeshes or the whole mesh
+std::vector<Submesh> getSubmeshRanges(const Mesh& mesh) {
+    if(!mesh.submeshes.empty()) {
+        return mesh.submeshes;
+    }
+    return std::vector<Submesh>(1, Submesh{0, (uint32_t)mesh.indices.size(), 0});
+}
+
+// Splits a mesh with more than 65536 vertices into chunks that can be drawn with 16 bit indices.
+// Triangles keep their order, every chunk gets the vertices its triangles reference.
+void splitMeshFor16BitIndices(const Mesh& mesh, std::vector<Mesh>& result) {
+    const uint32_t maxChunkVertices = 65536;
+    std::vector<uint32_t> remap(mesh.positions.size(), ~0u);
+    std::vector<uint32_t> chunkSourceVertices;
+    Mesh chunk;
+    chunk.materialIndex = mesh.materialIndex;
+    for(uint64_t i = 0; i < mesh.indices.size(); i += 3) {
+        uint32_t newVertices = 0;
+        for(uint32_t j = 0; j < 3; j++) {
+            newVertices += remap[mesh.indices[i + j]] == ~0u ? 1 : 0;
+        }
+        if(chunk.positions.size() + newVertices > maxChunkVertices) {
+            result.push_back(chunk);
+            for(uint32_t index : chunkSourceVertices) {
+                remap[index] = ~0u;
+            }
+            chunkSourceVertices.clear();
+            chunk = Mesh();
+            chunk.materialIndex = mesh.materialIndex;
+        }
+        for(uint32_t j = 0; j < 3; j++) {
+            uint32_t index = mesh.indices[i + j];
+            if(remap[index] == ~0u) {
+                remap[index] = (uint32_t)chunk.positions.size();
+                chunkSourceVertices.push_back(index);
+                chunk.positions.push_back(mesh.positions[index]);
+                chunk.normals.push_back(mesh.normals[index]);
+                chunk.tangents.push_back(mesh.tangents[index]);
+                chunk.uvs.push_back(mesh.uvs[index]);
+            }
+            chunk.indices.push_back(remap[index]);
+        }
+    }
+    if(!chunk.indices.empty()) {
+        result.push_back(chunk);
+    }
+}
+
+// Points every node that referenced source mesh i at meshes firstMesh[i] to firstMesh[i + 1]
+void remapNodeMeshes(ExportScene& scene, const std::vector<uint32_t>& firstMesh) {
+    std::vector<uint32_t> nodeMeshes;
+    for(BMFNodeRecord& node : scene.nodes) {
+        uint32_t first = (uint32_t)nodeMeshes.size();
+        for(uint32_t i = node.firstMesh; i < node.firstMesh + node.numMeshes; i++) {
+            for(uint32_t mesh = firstMesh[scene.nodeMeshes[i]]; mesh < firstMesh[scene.nodeMeshes[i] + 1]; mesh++) {
+                nodeMeshes.push_back(mesh);
+            }
+        }
+        node.firstMesh = first;
+        node.numMeshes = (uint32_t)nodeMeshes.size() - first;
+    }
+    scene.nodeMeshes.swap(nodeMeshes);
+}
+
+// Splits every mesh with more than 65536 vertices, the nodes reference all of its chunks
+void splitMeshes(ExportScene& scene, std::ostream& log) {
+    std::vector<Mesh> chunks;
+    std::vector<uint32_t> firstChunk;
+    for(Mesh& mesh : scene.meshes) {
+        firstChunk.push_back((uint32_t)chunks.size());
+        if(mesh.positions.size() > 65536) {
+            splitMeshFor16BitIndices(mesh, chunks);
+        } else {
+            chunks.push_back(std::move(mesh));
+        }
+    }
+    firstChunk.push_back((uint32_t)chunks.size());
+    remapNodeMeshes(scene, firstChunk);
+    log << "Split " << scene.meshes.size() << " meshes into " << chunks.size() << " meshes with 16 bit indices" << std::endl;
+    scene.meshes.swap(chunks);
+}
+
+template<typename T>
+void remapVertices(std::vector<T>& values, const std::vector<uint32_t>& remap, uint64_t numUsed) {
+    std::vector<T> result(values.size());
+    for(uint64_t i = 0; i < values.size(); i++) {
+        result[remap[i]] = values[i];
+    }
+    result.resize(numUsed);
+    values.swap(result);
+}
+
+// Reorders the triangles for the vertex cache and overdraw, then the vertices for fetch locality,
+// and prints what each metric looked like before and after. Unused vertices are dropped. Triangles
+// are only reordered within their submesh.
+void optimizeMesh(Mesh& mesh, uint64_t meshIndex, std::ostream& log) {
+    uint64_t numVertices = mesh.positions.size();
+    uint64_t vertexSize = bmfVertexSize(options.quantize ? BMF_MESH_QUANTIZED_VERTICES : 0);
+    const float* positions = (const float*)mesh.positions.data();
+    VertexCacheStats cacheBefore = analyzeVertexCache(mesh.indices.data(), mesh.indices.size(), numVertices, options.cacheSize);
+    float overdrawBefore = analyzeOverdraw(mesh.indices.data(), mesh.indices.size(), positions, numVertices);
+    float fetchBefore = analyzeVertexFetch(mesh.indices.data(), mesh.indices.size(), numVertices, vertexSize);
+
+    std::vector<uint32_t> clusters;
+    std::vector<uint32_t> cacheOptimized;
+    std::vector<uint32_t> overdrawOptimized;
+    uint64_t numClusters = 0;
+    for(const Submesh& range : getSubmeshRanges(mesh)) {
+        optimizeVertexCache(cacheOptimized, mesh.indices.data() + range.firstIndex, range.numIndices, numVertices, options.cacheSize, &clusters);
+        optimizeOverdraw(overdrawOptimized, cacheOptimized.data(), cacheOptimized.size(), positions, numVertices, clusters, options.cacheSize,
+            options.overdrawThreshold);
+        std::copy(overdrawOptimized.begin(), overdrawOptimized.end(), mesh.indices.begin() + range.firstIndex);
+        numClusters += clusters.size();
+    }
+
+    std::vector<uint32_t> remap;
+    uint64_t numUsed = optimizeVertexFetch(remap, mesh.indices.data(), mesh.indices.size(), numVertices);
+    for(uint32_t& index : mesh.indices) {
+        index = remap[index];
+    }
+    remapVertices(mesh.positions, remap, numUsed);
+    remapVertices(mesh.normals, remap, numUsed);
+    remapVertices(mesh.tangents, remap, numUsed);
+    remapVertices(mesh.uvs, remap, numUsed);
+
+    numVertices = mesh.positions.size();
+    positions = (const float*)mesh.positions.data();
+    VertexCacheStats cacheAfter = analyzeVertexCache(mesh.indices.data(), mesh.indices.size(), numVertices, options.cacheSize);
+    float overdrawAfter = analyzeOverdraw(mesh.indices.data(), mesh.indices.size(), positions, numVertices);
+    float fetchAfter = analyzeVertexFetch(mesh.indices.data(), mesh.indices.size(), numVertices, vertexSize);
+    log << "Mesh " << meshIndex << ": ACMR " << cacheBefore.acmr << " -> " << cacheAfter.acmr
+        << ", ATVR " << cacheBefore.atvr << " -> " << cacheAfter.atvr
+        << ", overdraw " << overdrawBefore << " -> " << overdrawAfter
+        << ", overfetch " << fetchBefore << " -> " << fetchAfter
+        << " (" << numClusters << " clusters)" << std::endl;
+}
+
+// Builds the coarser levels of detail of a mesh, each with about half the triangles of the previous
+// one. Stops early if the simplifier can not remove enough triangles anymore.
+void generateLods(Mesh& mesh, uint64_t meshIndex, std::ostream& log) {
+    // Normal and uv differences count like distances of this fraction of the mesh size
+    const float normalWeight = 0.05f;
+    const float uvWeight = 0.05f;
+    const uint32_t vertexSize = 8;
+    std::vector<float> vertices(mesh.positions.size() * vertexSize);
+    for(uint64_t i = 0; i < mesh.positions.size(); i++) {
+        float vertex[vertexSize] = {
+            mesh.positions[i].x, mesh.positions[i].y, mesh.positions[i].z,
+            mesh.normals[i].x * normalWeight, mesh.normals[i].y * normalWeight, mesh.normals[i].z * normalWeight,
+            mesh.uvs[i].x * uvWeight, mesh.uvs[i].y * uvWeight
+        };
+        memcpy(&vertices[i * vertexSize], vertex, sizeof(vertex));
+    }
+
+    uint64_t numIndices = mesh.indices.size();
+    float error = 0.0f;
+    for(uint32_t level = 1; level < options.numLods; level++) {
+        std::vector<uint32_t> lod;
+        float lodError = simplifyMesh(lod, mesh.indices.data(), mesh.indices.size(), vertices.data(), mesh.positions.size(), vertexSize,
+            numIndices / 2 / 3 * 3);
+        if(lod.empty() || lod.size() > numIndices * 9 / 10) {
+            break;
+        }
+        if(options.optimize) {
+            std::vector<uint32_t> reordered;
+            optimizeVertexCache(reordered, lod.data(), lod.size(), mesh.positions.size(), options.cacheSize);
+            lod.swap(reordered);
+        }
+        // Every level is simplified from the full detail mesh, the error must not shrink though
+        error = lodError > error ? lodError : error;
+        numIndices = lod.size();
+        log << "Mesh " << meshIndex << ": LOD " << level << " " << lod.size() / 3 << " triangles, error " << error << std::endl;
+        mesh.lods.push_back(lod);
+        mesh.lodErrors.push_back(error);
+    }
+}
+
+// Splits the full detail triangles of every submesh into meshlets, which reorders them by meshlet
+void generateMeshlets(Mesh& mesh, uint64_t meshIndex, std::ostream& log) {
+    const float* positions = (const float*)mesh.positions.data();
+    float acmrBefore = analyzeVertexCache(mesh.indices.data(), mesh.indices.size(), mesh.positions.size(), options.cacheSize).acmr;
+    std::vector<uint32_t> reordered;
+    std::vector<Meshlet> meshlets;
+    for(const Submesh& range : getSubmeshRanges(mesh)) {
+        buildMeshlets(meshlets, reordered, mesh.indices.data() + range.firstIndex, range.numIndices, positions, mesh.positions.size());
+        std::copy(reordered.begin(), reordered.end(), mesh.indices.begin() + range.firstIndex);
+        for(Meshlet& meshlet : meshlets) {
+            meshlet.firstIndex += range.firstIndex;
+            mesh.meshlets.push_back(meshlet);
+        }
+    }
+    if(options.optimize) {
+        // The meshlet order breaks up the Tipsify fans, so every meshlet is reordered on its own
+        std::vector<uint32_t> localIndex(mesh.positions.size(), ~0u);
+        std::vector<uint32_t> vertices;
+        std::vector<uint32_t> local;
+        for(const Meshlet& meshlet : mesh.meshlets) {
+            uint32_t* indices = mesh.indices.data() + meshlet.firstIndex;
+            vertices.clear();
+            local.clear();
+            for(uint32_t i = 0; i < meshlet.numIndices; i++) {
+                if(localIndex[indices[i]] == ~0u) {
+                    localIndex[indices[i]] = (uint32_t)vertices.size();
+                    vertices.push_back(indices[i]);
+                }
+                local.push_back(localIndex[indices[i]]);
+            }
+            optimizeVertexCache(reordered, local.data(), local.size(), vertices.size(), options.cacheSize);
+            for(uint32_t i = 0; i < meshlet.numIndices; i++) {
+                indices[i] = vertices[reordered[i]];
+            }
+            for(uint32_t vertex : vertices) {
+                localIndex[vertex] = ~0u;
+            }
+        }
+    }
+    float acmrAfter = analyzeVertexCache(mesh.indices.data(), mesh.indices.size(), mesh.positions.size(), options.cacheSize).acmr;
+
+    uint64_t numVertices = 0;
+    uint64_t numCones = 0;
+    for(const Meshlet& meshlet : mesh.meshlets) {
+        numVertices += meshlet.numVertices;
+        numCones += meshlet.coneCutoff < 1.0f ? 1 : 0;
+    }
+    uint64_t numMeshlets = mesh.meshlets.size() > 0 ? mesh.meshlets.size() : 1;
+    log << "Mesh " << meshIndex << ": " << mesh.meshlets.size() << " meshlets, " << (float)mesh.indices.size() / 3 / numMeshlets
+        << " triangles and " << (float)numVertices / numMeshlets << " vertices on average, " << numCones << " with a normal cone"
+        << ", ACMR " << acmrBefore << " -> " << acmrAfter << std::endl;
+}
+
+// Optimizes a mesh and builds its levels of detail and meshlets, as far as the options ask for them
+void buildMesh(Mesh& mesh, uint64_t meshIndex, std::ostream& log) {
+    if(options.optimize) {
+        optimizeMesh(mesh, meshIndex, log);
+    }
+    if(options.numLods > 1) {
+        generateLods(mesh, meshIndex, log);
+    }
+    if(options.meshlets) {
+        generateMeshlets(mesh, meshIndex, log);
+    }
+}
+
+// Serializes the bmf file into memory and keeps track of the offsets for the table of contents, so
+// the file is written with a single call once it is complete. After open() everything goes straight
+// to the file instead, and the header is patched once the table of contents is known. The streamed
+// file is written next to the destination and only replaces it in save(), so a failed export keeps
+// the previous output.
+struct BMFWriter {
+    ~BMFWriter() {
+        if(file.is_open()) {
+            file.close();
+            std::remove(tempFilename.c_str());
+        }
+    }
+
+    bool open(const std::string& filename) {
+        tempFilename = filename + ".tmp";
+        file.open(tempFilename, std::ios::out | std::ios::binary | std::ios::trunc);
+        return file.is_open();
+    }
+
+    uint64_t tell() {
+        return file.is_open() ? fileSize : buffer.size();
+    }
+
+    void write(const void* data, uint64_t size) {
+        if(file.is_open()) {
+            file.write((const char*)data, size);
+            fileSize += size;
+        } else {
+            buffer.insert(buffer.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+        }
+    }
+
+    void align(uint64_t alignment) {
+        static const uint8_t zeros[BMF_PAGE_SIZE] = {};
+        uint64_t padding = bmfAlign(tell(), alignment) - tell();
+        while(padding > 0) {
+            uint64_t size = padding < sizeof(zeros) ? padding : sizeof(zeros);
+            write(zeros, size);
+            padding -= size;
+        }
+    }
+
+    BMFBlobRange writeBlob(const void* data, uint64_t size, uint64_t alignment = BMF_ALIGNMENT) {
+        align(alignment);
+        BMFBlobRange range = {tell(), size};
+        write(data, size);
+        return range;
+    }
+
+    void writeSection(uint32_t type, const void* records, uint32_t count, uint64_t recordSize) {
+        align(BMF_ALIGNMENT);
+        BMFSection section = {type, count, tell(), count * recordSize};
+        write(records, section.size);
+        sections.push_back(section);
+    }
+
+    // Writes the table of contents and patches the header at the start of the buffer
+    void finish() {
+        align(BMF_ALIGNMENT);
+        BMFHeader header = {};
+        header.magic = BMF_MAGIC;
+        header.version = BMF_VERSION;
+        header.numSections = (uint32_t)sections.size();
+        header.tocOffset = tell();
+        write(sections.data(), sections.size() * sizeof(BMFSection));
+        header.fileSize = tell();
+        if(file.is_open()) {
+            file.seekp(0);
+            file.write((const char*)&header, sizeof(BMFHeader));
+        } else {
+            memcpy(buffer.data(), &header, sizeof(BMFHeader));
+        }
+    }
+
+    // Moves the streamed file to filename after open()
+    bool save(const std::string& filename) {
+        if(file.is_open()) {
+            file.close();
+            if(file.fail()) {
+                std::remove(tempFilename.c_str());
+                return false;
+            }
+#ifdef _WIN32
+            // rename does not replace an existing file on Windows
+            std::remove(filename.c_str());
+#endif
+            return std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+        }
+        std::ofstream output(filename, std::ios::out | std::ios::binary);
+        if(!output.is_open()) {
+            return false;
+        }
+        output.write((const char*)buffer.data(), buffer.size());
+        return output.good();
+    }
+
+    std::vector<uint8_t> buffer;
+    std::vector<BMFSection> sections;
+    std::ofstream file;
+    std::string tempFilename;
+    uint64_t fileSize = 0;
+};
+
+// Embedded textures by name and content, so images that several materials use are only stored once
+struct TextureEmbedder {
+    // Writes the image file to the blob section if it has not been written yet. Returns the index + 1
+    // of its texture record, or 0 if the file could not be read and stays referenced by name.
+    // Decoded textures get the specular map packed into their spare channel if specularPath is not
+    // empty: the alpha of a diffuse map that is not alpha tested, or the blue of an uncompressed
+    // normal map. packedSpecular tells whether that happened.
+    uint32_t embed(BMFWriter& output, const std::string& path, bool normalMap, const std::string& specularPath, bool& packedSpecular,
+        std::ostream& log) {
+        std::string packedPath = options.embedTextures == BMF_TEXTURE_ENCODED ? "" : specularPath;
+        std::string key = std::string(normalMap ? "normal " : "diffuse ") + path + "\n" + packedPath;
+        auto it = embedded.find(key);
+        if(it != embedded.end()) {
+            packedSpecular = it->second.packedSpecular;
+            return it->second.index;
+        }
+        Embedded& result = embedded[key];
+        packedSpecular = false;
+
+        std::vector<uint8_t> fileData;
+        addFile(path);
+        if(!readFile(path, fileData)) {
+            log << "Could not open texture " << path << ", it is referenced by name" << std::endl;
+            return 0;
+        }
+        BMFTextureRecord record = {};
+        record.format = options.embedTextures;
+        record.hash = bmfHash(fileData.data(), fileData.size());
+        if(record.format == BMF_TEXTURE_ENCODED) {
+            result.index = addRecord(output, record, fileData);
+            return result.index;
+        }
+
+        std::vector<TextureImage> levels(1);
+        if(!decodeImage(fileData, levels[0])) {
+            log << "Could not decode texture " << path << ", it is referenced by name" << std::endl;
+            return 0;
+        }
+        bool alphaTested = !normalMap && hasTranslucentPixels(levels[0]);
+        // Hash of the content, the usage and the packed specular map, so a texture is only shared
+        // with textures that were built the same way
+        uint64_t hashes[3] = {record.hash, normalMap ? 1ull : 0ull, 0};
+        TextureImage specular;
+        if(!packedPath.empty()) {
+            std::vector<uint8_t> specularData;
+            addFile(packedPath);
+            if(alphaTested) {
+                // No spare channel, the normal map gets the next chance
+            } else if(normalMap && record.format == BMF_TEXTURE_BC1) {
+                log << "BC5 normal map " << path << " has no spare channel, the specular map " << packedPath << " is not used" << std::endl;
+            } else if(!readFile(packedPath, specularData) || !decodeImage(specularData, specular)) {
+                log << "Could not read specular map " << packedPath << std::endl;
+            } else {
+                packedSpecular = true;
+                hashes[2] = bmfHash(specularData.data(), specularData.size());
+            }
+        }
+        record.hash = bmfHash(hashes, sizeof(hashes));
+
+        generateMips(levels, normalMap, alphaTested ? ALPHA_TEST_THRESHOLD : 0.0f);
+        if(packedSpecular) {
+            packSpecular(levels, specular, normalMap ? 2 : 3);
+        }
+        if(record.format == BMF_TEXTURE_BC1) {
+            record.format = normalMap ? BMF_TEXTURE_BC5 : (alphaTested || packedSpecular ? BMF_TEXTURE_BC3 : BMF_TEXTURE_BC1);
+        } else if(normalMap && !packedSpecular) {
+            record.format = BMF_TEXTURE_RG8;
+        }
+        std::vector<uint8_t> data;
+        for(const TextureImage& level : levels) {
+            if(record.format == BMF_TEXTURE_RGBA8) {
+                data.insert(data.end(), level.pixels.begin(), level.pixels.end());
+            } else if(record.format == BMF_TEXTURE_RG8) {
+                for(uint64_t i = 0; i < level.pixels.size(); i += 4) {
+                    data.push_back(level.pixels[i]);
+                    data.push_back(level.pixels[i + 1]);
+                }
+            } else {
+                compressImage(level, record.format, data);
+            }
+        }
+        record.width = levels[0].width;
+        record.height = levels[0].height;
+        record.numMips = (uint32_t)levels.size();
+        result.index = addRecord(output, record, data);
+        result.packedSpecular = packedSpecular;
+        const char* formatNames[] = {"", "", "RGBA8", "BC1", "BC3", "BC5", "RG8"};
+        log << "Texture " << path << (packedSpecular ? " with " + packedPath : std::string()) << ": " << record.width << "x" << record.height
+            << " " << formatNames[record.format] << ", " << record.numMips << " mips, " << data.size() / 1024 << " KB" << std::endl;
+        return result.index;
+    }
+
+    static bool readFile(const std::string& path, std::vector<uint8_t>& data) {
+        std::ifstream input(path, std::ios::in | std::ios::binary);
+        if(!input.is_open()) {
+            return false;
+        }
+        data.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    // Decodes to RGBA8 with the bottom row first, like GL expects it
+    static bool decodeImage(const std::vector<uint8_t>& fileData, TextureImage& image) {
+        int width = 0;
+        int height = 0;
+        int bitsPerPixel = 0;
+        uint8_t* pixels = stbi_load_from_memory(fileData.data(), (int)fileData.size(), &width, &height, &bitsPerPixel, 4);
+        if(!pixels) {
+            return false;
+        }
+        image.width = width;
+        image.height = height;
+        uint64_t rowSize = (uint64_t)width * 4;
+        image.pixels.resize(rowSize * height);
+        for(int y = 0; y < height; y++) {
+            memcpy(image.pixels.data() + y * rowSize, pixels + (height - 1 - y) * rowSize, rowSize);
+        }
+        stbi_image_free(pixels);
+        return true;
+    }
+
+    // Writes the luminance of the specular map into channel of every mip level. The specular map is
+    // point sampled if its size differs, and its mips are filtered on their own.
+    static void packSpecular(std::vector<TextureImage>& levels, const TextureImage& specular, uint32_t channel) {
+        std::vector<TextureImage> specularLevels(1);
+        TextureImage& base = specularLevels[0];
+        base.width = levels[0].width;
+        base.height = levels[0].height;
+        base.pixels.assign((uint64_t)base.width * base.height * 4, 255);
+        for(uint32_t y = 0; y < base.height; y++) {
+            for(uint32_t x = 0; x < base.width; x++) {
+                uint64_t sx = (uint64_t)x * specular.width / base.width;
+                uint64_t sy = (uint64_t)y * specular.height / base.height;
+                const uint8_t* source = &specular.pixels[(sy * specular.width + sx) * 4];
+                // Stored in alpha, which generateMips filters linearly instead of in sRGB
+                base.pixels[((uint64_t)y * base.width + x) * 4 + 3] = (uint8_t)(0.2126f * source[0] + 0.7152f * source[1] + 0.0722f * source[2] + 0.5f);
+            }
+        }
+        generateMips(specularLevels, false, 0.0f);
+        for(uint64_t level = 0; level < levels.size(); level++) {
+            for(uint64_t i = 0; i < levels[level].pixels.size(); i += 4) {
+                levels[level].pixels[i + channel] = specularLevels[level].pixels[i + 3];
+            }
+        }
+    }
+
+    // Returns the index + 1 of the record, reusing an earlier one with the same hash
+    void addFile(const std::string& path) {
+        if(!files.count(path)) {
+            hashCookInput(path, files[path]);
+        }
+    }
+
+    uint32_t addRecord(BMFWriter& output, BMFTextureRecord& record, const std::vector<uint8_t>& data) {
+        for(uint32_t i = 0; i < records.size(); i++) {
+            // Same image under a different name
+            if(records[i].hash == record.hash) {
+                return i + 1;
+            }
+        }
+        record.data = output.writeBlob(data.data(), data.size(), BMF_PAGE_SIZE);
+        records.push_back(record);
+        return (uint32_t)records.size();
+    }
+
+    struct Embedded {
+        uint32_t index = 0;
+        bool packedSpecular = false;
+    };
+    // Keyed by the usage, the path and the path of the packed specular map
+    std::map<std::string, Embedded> embedded;
+    // Every image file that was read, for the cook manifest. Hashed before it is read, so a change
+    // while the export runs makes the next run rebuild.
+    std::map<std::string, CookInput> files;
+    std::vector<BMFTextureRecord> records;
+};
+
+void processMaterials(const aiScene* scene, ExportScene& result, std::ostream& log) {
     for(uint32_t i = 0; i < scene->mNumMaterials; i++) {
         Material mat = {};
         aiMaterial* material = scene->mMaterials[i];
@@ -143,14 +950,476 @@ void processMaterials(const aiScene* scene) {
         mat.specular.y *= shininessStrength;
         mat.specular.z *= shininessStrength;
 
-        uint32_t numDiffuseMaps = material->GetTextureCount(aiTextureType_DIFFUSE);
-        uint32_t numNormalMaps = material->GetTextureCount(aiTextureType_NORMALS);
-        assert(numDiffuseMaps > 0);
-        material->GetTexture(aiTextureType_DIFFUSE, 0, &mat.diffuseMapName);
-        assert(numNormalMaps > 0);
-        material->GetTexture(aiTextureType_NORMALS, 0, &mat.normalMapName);
+        // Missing maps are stored without a name, the renderer uses a white diffuse map and a flat
+        // normal map for them
+        if(material->GetTextureCount(aiTextureType_DIFFUSE) > 0) {
+            material->GetTexture(aiTextureType_DIFFUSE, 0, &mat.diffuseMapName);
+        } else {
+            log << "Material " << i << " has no diffuse map" << std::endl;
+        }
+        if(material->GetTextureCount(aiTextureType_NORMALS) > 0) {
+            material->GetTexture(aiTextureType_NORMALS, 0, &mat.normalMapName);
+        } else {
+            log << "Material " << i << " has no normal map" << std::endl;
+        }
+        if(material->GetTextureCount(aiTextureType_SPECULAR) > 0) {
+            material->GetTexture(aiTextureType_SPECULAR, 0, &mat.specularMapName);
+        }
+
+        result.materials.push_back(mat);
+    }
+}
+
+// Encodes and decodes the vertex and index streams of existing bmf files and checks that the result
+// is bit exact. Returns false if any mesh does not survive the round trip.
+bool roundtripFiles(int argc, char** argv, int firstFile) {
+    bool success = true;
+    std::vector<uint8_t> vertexScratch;
+    std::vector<uint8_t> indexScratch;
+    std::vector<uint8_t> encoded;
+    std::vector<uint8_t> decoded;
+    for(int i = firstFile; i < argc; i++) {
+        BMFFile file;
+        if(!file.open(argv[i])) {
+            success = false;
+            continue;
+        }
+        for(uint64_t m = 0; m < file.meshRecords.size(); m++) {
+            const BMFMeshRecord& record = file.meshRecords[m];
+            const uint8_t* vertices = 0;
+            const uint8_t* indices = 0;
+            if(!file.getMeshData(m, vertexScratch, indexScratch, &vertices, &indices)) {
+                std::cout << argv[i] << " mesh " << m << ": could not decode stored data" << std::endl;
+                success = false;
+                continue;
+            }
+            uint64_t vertexSize = bmfVertexSize(record.flags);
+            uint64_t vertexBytes = record.numVertices * vertexSize;
+            bool index16 = (record.flags & BMF_MESH_INDEX16) != 0;
+            uint64_t indexBytes = record.numIndices * bmfIndexSize(record.flags);
+
+            encoded.clear();
+            bmfEncodeVertexBuffer(encoded, vertices, record.numVertices, vertexSize);
+            uint64_t encodedVertexBytes = encoded.size();
+            decoded.assign(vertexBytes, 0);
+            auto startTime = std::chrono::high_resolution_clock::now();
+            bool vertexResult = bmfDecodeVertexBuffer(decoded.data(), record.numVertices, vertexSize, encoded.data(), encoded.size());
+            double vertexSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+            vertexResult = vertexResult && memcmp(decoded.data(), vertices, vertexBytes) == 0;
+
+            encoded.clear();
+            if(index16) {
+                bmfEncodeIndexBuffer(encoded, (const uint16_t*)indices, record.numIndices);
+            } else {
+                bmfEncodeIndexBuffer(encoded, (const uint32_t*)indices, record.numIndices);
+            }
+            uint64_t encodedIndexBytes = encoded.size();
+            decoded.assign(indexBytes, 0);
+            startTime = std::chrono::high_resolution_clock::now();
+            bool indexResult = index16
+                ? bmfDecodeIndexBuffer((uint16_t*)decoded.data(), record.numIndices, encoded.data(), encoded.size())
+                : bmfDecodeIndexBuffer((uint32_t*)decoded.data(), record.numIndices, encoded.data(), encoded.size());
+            double indexSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+            indexResult = indexResult && memcmp(decoded.data(), indices, indexBytes) == 0;
+
+            std::cout << argv[i] << " mesh " << m << ": vertices " << vertexBytes << " -> " << encodedVertexBytes << " bytes ("
+                << (vertexSeconds > 0.0 ? vertexBytes / vertexSeconds / 1e6 : 0.0) << " MB/s) " << (vertexResult ? "ok" : "MISMATCH")
+                << ", indices " << indexBytes << " -> " << encodedIndexBytes << " bytes ("
+                << (indexSeconds > 0.0 ? indexBytes / indexSeconds / 1e6 : 0.0) << " MB/s) " << (indexResult ? "ok" : "MISMATCH") << std::endl;
+            success = success && vertexResult && indexResult;
+        }
+    }
+    return success;
+}
+
+struct ExportResult {
+    std::string inputFilename;
+    std::string outputFilename;
+    bool success = false;
+    double importSeconds = 0.0;
+    double processSeconds = 0.0;
+    double writeSeconds = 0.0;
+    uint64_t outputSize = 0;
+    // Skipped because the manifest says the output is current
+    bool upToDate = false;
+    // Files the output was built from, for the manifest
+    CookEntry cooked;
+    // Messages of the export, printed in one piece so concurrent exports do not interleave
+    std::string log;
+};
+
+double secondsSince(std::chrono::high_resolution_clock::time_point startTime) {
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+}
+
+// Mesh records of the file being written, and scratch buffers for encoding the meshes
+struct MeshTables {
+    std::vector<BMFMeshRecord> meshRecords;
+    std::vector<BMFBoundsRecord> boundsRecords;
+    std::vector<BMFLodRecord> lodRecords;
+    std::vector<BMFMeshletRecord> meshletRecords;
+    std::vector<BMFSubmeshRecord> submeshRecords;
+    std::vector<uint8_t> vertexData;
+    std::vector<uint8_t> compressedData;
+};
+
+// Writes the vertices and indices of a mesh to the blob section and adds its records
+void writeMesh(BMFWriter& output, Mesh& mesh, MeshTables& tables) {
+    BMFMeshRecord record = {};
+    record.materialIndex = mesh.materialIndex;
+    record.flags = options.quantize ? BMF_MESH_QUANTIZED_VERTICES : 0;
+    record.flags |= options.compress ? BMF_MESH_COMPRESSED_VERTICES | BMF_MESH_COMPRESSED_INDICES : 0;
+    record.numVertices = mesh.positions.size();
+    record.flags |= record.numVertices <= 65536 ? BMF_MESH_INDEX16 : 0;
+    record.flags |= mesh.occlusion.empty() ? 0 : BMF_MESH_VERTEX_OCCLUSION;
+
+    // The levels of detail follow the full detail indices
+    if(!mesh.lods.empty()) {
+        record.firstLod = (uint32_t)tables.lodRecords.size();
+        record.numLods = (uint32_t)mesh.lods.size() + 1;
+        tables.lodRecords.push_back({0, mesh.indices.size(), 0.0f, 0});
+        for(uint64_t i = 0; i < mesh.lods.size(); i++) {
+            tables.lodRecords.push_back({mesh.indices.size(), mesh.lods[i].size(), mesh.lodErrors[i], 0});
+            mesh.indices.insert(mesh.indices.end(), mesh.lods[i].begin(), mesh.lods[i].end());
+        }
+    }
+    record.numIndices = mesh.indices.size();
+
+    BMFBoundsRecord bounds = computeBounds(mesh);
+    record.firstMeshlet = (uint32_t)tables.meshletRecords.size();
+    record.numMeshlets = (uint32_t)mesh.meshlets.size();
+    for(const Meshlet& meshlet : mesh.meshlets) {
+        BMFMeshletRecord meshletRecord = {meshlet.firstIndex, meshlet.numIndices};
+        memcpy(meshletRecord.center, meshlet.center, sizeof(meshlet.center));
+        memcpy(meshletRecord.coneAxis, meshlet.coneAxis, sizeof(meshlet.coneAxis));
+        meshletRecord.radius = meshlet.radius;
+        meshletRecord.coneCutoff = meshlet.coneCutoff;
+        if(options.quantize) {
+            // Quantized positions move by up to half a step along every axis
+            glm::vec3 extent = glm::vec3(bounds.max[0], bounds.max[1], bounds.max[2]) - glm::vec3(bounds.min[0], bounds.min[1], bounds.min[2]);
+            meshletRecord.radius += glm::length(extent) / 65535.0f;
+        }
+        tables.meshletRecords.push_back(meshletRecord);
+    }
+    record.firstSubmesh = (uint32_t)tables.submeshRecords.size();
+    record.numSubmeshes = (uint32_t)mesh.submeshes.size();
+    for(const Submesh& submesh : mesh.submeshes) {
+        tables.submeshRecords.push_back({submesh.firstIndex, submesh.numIndices, submesh.sourceMesh, 0});
+    }
+    encodeVertices(mesh, bounds, tables.vertexData);
+    if(options.compress) {
+        tables.compressedData.clear();
+        bmfEncodeVertexBuffer(tables.compressedData, tables.vertexData.data(), record.numVertices, bmfVertexSize(record.flags));
+        record.vertices = output.writeBlob(tables.compressedData.data(), tables.compressedData.size());
+        tables.compressedData.clear();
+        bmfEncodeIndexBuffer(tables.compressedData, mesh.indices.data(), record.numIndices);
+        record.indices = output.writeBlob(tables.compressedData.data(), tables.compressedData.size());
+    } else if(record.flags & BMF_MESH_INDEX16) {
+        record.vertices = output.writeBlob(tables.vertexData.data(), tables.vertexData.size());
+        std::vector<uint16_t> indices(mesh.indices.begin(), mesh.indices.end());
+        record.indices = output.writeBlob(indices.data(), indices.size() * sizeof(uint16_t));
+    } else {
+        record.vertices = output.writeBlob(tables.vertexData.data(), tables.vertexData.size());
+        record.indices = output.writeBlob(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+    }
+    tables.meshRecords.push_back(record);
+    tables.boundsRecords.push_back(bounds);
+}
+
+// Converts, processes and writes one source mesh at a time and releases it right away, so next to
+// the imported scene only the mesh at hand has to fit in memory. The nodes are pointed at the
+// written meshes once all of them are known. Merging and ambient occlusion need the whole scene and
+// are not available here.
+void streamMeshes(aiScene* scene, ExportScene& exported, BMFWriter& output, MeshTables& tables, std::ostream& log) {
+    std::vector<uint32_t> firstChunk;
+    std::vector<Mesh> chunks;
+    uint64_t largestMesh = 0;
+    for(unsigned int i = 0; i < scene->mNumMeshes; i++) {
+        firstChunk.push_back((uint32_t)tables.meshRecords.size());
+        processMesh(scene->mMeshes[i], scene, exported);
+        delete scene->mMeshes[i];
+        scene->mMeshes[i] = 0;
+        Mesh& mesh = exported.meshes.back();
+        largestMesh = std::max<uint64_t>(largestMesh, mesh.positions.size());
+        chunks.clear();
+        if(options.split16 && mesh.positions.size() > 65536) {
+            splitMeshFor16BitIndices(mesh, chunks);
+        } else {
+            chunks.push_back(std::move(mesh));
+        }
+        exported.meshes.clear();
+        for(Mesh& chunk : chunks) {
+            buildMesh(chunk, tables.meshRecords.size(), log);
+            writeMesh(output, chunk, tables);
+        }
+    }
+    firstChunk.push_back((uint32_t)tables.meshRecords.size());
+    remapNodeMeshes(exported, firstChunk);
+    log << "Streamed " << scene->mNumMeshes << " meshes as " << tables.meshRecords.size() << " meshes, the largest with " << largestMesh
+        << " vertices" << std::endl;
+}
+
+// Bakes the ambient occlusion of every vertex, the fraction of cosine distributed rays that leave
+// the scene within options.occlusionDistance. Meshes occlude wherever a node places them. A mesh
+// that several nodes reference is baked where the first of them places it.
+void bakeOcclusion(ExportScene& scene, ThreadPool& pool, std::ostream& log) {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    std::vector<Mesh>& meshes = scene.meshes;
+    std::vector<glm::mat4> nodeTransforms(scene.nodes.size());
+    std::vector<glm::mat4> meshTransforms(meshes.size(), glm::mat4(1.0f));
+    std::vector<bool> placed(meshes.size(), false);
+    std::vector<float> triangles;
+    glm::vec3 sceneMin(FLT_MAX);
+    glm::vec3 sceneMax(-FLT_MAX);
+    for(uint64_t i = 0; i < scene.nodes.size(); i++) {
+        const BMFNodeRecord& node = scene.nodes[i];
+        glm::mat4 transform;
+        memcpy(&transform, node.transform, sizeof(node.transform));
+        nodeTransforms[i] = node.parent == BMF_NO_PARENT ? transform : nodeTransforms[node.parent] * transform;
+        for(uint32_t j = node.firstMesh; j < node.firstMesh + node.numMeshes; j++) {
+            const Mesh& mesh = meshes[scene.nodeMeshes[j]];
+            if(!placed[scene.nodeMeshes[j]]) {
+                placed[scene.nodeMeshes[j]] = true;
+                meshTransforms[scene.nodeMeshes[j]] = nodeTransforms[i];
+            }
+            for(uint32_t index : mesh.indices) {
+                const Position& p = mesh.positions[index];
+                glm::vec3 position = glm::vec3(nodeTransforms[i] * glm::vec4(p.x, p.y, p.z, 1.0f));
+                triangles.insert(triangles.end(), {position.x, position.y, position.z});
+                sceneMin = glm::min(sceneMin, position);
+                sceneMax = glm::max(sceneMax, position);
+            }
+        }
+    }
+    OcclusionScene occluders;
+    occluders.build(triangles);
+    double buildSeconds = secondsSince(startTime);
 
-        materials.push_back(mat);
+    float sceneSize = triangles.empty() ? 0.0f : glm::length(sceneMax - sceneMin);
+    float distance = options.occlusionDistance > 0.0f ? options.occlusionDistance : sceneSize * 0.1f;
+    // Keeps the rays from hitting the triangles around their own vertex
+    float bias = sceneSize * 1e-4f;
+    std::vector<uint64_t> firstVertex(meshes.size() + 1, 0);
+    for(uint64_t i = 0; i < meshes.size(); i++) {
+        meshes[i].occlusion.resize(meshes[i].positions.size());
+        firstVertex[i + 1] = firstVertex[i] + meshes[i].positions.size();
+    }
+    const uint64_t batchSize = 256;
+    uint64_t numVertices = firstVertex.back();
+    startTime = std::chrono::high_resolution_clock::now();
+    pool.parallelFor((numVertices + batchSize - 1) / batchSize, [&](uint64_t batch) {
+        uint64_t end = std::min(numVertices, (batch + 1) * batchSize);
+        for(uint64_t vertex = batch * batchSize; vertex < end; vertex++) {
+            uint64_t meshIndex = std::upper_bound(firstVertex.begin(), firstVertex.end(), vertex) - firstVertex.begin() - 1;
+            Mesh& mesh = meshes[meshIndex];
+            uint64_t i = vertex - firstVertex[meshIndex];
+            const glm::mat4& transform = meshTransforms[meshIndex];
+            const Position& p = mesh.positions[i];
+            const Position& n = mesh.normals[i];
+            glm::vec3 normal = glm::inverseTranspose(glm::mat3(transform)) * glm::vec3(n.x, n.y, n.z);
+            if(glm::length(normal) == 0.0f) {
+                mesh.occlusion[i] = 1.0f;
+                continue;
+            }
+            normal = glm::normalize(normal);
+            glm::vec3 origin = glm::vec3(transform * glm::vec4(p.x, p.y, p.z, 1.0f)) + normal * bias;
+            float rotation = (uint32_t)(vertex * 2654435761u) * 2.3283064e-10f;
+            uint32_t numHits = 0;
+            for(uint32_t ray = 0; ray < options.occlusionRays; ray++) {
+                float direction[3];
+                getOcclusionDirection(ray, options.occlusionRays, rotation, &normal.x, direction);
+                numHits += occluders.isOccluded(&origin.x, direction, distance) ? 1 : 0;
+            }
+            mesh.occlusion[i] = 1.0f - (float)numHits / options.occlusionRays;
+        }
+    });
+    double bakeSeconds = secondsSince(startTime);
+    uint64_t numRays = numVertices * options.occlusionRays;
+    log << "Ambient occlusion: " << triangles.size() / 9 << " triangles, BVH built in " << buildSeconds << " s, " << numRays << " rays in "
+        << bakeSeconds << " s on " << pool.getNumThreads() + 1 << " threads (" << (bakeSeconds > 0.0 ? numRays / bakeSeconds / 1e6 : 0.0)
+        << " million rays/s)" << std::endl;
+}
+
+// Converts one model file. The importer is reused between files of the same thread.
+bool exportModel(Assimp::Importer& importer, ThreadPool& pool, ExportResult& result) {
+    std::ostringstream log;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    // Hashed before the import, so a change while the export runs makes the next run rebuild
+    CookInput modelInput;
+    hashCookInput(result.inputFilename, modelInput);
+    // The in-tree passes replace assimp's cache locality step
+    unsigned int importFlags = aiProcess_Triangulate | aiProcess_GenNormals | aiProcess_OptimizeMeshes | aiProcess_JoinIdenticalVertices | aiProcess_CalcTangentSpace;
+    importFlags |= options.optimize ? 0 : aiProcess_ImproveCacheLocality;
+    const aiScene* scene = importer.ReadFile(result.inputFilename, importFlags);
+    if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
+        log << "Error while loading model with assimp: " << importer.GetErrorString() << std::endl;
+        result.log = log.str();
+        return false;
+    }
+    result.importSeconds = secondsSince(startTime);
+
+    startTime = std::chrono::high_resolution_clock::now();
+    ExportScene exported;
+    processMaterials(scene, exported, log);
+    processNode(scene->mRootNode, scene, BMF_NO_PARENT, exported);
+    std::vector<Mesh>& meshes = exported.meshes;
+    std::vector<BMFNodeRecord>& nodes = exported.nodes;
+    std::vector<uint32_t>& nodeMeshes = exported.nodeMeshes;
+    log << scene->mNumMeshes << " meshes, " << nodes.size() << " nodes, " << nodeMeshes.size() << " mesh instances" << std::endl;
+    std::unique_ptr<aiScene> streamedScene;
+    if(options.stream) {
+        // Owned from here on, so every aiMesh can be released as soon as it is written
+        streamedScene.reset(importer.GetOrphanedScene());
+    } else {
+        for(unsigned int i = 0; i < scene->mNumMeshes; i++) {
+            processMesh(scene->mMeshes[i], scene, exported);
+        }
+        importer.FreeScene();
+
+        if(options.merge) {
+            mergeMaterials(exported, log);
+            mergeMeshes(exported, log);
+        }
+        if(options.split16) {
+            splitMeshes(exported, log);
+        }
+        for(uint64_t i = 0; i < meshes.size(); i++) {
+            buildMesh(meshes[i], i, log);
+        }
+        if(options.occlusionRays > 0) {
+            bakeOcclusion(exported, pool, log);
+        }
+    }
+
+    BMFWriter output;
+    if(options.stream && !output.open(result.outputFilename)) {
+        log << "Could not write " << result.outputFilename << std::endl;
+        result.log = log.str();
+        return false;
+    }
+    // Space for the header, it is written last
+    BMFHeader header = {};
+    output.write(&header, sizeof(BMFHeader));
+
+    // Blob section: texture names, embedded textures, vertex and index data
+    uint64_t blobStart = bmfAlign(output.tell(), BMF_ALIGNMENT);
+    const std::string& inputFilename = result.inputFilename;
+    std::string inputDirectory = inputFilename.substr(0, getFilename((char*)inputFilename.c_str()) - inputFilename.c_str());
+    TextureEmbedder textures;
+    std::vector<BMFMaterialRecord> materialRecords;
+    for(Material& material : exported.materials) {
+        BMFMaterialRecord record = {};
+        memcpy(&record, &material, sizeof(BMFMaterial));
+        std::string diffuseMapName = material.diffuseMapName.length > 0 ? "models/" + std::string(material.diffuseMapName.C_Str()) : "";
+        std::string normalMapName = material.normalMapName.length > 0 ? "models/" + std::string(material.normalMapName.C_Str()) : "";
+        record.diffuseMapName = output.writeBlob(diffuseMapName.data(), diffuseMapName.size());
+        record.normalMapName = output.writeBlob(normalMapName.data(), normalMapName.size());
+        if(options.embedTextures) {
+            std::string specularMapName = material.specularMapName.length > 0 ? inputDirectory + material.specularMapName.C_Str() : "";
+            bool specularInDiffuse = false;
+            bool specularInNormal = false;
+            if(material.diffuseMapName.length > 0) {
+                record.diffuseMapTexture = textures.embed(output, inputDirectory + material.diffuseMapName.C_Str(), false, specularMapName,
+                    specularInDiffuse, log);
+            }
+            if(material.normalMapName.length > 0) {
+                record.normalMapTexture = textures.embed(output, inputDirectory + material.normalMapName.C_Str(), true,
+                    specularInDiffuse ? "" : specularMapName, specularInNormal, log);
+            }
+            record.specularChannel = specularInDiffuse ? BMF_SPECULAR_DIFFUSE_ALPHA : (specularInNormal ? BMF_SPECULAR_NORMAL_BLUE : BMF_SPECULAR_NONE);
+        }
+        materialRecords.push_back(record);
+    }
+
+    MeshTables tables;
+    if(options.stream) {
+        streamMeshes(streamedScene.get(), exported, output, tables, log);
+    } else {
+        for(Mesh& mesh : meshes) {
+            writeMesh(output, mesh, tables);
+        }
+    }
+    output.align(BMF_ALIGNMENT);
+    BMFSection blobSection = {BMF_SECTION_BLOB, 1, blobStart, output.tell() - blobStart};
+    output.sections.push_back(blobSection);
+
+    output.writeSection(BMF_SECTION_MATERIALS, materialRecords.data(), (uint32_t)materialRecords.size(), sizeof(BMFMaterialRecord));
+    output.writeSection(BMF_SECTION_MESHES, tables.meshRecords.data(), (uint32_t)tables.meshRecords.size(), sizeof(BMFMeshRecord));
+    output.writeSection(BMF_SECTION_BOUNDS, tables.boundsRecords.data(), (uint32_t)tables.boundsRecords.size(), sizeof(BMFBoundsRecord));
+    output.writeSection(BMF_SECTION_NODES, nodes.data(), (uint32_t)nodes.size(), sizeof(BMFNodeRecord));
+    output.writeSection(BMF_SECTION_NODE_MESHES, nodeMeshes.data(), (uint32_t)nodeMeshes.size(), sizeof(uint32_t));
+    if(!tables.lodRecords.empty()) {
+        output.writeSection(BMF_SECTION_LODS, tables.lodRecords.data(), (uint32_t)tables.lodRecords.size(), sizeof(BMFLodRecord));
+    }
+    if(!tables.meshletRecords.empty()) {
+        output.writeSection(BMF_SECTION_MESHLETS, tables.meshletRecords.data(), (uint32_t)tables.meshletRecords.size(), sizeof(BMFMeshletRecord));
+    }
+    if(!tables.submeshRecords.empty()) {
+        output.writeSection(BMF_SECTION_SUBMESHES, tables.submeshRecords.data(), (uint32_t)tables.submeshRecords.size(), sizeof(BMFSubmeshRecord));
+    }
+    if(!textures.records.empty()) {
+        output.writeSection(BMF_SECTION_TEXTURES, textures.records.data(), (uint32_t)textures.records.size(), sizeof(BMFTextureRecord));
+    }
+    output.finish();
+    result.processSeconds = secondsSince(startTime);
+
+    startTime = std::chrono::high_resolution_clock::now();
+    bool saved = output.save(result.outputFilename);
+    result.writeSeconds = secondsSince(startTime);
+    result.outputSize = output.tell();
+    if(!saved) {
+        log << "Could not write " << result.outputFilename << std::endl;
+    }
+    result.log = log.str();
+
+    result.cooked.exporterVersion = EXPORTER_VERSION;
+    result.cooked.optionsHash = hashOptions();
+    result.cooked.outputSize = result.outputSize;
+    result.cooked.inputs.resize(1);
+    result.cooked.inputs[0] = modelInput;
+    for(const auto& file : textures.files) {
+        result.cooked.inputs.push_back(file.second);
+    }
+    return saved;
+}
+
+bool isDirectory(const std::string& path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && (info.st_mode & S_IFMT) == S_IFDIR;
+}
+
+// Adds the files in directory and its subdirectories that assimp can import, in name order
+void collectModelFiles(const std::string& directory, Assimp::Importer& importer, std::vector<std::string>& result) {
+    std::vector<std::string> names;
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((directory + "/*").c_str(), &data);
+    if(find != INVALID_HANDLE_VALUE) {
+        do {
+            names.push_back(data.cFileName);
+        } while(FindNextFileA(find, &data));
+        FindClose(find);
+    }
+#else
+    DIR* dir = opendir(directory.c_str());
+    if(dir) {
+        while(dirent* entry = readdir(dir)) {
+            names.push_back(entry->d_name);
+        }
+        closedir(dir);
+    }
+#endif
+    std::sort(names.begin(), names.end());
+    for(const std::string& name : names) {
+        if(name == "." || name == "..") {
+            continue;
+        }
+        std::string path = directory + "/" + name;
+        if(isDirectory(path)) {
+            collectModelFiles(path, importer, result);
+        } else if(name.find('.') != std::string::npos && importer.IsExtensionSupported(name.substr(name.find_last_of('.')))) {
+            result.push_back(path);
+        }
     }
 }
 
@@ -158,78 +1427,196 @@ int main(int argc, char** argv) {
     if(argc <= 0) {
         return 1;
     }
-    if(argc < 2) {
-        std::cout << "Usage: " << argv[0] << " <modelfilename>" << std::endl;
+    std::vector<std::string> inputs;
+    std::string outputDirectory;
+    std::string manifestFilename;
+    bool force = false;
+    uint32_t numJobs = 0;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--quantize") == 0) {
+            options.quantize = true;
+        } else if(strcmp(argv[i], "--compress") == 0) {
+            options.compress = true;
+        } else if(strcmp(argv[i], "--split16") == 0) {
+            options.split16 = true;
+        } else if(strcmp(argv[i], "--optimize") == 0) {
+            options.optimize = true;
+        } else if(strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            options.cacheSize = (uint32_t)atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--overdraw-threshold") == 0 && i + 1 < argc) {
+            options.overdrawThreshold = (float)atof(argv[++i]);
+        } else if(strcmp(argv[i], "--lods") == 0 && i + 1 < argc) {
+            options.numLods = (uint32_t)atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--meshlets") == 0) {
+            options.meshlets = true;
+        } else if(strcmp(argv[i], "--merge") == 0) {
+            options.merge = true;
+        } else if(strcmp(argv[i], "--stream") == 0) {
+            options.stream = true;
+        } else if(strcmp(argv[i], "--ao") == 0 && i + 1 < argc) {
+            options.occlusionRays = (uint32_t)atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--ao-distance") == 0 && i + 1 < argc) {
+            options.occlusionDistance = (float)atof(argv[++i]);
+        } else if(strcmp(argv[i], "--embed-textures") == 0) {
+            options.embedTextures = BMF_TEXTURE_ENCODED;
+        } else if(strcmp(argv[i], "--embed-textures=rgba8") == 0) {
+            options.embedTextures = BMF_TEXTURE_RGBA8;
+        } else if(strcmp(argv[i], "--embed-textures=bc") == 0) {
+            options.embedTextures = BMF_TEXTURE_BC1;
+        } else if(strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            numJobs = (uint32_t)atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--output-dir") == 0 && i + 1 < argc) {
+            outputDirectory = argv[++i];
+        } else if(strcmp(argv[i], "--manifest") == 0 && i + 1 < argc) {
+            manifestFilename = argv[++i];
+        } else if(strcmp(argv[i], "--force") == 0) {
+            force = true;
+        } else if(strcmp(argv[i], "--roundtrip") == 0) {
+            return roundtripFiles(argc, argv, i + 1) ? 0 : 1;
+        } else if(argv[i][0] == '-') {
+            std::cout << "Unknown option " << argv[i] << std::endl;
+            return 1;
+        } else {
+            inputs.push_back(argv[i]);
+        }
+    }
+    if(options.stream && (options.merge || options.occlusionRays > 0)) {
+        std::cout << "--stream can't be combined with --merge or --ao, they need all meshes at once" << std::endl;
         return 1;
     }
-
-    Assimp::Importer importer;
-    const aiScene* scene = importer.ReadFile(argv[argc-1], aiProcess_PreTransformVertices | aiProcess_Triangulate | aiProcess_GenNormals | aiProcess_OptimizeMeshes | aiProcess_OptimizeGraph | aiProcess_JoinIdenticalVertices | aiProcess_ImproveCacheLocality | aiProcess_CalcTangentSpace);
-    if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE, !scene->mRootNode) {
-        std::cout << "Error while loading model with assimp: " << importer.GetErrorString() << std::endl;
+    if(inputs.empty()) {
+        std::cout << "Usage: " << argv[0] << " [options] <model files or directories>" << std::endl;
+        std::cout << "  --quantize  Write 16 bit positions, octahedral normals and tangents and half float uvs" << std::endl;
+        std::cout << "  --compress  Compress the vertex and index streams" << std::endl;
+        std::cout << "  --split16  Split meshes with more than 65536 vertices so all meshes use 16 bit indices" << std::endl;
+        std::cout << "  --optimize  Reorder triangles and vertices for the vertex cache, overdraw and vertex fetch" << std::endl;
+        std::cout << "  --cache-size <n>  Vertex cache size the optimizer targets, default 16" << std::endl;
+        std::cout << "  --overdraw-threshold <x>  Cache miss ratio the overdraw pass may give up, default 1.05" << std::endl;
+        std::cout << "  --lods <n>  Store n levels of detail per mesh, each with about half the triangles of the previous one" << std::endl;
+        std::cout << "  --meshlets  Split the meshes into clusters of at most 64 vertices and 124 triangles for culling" << std::endl;
+        std::cout << "  --ao n  Bake ambient occlusion into the vertices with n rays per vertex" << std::endl;
+        std::cout << "  --ao-distance d  Length of the occlusion rays, a tenth of the scene size by default" << std::endl;
+        std::cout << "  --stream  Write every mesh as soon as it is processed, for scenes that don't fit in memory twice" << std::endl;
+        std::cout << "  --merge  Merge identical materials and concatenate the meshes that share a material and nodes, for fewer draw calls" << std::endl;
+        std::cout << "  --embed-textures  Store the texture files in the bmf file instead of referencing them by name" << std::endl;
+        std::cout << "  --embed-textures=rgba8  Store the textures decoded with mips, so they can be uploaded without decoding. Normal maps" << std::endl;
+        std::cout << "      are RG8 and specular maps are packed into the diffuse alpha or the normal map blue" << std::endl;
+        std::cout << "  --embed-textures=bc  Store the textures with mips and block compressed, BC5 for normal maps. Specular maps are" << std::endl;
+        std::cout << "      packed into the diffuse alpha unless it is alpha tested" << std::endl;
+        std::cout << "  --jobs <n>  Number of files converted at the same time, default one per hardware thread" << std::endl;
+        std::cout << "  --output-dir <dir>  Directory the bmf files are written to, default the working directory" << std::endl;
+        std::cout << "  --manifest <file>  Only convert files whose output is missing or whose inputs or options changed since" << std::endl;
+        std::cout << "                     the last run with the same manifest" << std::endl;
+        std::cout << "  --force  Convert all files even if the manifest says they are up to date" << std::endl;
+        std::cout << "  --roundtrip <bmf files>  Check that the streams of existing files survive compression bit exact" << std::endl;
+        std::cout << "Directories are searched recursively for files assimp can import." << std::endl;
         return 1;
     }
 
-    processMaterials(scene);
-    processNode(scene->mRootNode, scene);
-
-    std::string filename = std::string(getFilename(argv[argc-1]));
-    std::string filenameWithoutExtension = filename.substr(0, filename.find_last_of('.'));
-    std::string outputFilename = filenameWithoutExtension + ".bmf";
-
-    std::ofstream output(outputFilename, std::ios::out | std::ios::binary);
-    std::cout << "Writing bmf file..." << std::endl;
-
-    // Materials
-    uint64_t numMaterials = materials.size();
-    output.write((char*)&numMaterials, sizeof(uint64_t));
-    for(Material material : materials) {
-        output.write((char*)&material, sizeof(BMFMaterial));
-        const char* pathPrefix = "models/";
-        // Diffuse map
-        uint64_t diffuesMapNameLength = material.diffuseMapName.length + 7;
-        output.write((char*)&diffuesMapNameLength, sizeof(uint64_t));
-        output.write(pathPrefix, 7);
-        output.write((char*)&material.diffuseMapName.data, material.diffuseMapName.length);
-
-        // Normal map
-        uint64_t normalMapNameLength = material.normalMapName.length + 7;
-        output.write((char*)&normalMapNameLength, sizeof(uint64_t));
-        output.write(pathPrefix, 7);
-        output.write((char*)&material.normalMapName.data, material.normalMapName.length);
-    }
-
-    // Meshes
-    uint64_t numMeshes = meshes.size();
-    output.write((char*)&numMeshes, sizeof(uint64_t));
-    for(Mesh& mesh : meshes) {
-        uint64_t numVertices = mesh.positions.size();
-        uint64_t numIndices = mesh.indices.size();
-        uint64_t materialIndex = mesh.materialIndex;
-
-        output.write((char*)&materialIndex, sizeof(uint64_t));
-        output.write((char*)&numVertices, sizeof(uint64_t));
-        output.write((char*)&numIndices, sizeof(uint64_t));
-        for(uint64_t i = 0; i < numVertices; i++) {
-            output.write((char*)&mesh.positions[i].x, sizeof(float));
-            output.write((char*)&mesh.positions[i].y, sizeof(float));
-            output.write((char*)&mesh.positions[i].z, sizeof(float));
-
-            output.write((char*)&mesh.normals[i].x, sizeof(float));
-            output.write((char*)&mesh.normals[i].y, sizeof(float));
-            output.write((char*)&mesh.normals[i].z, sizeof(float));
+    std::vector<ExportResult> results;
+    {
+        Assimp::Importer importer;
+        std::vector<std::string> inputFilenames;
+        for(const std::string& input : inputs) {
+            if(isDirectory(input)) {
+                collectModelFiles(input, importer, inputFilenames);
+            } else {
+                inputFilenames.push_back(input);
+            }
+        }
+        // The output name only keeps the file name, so files from different directories can collide
+        std::map<std::string, std::string> outputs;
+        for(const std::string& inputFilename : inputFilenames) {
+            std::string filename = std::string(getFilename((char*)inputFilename.c_str()));
+            std::string filenameWithoutExtension = filename.substr(0, filename.find_last_of('.'));
+            std::string outputFilename = filenameWithoutExtension + ".bmf";
+            if(!outputDirectory.empty()) {
+                outputFilename = outputDirectory + "/" + outputFilename;
+            }
+            if(outputs.count(outputFilename)) {
+                std::cout << "Skipping " << inputFilename << ", " << outputs[outputFilename] << " is also written to " << outputFilename << std::endl;
+                continue;
+            }
+            outputs[outputFilename] = inputFilename;
+            ExportResult result;
+            result.inputFilename = inputFilename;
+            result.outputFilename = outputFilename;
+            results.push_back(result);
+        }
+    }
+    if(results.empty()) {
+        std::cout << "No model files found" << std::endl;
+        return 1;
+    }
+    CookManifest manifest;
+    if(!manifestFilename.empty() && !manifest.load(manifestFilename)) {
+        return 1;
+    }
+    uint64_t optionsHash = hashOptions();
 
-            output.write((char*)&mesh.tangents[i].x, sizeof(float));
-            output.write((char*)&mesh.tangents[i].y, sizeof(float));
-            output.write((char*)&mesh.tangents[i].z, sizeof(float));
+    // Every worker keeps its importer and takes the next file when it is done with one
+    uint64_t numWorkers = numJobs > 0 ? numJobs : std::thread::hardware_concurrency();
+    numWorkers = numWorkers < results.size() ? numWorkers : results.size();
+    numWorkers = numWorkers > 0 ? numWorkers : 1;
+    // Files take numWorkers threads, the rest help with baking ambient occlusion
+    uint64_t numThreads = std::max<uint64_t>(numWorkers, std::thread::hardware_concurrency());
+    ThreadPool pool((uint32_t)(numThreads - 1));
+    std::atomic<uint64_t> nextFile(0);
+    std::mutex logMutex;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    pool.parallelFor(numWorkers, [&](uint64_t) {
+        Assimp::Importer importer;
+        for(uint64_t i = nextFile.fetch_add(1); i < results.size(); i = nextFile.fetch_add(1)) {
+            ExportResult& result = results[i];
+            if(!manifestFilename.empty() && !force
+                && manifest.isUpToDate(result.outputFilename, EXPORTER_VERSION, optionsHash, result.cooked)) {
+                result.upToDate = true;
+                result.success = true;
+                continue;
+            }
+            result.success = exportModel(importer, pool, result);
+            std::lock_guard<std::mutex> lock(logMutex);
+            std::cout << result.inputFilename << " -> " << result.outputFilename << std::endl << result.log;
+        }
+    });
+    double totalSeconds = secondsSince(startTime);
 
-            output.write((char*)&mesh.uvs[i].x, sizeof(float));
-            output.write((char*)&mesh.uvs[i].y, sizeof(float));
+    uint64_t numFailed = 0;
+    uint64_t numUpToDate = 0;
+    double busySeconds = 0.0;
+    for(const ExportResult& result : results) {
+        numFailed += result.success ? 0 : 1;
+        numUpToDate += result.upToDate ? 1 : 0;
+        busySeconds += result.importSeconds + result.processSeconds + result.writeSeconds;
+    }
+    if(!manifestFilename.empty()) {
+        for(const ExportResult& result : results) {
+            if(result.success) {
+                manifest.entries[result.outputFilename] = result.cooked;
+            } else {
+                manifest.entries.erase(result.outputFilename);
+            }
         }
-        for(uint64_t i = 0; i < numIndices; i++) {
-            output.write((char*)&mesh.indices[i], sizeof(uint32_t));
+        if(!manifest.save(manifestFilename)) {
+            std::cout << "Could not write " << manifestFilename << std::endl;
+            return 1;
         }
     }
-    
-    output.close();
-}
\ No newline at end of file
+    if(results.size() > 1) {
+        if(numUpToDate < results.size()) {
+            std::cout << std::endl << "import s\tprocess s\twrite s\tbytes\tfile" << std::endl;
+        }
+        for(const ExportResult& result : results) {
+            if(result.upToDate) {
+                continue;
+            }
+            std::cout << result.importSeconds << "\t" << result.processSeconds << "\t" << result.writeSeconds << "\t"
+                << result.outputSize << "\t" << result.inputFilename << (result.success ? "" : " FAILED") << std::endl;
+        }
+        std::cout << results.size() - numFailed - numUpToDate << " of " << results.size() << " files converted, " << numUpToDate
+            << " up to date, in " << totalSeconds << " s on " << numWorkers << " threads, " << busySeconds << " s of work" << std::endl;
+    } else if(numUpToDate > 0) {
+        std::cout << results[0].outputFilename << " is up to date" << std::endl;
+    }
+    return numFailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,358 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCCLUSION_SSE2 1
+#endif
+
+// Ray casting for baking ambient occlusion. The triangles are sorted into a bounding volume
+// hierarchy with four children per node and four triangles per leaf. Both are stored as structure
+// of arrays, so a ray is tested against the four child boxes of a node or the four triangles of a
+// leaf at once with SSE2 (triangles with Moller and Trumbore 1997, "Fast, Minimum Storage
+// Ray/Triangle Intersection"). Without SSE2 the same tests run one lane at a time.
+//
+// Rays only answer whether anything is hit, which is all ambient occlusion needs, so traversal
+// stops at the first hit and triangles are two sided.
+
+// Up to four children, lane i is child i
+struct alignas(16) OcclusionNode {
+    float min[3][4];
+    float max[3][4];
+    // Index of the child node, or of the triangle group if bit i of leafMask is set
+    uint32_t children[4];
+    uint32_t leafMask;
+    uint32_t numChildren;
+    uint32_t padding[2];
+};
+
+// Four triangles as a corner and two edges, lane i is triangle i. Unused lanes are degenerate and
+// never hit.
+struct alignas(16) OcclusionTriangleGroup {
+    float corner[3][4];
+    float edge1[3][4];
+    float edge2[3][4];
+};
+
+struct OcclusionScene {
+    // triangles are 9 floats each, the three corners
+    void build(const std::vector<float>& triangles) {
+        uint32_t numTriangles = (uint32_t)(triangles.size() / 9);
+        nodes.clear();
+        groups.clear();
+        depth = 0;
+        if(numTriangles == 0) {
+            return;
+        }
+        std::vector<uint32_t> order(numTriangles);
+        std::vector<float> centers(numTriangles * 3);
+        for(uint32_t i = 0; i < numTriangles; i++) {
+            order[i] = i;
+            for(uint32_t k = 0; k < 3; k++) {
+                centers[i * 3 + k] = (triangles[i * 9 + k] + triangles[i * 9 + 3 + k] + triangles[i * 9 + 6 + k]) / 3.0f;
+            }
+        }
+        std::vector<BinaryNode> binaryNodes;
+        binaryNodes.reserve(numTriangles / 2 + 1);
+        groups.reserve(numTriangles / 4 + 1);
+        buildBinaryNode(binaryNodes, triangles, centers, order.data(), numTriangles);
+        nodes.reserve(binaryNodes.size() / 3 + 1);
+        collapseNode(binaryNodes, 0, 1);
+        assert(depth <= MAX_DEPTH);
+    }
+
+    // True if the ray from origin along direction hits a triangle closer than maxDistance
+    bool isOccluded(const float* origin, const float* direction, float maxDistance) const {
+        if(nodes.empty()) {
+            return false;
+        }
+        float inverse[3];
+        for(uint32_t k = 0; k < 3; k++) {
+            inverse[k] = direction[k] != 0.0f ? 1.0f / direction[k] : FLT_MAX;
+        }
+        // Every level leaves at most three nodes on the stack, the root is popped before its
+        // children are pushed
+        uint32_t stack[3 * MAX_DEPTH + 1];
+        uint32_t stackSize = 1;
+        stack[0] = 0;
+        while(stackSize > 0) {
+            const OcclusionNode& node = nodes[stack[--stackSize]];
+            uint32_t hitMask = hitsBoxes(node, origin, inverse, maxDistance);
+            for(uint32_t i = 0; i < node.numChildren; i++) {
+                if(!(hitMask & (1 << i))) {
+                    continue;
+                }
+                if(node.leafMask & (1 << i)) {
+                    if(hitsGroup(groups[node.children[i]], origin, direction, maxDistance)) {
+                        return true;
+                    }
+                } else {
+                    stack[stackSize++] = node.children[i];
+                }
+            }
+        }
+        return false;
+    }
+
+    // Median splits halve the triangle count per binary level and a node never sits deeper than the
+    // binary node it came from, so 32 levels cover any 32 bit triangle count
+    static const uint32_t MAX_DEPTH = 32;
+
+    std::vector<OcclusionNode> nodes;
+    std::vector<OcclusionTriangleGroup> groups;
+    // Number of node levels of the last build
+    uint32_t depth = 0;
+
+private:
+    struct BinaryNode {
+        float min[3];
+        float max[3];
+        // Leaves: index of their triangle group. Inner nodes: index of the second child, the first
+        // child follows the node directly.
+        uint32_t index;
+        bool isLeaf;
+    };
+
+    // Splits at the median center along the longest axis of the centers, which keeps the tree
+    // balanced
+    uint32_t buildBinaryNode(std::vector<BinaryNode>& binaryNodes, const std::vector<float>& triangles, const std::vector<float>& centers,
+        uint32_t* order, uint32_t count) {
+        uint32_t index = (uint32_t)binaryNodes.size();
+        binaryNodes.push_back(BinaryNode());
+        float min[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+        float max[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        float centerMin[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+        float centerMax[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        for(uint32_t i = 0; i < count; i++) {
+            for(uint32_t k = 0; k < 3; k++) {
+                for(uint32_t corner = 0; corner < 3; corner++) {
+                    min[k] = std::min(min[k], triangles[order[i] * 9 + corner * 3 + k]);
+                    max[k] = std::max(max[k], triangles[order[i] * 9 + corner * 3 + k]);
+                }
+                centerMin[k] = std::min(centerMin[k], centers[order[i] * 3 + k]);
+                centerMax[k] = std::max(centerMax[k], centers[order[i] * 3 + k]);
+            }
+        }
+        memcpy(binaryNodes[index].min, min, sizeof(min));
+        memcpy(binaryNodes[index].max, max, sizeof(max));
+
+        if(count <= 4) {
+            OcclusionTriangleGroup group = {};
+            for(uint32_t i = 0; i < count; i++) {
+                const float* triangle = &triangles[order[i] * 9];
+                for(uint32_t k = 0; k < 3; k++) {
+                    group.corner[k][i] = triangle[k];
+                    group.edge1[k][i] = triangle[3 + k] - triangle[k];
+                    group.edge2[k][i] = triangle[6 + k] - triangle[k];
+                }
+            }
+            binaryNodes[index].index = (uint32_t)groups.size();
+            binaryNodes[index].isLeaf = true;
+            groups.push_back(group);
+            return index;
+        }
+
+        uint32_t axis = 0;
+        for(uint32_t k = 1; k < 3; k++) {
+            if(centerMax[k] - centerMin[k] > centerMax[axis] - centerMin[axis]) {
+                axis = k;
+            }
+        }
+        uint32_t half = count / 2;
+        std::nth_element(order, order + half, order + count, [&](uint32_t a, uint32_t b) {
+            return centers[a * 3 + axis] < centers[b * 3 + axis];
+        });
+        buildBinaryNode(binaryNodes, triangles, centers, order, half);
+        uint32_t second = buildBinaryNode(binaryNodes, triangles, centers, order + half, count - half);
+        binaryNodes[index].index = second;
+        binaryNodes[index].isLeaf = false;
+        return index;
+    }
+
+    // Turns a binary node into a node with its children and grandchildren, opening up the largest
+    // inner child until there are four. A leaf, which only happens at the root, becomes the single
+    // child. level is the depth of the new node, the root is at level 1. Returns the index of the new
+    // node.
+    uint32_t collapseNode(const std::vector<BinaryNode>& binaryNodes, uint32_t binaryIndex, uint32_t level) {
+        depth = std::max(depth, level);
+        uint32_t children[4] = {binaryIndex};
+        uint32_t numChildren = 1;
+        if(!binaryNodes[binaryIndex].isLeaf) {
+            children[0] = binaryIndex + 1;
+            children[1] = binaryNodes[binaryIndex].index;
+            numChildren = 2;
+        }
+        while(numChildren < 4) {
+            int32_t largest = -1;
+            float largestArea = -1.0f;
+            for(uint32_t i = 0; i < numChildren; i++) {
+                const BinaryNode& child = binaryNodes[children[i]];
+                float size[3] = {child.max[0] - child.min[0], child.max[1] - child.min[1], child.max[2] - child.min[2]};
+                float area = size[0] * size[1] + size[1] * size[2] + size[2] * size[0];
+                if(!child.isLeaf && area > largestArea) {
+                    largest = (int32_t)i;
+                    largestArea = area;
+                }
+            }
+            if(largest < 0) {
+                break;
+            }
+            uint32_t opened = children[largest];
+            children[largest] = opened + 1;
+            children[numChildren++] = binaryNodes[opened].index;
+        }
+
+        uint32_t index = (uint32_t)nodes.size();
+        nodes.push_back(OcclusionNode());
+        OcclusionNode node = {};
+        node.numChildren = numChildren;
+        for(uint32_t i = 0; i < numChildren; i++) {
+            const BinaryNode& child = binaryNodes[children[i]];
+            for(uint32_t k = 0; k < 3; k++) {
+                node.min[k][i] = child.min[k];
+                node.max[k][i] = child.max[k];
+            }
+            if(child.isLeaf) {
+                node.children[i] = child.index;
+                node.leafMask |= 1 << i;
+            } else {
+                node.children[i] = collapseNode(binaryNodes, children[i], level + 1);
+            }
+        }
+        nodes[index] = node;
+        return index;
+    }
+
+#ifdef OCCLUSION_SSE2
+    // Bit i is set if the ray enters box i before maxDistance
+    static uint32_t hitsBoxes(const OcclusionNode& node, const float* origin, const float* inverse, float maxDistance) {
+        __m128 enter = _mm_setzero_ps();
+        __m128 leave = _mm_set1_ps(maxDistance);
+        for(uint32_t k = 0; k < 3; k++) {
+            __m128 o = _mm_set1_ps(origin[k]);
+            __m128 scale = _mm_set1_ps(inverse[k]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min[k]), o), scale);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max[k]), o), scale);
+            enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+            leave = _mm_min_ps(leave, _mm_max_ps(t0, t1));
+        }
+        return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(enter, leave));
+    }
+#else
+    static uint32_t hitsBoxes(const OcclusionNode& node, const float* origin, const float* inverse, float maxDistance) {
+        uint32_t result = 0;
+        for(uint32_t i = 0; i < 4; i++) {
+            float enter = 0.0f;
+            float leave = maxDistance;
+            for(uint32_t k = 0; k < 3; k++) {
+                float t0 = (node.min[k][i] - origin[k]) * inverse[k];
+                float t1 = (node.max[k][i] - origin[k]) * inverse[k];
+                enter = std::max(enter, std::min(t0, t1));
+                leave = std::min(leave, std::max(t0, t1));
+            }
+            result |= enter <= leave ? 1 << i : 0;
+        }
+        return result;
+    }
+#endif
+
+#ifdef OCCLUSION_SSE2
+    static bool hitsGroup(const OcclusionTriangleGroup& group, const float* origin, const float* direction, float maxDistance) {
+        const float epsilon = 1e-12f;
+        __m128 d[3];
+        __m128 t[3];
+        __m128 e1[3];
+        __m128 e2[3];
+        for(uint32_t k = 0; k < 3; k++) {
+            d[k] = _mm_set1_ps(direction[k]);
+            t[k] = _mm_sub_ps(_mm_set1_ps(origin[k]), _mm_load_ps(group.corner[k]));
+            e1[k] = _mm_load_ps(group.edge1[k]);
+            e2[k] = _mm_load_ps(group.edge2[k]);
+        }
+        // p = d x e2, q = t x e1
+        __m128 p0 = _mm_sub_ps(_mm_mul_ps(d[1], e2[2]), _mm_mul_ps(d[2], e2[1]));
+        __m128 p1 = _mm_sub_ps(_mm_mul_ps(d[2], e2[0]), _mm_mul_ps(d[0], e2[2]));
+        __m128 p2 = _mm_sub_ps(_mm_mul_ps(d[0], e2[1]), _mm_mul_ps(d[1], e2[0]));
+        __m128 q0 = _mm_sub_ps(_mm_mul_ps(t[1], e1[2]), _mm_mul_ps(t[2], e1[1]));
+        __m128 q1 = _mm_sub_ps(_mm_mul_ps(t[2], e1[0]), _mm_mul_ps(t[0], e1[2]));
+        __m128 q2 = _mm_sub_ps(_mm_mul_ps(t[0], e1[1]), _mm_mul_ps(t[1], e1[0]));
+        __m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], p0), _mm_mul_ps(e1[1], p1)), _mm_mul_ps(e1[2], p2));
+        __m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(t[0], p0), _mm_mul_ps(t[1], p1)), _mm_mul_ps(t[2], p2));
+        __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], q0), _mm_mul_ps(d[1], q1)), _mm_mul_ps(d[2], q2));
+        __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2[0], q0), _mm_mul_ps(e2[1], q1)), _mm_mul_ps(e2[2], q2));
+        // Compared against the determinant instead of dividing by it, flipped so it is positive
+        __m128 sign = _mm_and_ps(determinant, _mm_set1_ps(-0.0f));
+        __m128 absDeterminant = _mm_xor_ps(determinant, sign);
+        u = _mm_xor_ps(u, sign);
+        v = _mm_xor_ps(v, sign);
+        distance = _mm_xor_ps(distance, sign);
+        __m128 zero = _mm_setzero_ps();
+        __m128 hit = _mm_cmpgt_ps(absDeterminant, _mm_set1_ps(epsilon));
+        hit = _mm_and_ps(hit, _mm_cmpge_ps(u, zero));
+        hit = _mm_and_ps(hit, _mm_cmpge_ps(v, zero));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), absDeterminant));
+        hit = _mm_and_ps(hit, _mm_cmpgt_ps(distance, zero));
+        hit = _mm_and_ps(hit, _mm_cmplt_ps(distance, _mm_mul_ps(absDeterminant, _mm_set1_ps(maxDistance))));
+        return _mm_movemask_ps(hit) != 0;
+    }
+#else
+    static bool hitsGroup(const OcclusionTriangleGroup& group, const float* origin, const float* direction, float maxDistance) {
+        const float epsilon = 1e-12f;
+        for(uint32_t i = 0; i < 4; i++) {
+            float t[3];
+            float e1[3];
+            float e2[3];
+            for(uint32_t k = 0; k < 3; k++) {
+                t[k] = origin[k] - group.corner[k][i];
+                e1[k] = group.edge1[k][i];
+                e2[k] = group.edge2[k][i];
+            }
+            float p[3] = {direction[1] * e2[2] - direction[2] * e2[1], direction[2] * e2[0] - direction[0] * e2[2], direction[0] * e2[1] - direction[1] * e2[0]};
+            float q[3] = {t[1] * e1[2] - t[2] * e1[1], t[2] * e1[0] - t[0] * e1[2], t[0] * e1[1] - t[1] * e1[0]};
+            float determinant = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+            float sign = determinant < 0.0f ? -1.0f : 1.0f;
+            float absDeterminant = determinant * sign;
+            float u = (t[0] * p[0] + t[1] * p[1] + t[2] * p[2]) * sign;
+            float v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * sign;
+            float distance = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * sign;
+            if(absDeterminant > epsilon && u >= 0.0f && v >= 0.0f && u + v <= absDeterminant && distance > 0.0f
+                && distance < absDeterminant * maxDistance) {
+                return true;
+            }
+        }
+        return false;
+    }
+#endif
+};
+
+// Direction i of numDirections, cosine distributed over the hemisphere around normal, so the
+// fraction of unoccluded directions is the ambient occlusion. The Hammersley set is rotated by
+// rotation (0 to 1 turns) around the normal, so neighbouring vertices don't show the same pattern.
+inline void getOcclusionDirection(uint32_t i, uint32_t numDirections, float rotation, const float* normal, float* result) {
+    uint32_t bits = i;
+    bits = (bits << 16) | (bits >> 16);
+    bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+    bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+    bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+    bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+    float u = (i + 0.5f) / numDirections;
+    float v = bits * 2.3283064e-10f + rotation;
+    float radius = sqrtf(u);
+    float angle = 6.2831853f * v;
+    float local[3] = {radius * cosf(angle), radius * sinf(angle), sqrtf(std::max(1.0f - u, 0.0f))};
+
+    // Tangent frame of the normal (Duff et al. 2017, "Building an Orthonormal Basis, Revisited")
+    float sign = normal[2] >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (sign + normal[2]);
+    float b = normal[0] * normal[1] * a;
+    float tangent[3] = {1.0f + sign * normal[0] * normal[0] * a, sign * b, -sign * normal[0]};
+    float bitangent[3] = {b, sign + normal[1] * normal[1] * a, -normal[1]};
+    for(uint32_t k = 0; k < 3; k++) {
+        result[k] = tangent[k] * local[0] + bitangent[k] * local[1] + normal[k] * local[2];
+    }
+}
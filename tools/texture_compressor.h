@@ -0,0 +1,379 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cfloat>
+
+#include "../bmf.h"
+
+// Mip chain generation and BC1, BC3 and BC5 block compression for the textures the exporter embeds.
+//
+// Color mips are averaged in linear light, the images are sRGB encoded even though the renderer
+// shades them as they are. Normal map mips are averaged as vectors and renormalized. Alpha tested
+// textures keep the fraction of pixels that pass the test in every mip, otherwise thin geometry
+// like leaves fades away in the distance.
+//
+// The block encoders fit the endpoints along the principal axis of the block colors, refine them
+// once with a least squares fit and keep whichever result has the smaller error. Images are RGBA8
+// with the bottom row first, so the blocks come out in the order glCompressedTexImage2D expects.
+
+struct TextureImage {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<uint8_t> pixels;
+};
+
+struct SrgbTable {
+    SrgbTable() {
+        for(uint32_t i = 0; i < 256; i++) {
+            float c = i / 255.0f;
+            values[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+        }
+    }
+    float values[256];
+};
+
+inline float srgbToLinear(uint8_t value) {
+    // Initialized once even if several export threads get here at the same time
+    static const SrgbTable table;
+    return table.values[value];
+}
+
+inline uint8_t linearToSrgb(float value) {
+    value = std::min(std::max(value, 0.0f), 1.0f);
+    float c = value <= 0.0031308f ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+    return (uint8_t)(c * 255.0f + 0.5f);
+}
+
+inline uint8_t unormToByte(float value) {
+    return (uint8_t)(std::min(std::max(value, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+// Halves the image with a box filter. Odd sizes drop their last row or column.
+inline void downsampleImage(const TextureImage& source, TextureImage& result, bool normalMap) {
+    result.width = std::max(source.width / 2, 1u);
+    result.height = std::max(source.height / 2, 1u);
+    result.pixels.resize((uint64_t)result.width * result.height * 4);
+    for(uint32_t y = 0; y < result.height; y++) {
+        for(uint32_t x = 0; x < result.width; x++) {
+            const uint8_t* p[4];
+            uint32_t x0 = std::min(x * 2, source.width - 1);
+            uint32_t x1 = std::min(x * 2 + 1, source.width - 1);
+            uint32_t y0 = std::min(y * 2, source.height - 1);
+            uint32_t y1 = std::min(y * 2 + 1, source.height - 1);
+            p[0] = &source.pixels[((uint64_t)y0 * source.width + x0) * 4];
+            p[1] = &source.pixels[((uint64_t)y0 * source.width + x1) * 4];
+            p[2] = &source.pixels[((uint64_t)y1 * source.width + x0) * 4];
+            p[3] = &source.pixels[((uint64_t)y1 * source.width + x1) * 4];
+            uint8_t* output = &result.pixels[((uint64_t)y * result.width + x) * 4];
+
+            float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+            for(uint32_t i = 0; i < 4; i++) {
+                for(uint32_t c = 0; c < 3; c++) {
+                    sum[c] += normalMap ? p[i][c] / 127.5f - 1.0f : srgbToLinear(p[i][c]);
+                }
+                sum[3] += p[i][3] / 255.0f;
+            }
+            if(normalMap) {
+                float length = sqrtf(sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]);
+                // Opposing normals cancel out, point straight out of the surface then
+                float n[3] = {0.0f, 0.0f, 1.0f};
+                if(length > 1e-6f) {
+                    n[0] = sum[0] / length;
+                    n[1] = sum[1] / length;
+                    n[2] = sum[2] / length;
+                }
+                for(uint32_t c = 0; c < 3; c++) {
+                    output[c] = unormToByte(n[c] * 0.5f + 0.5f);
+                }
+            } else {
+                for(uint32_t c = 0; c < 3; c++) {
+                    output[c] = linearToSrgb(sum[c] * 0.25f);
+                }
+            }
+            output[3] = unormToByte(sum[3] * 0.25f);
+        }
+    }
+}
+
+// Fraction of the pixels whose alpha, multiplied by scale, passes an alpha test against threshold
+inline float alphaCoverage(const TextureImage& image, float threshold, float scale) {
+    uint64_t numPixels = (uint64_t)image.width * image.height;
+    uint64_t covered = 0;
+    for(uint64_t i = 0; i < numPixels; i++) {
+        covered += image.pixels[i * 4 + 3] / 255.0f * scale >= threshold ? 1 : 0;
+    }
+    return numPixels > 0 ? (float)covered / numPixels : 0.0f;
+}
+
+// Scales the alpha of image so that the given fraction of its pixels passes the alpha test
+inline void preserveAlphaCoverage(TextureImage& image, float coverage, float threshold) {
+    float low = 0.0f;
+    float high = 8.0f;
+    for(uint32_t i = 0; i < 16; i++) {
+        float middle = (low + high) * 0.5f;
+        if(alphaCoverage(image, threshold, middle) < coverage) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    uint64_t numPixels = (uint64_t)image.width * image.height;
+    for(uint64_t i = 0; i < numPixels; i++) {
+        image.pixels[i * 4 + 3] = unormToByte(image.pixels[i * 4 + 3] / 255.0f * high);
+    }
+}
+
+// Appends the mips of levels[0] down to 1x1. alphaTestThreshold is the alpha below which the
+// renderer discards pixels, 0 if the texture is not alpha tested.
+inline void generateMips(std::vector<TextureImage>& levels, bool normalMap, float alphaTestThreshold) {
+    float coverage = alphaTestThreshold > 0.0f ? alphaCoverage(levels[0], alphaTestThreshold, 1.0f) : 0.0f;
+    while(levels.back().width > 1 || levels.back().height > 1) {
+        TextureImage level;
+        downsampleImage(levels.back(), level, normalMap);
+        if(alphaTestThreshold > 0.0f) {
+            preserveAlphaCoverage(level, coverage, alphaTestThreshold);
+        }
+        levels.push_back(std::move(level));
+    }
+}
+
+inline bool hasTranslucentPixels(const TextureImage& image) {
+    uint64_t numPixels = (uint64_t)image.width * image.height;
+    for(uint64_t i = 0; i < numPixels; i++) {
+        if(image.pixels[i * 4 + 3] != 255) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline uint16_t packColor565(const float* color) {
+    uint32_t r = (uint32_t)(std::min(std::max(color[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    uint32_t g = (uint32_t)(std::min(std::max(color[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+    uint32_t b = (uint32_t)(std::min(std::max(color[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+inline void unpackColor565(uint16_t packed, float* color) {
+    uint32_t r = (packed >> 11) & 31;
+    uint32_t g = (packed >> 5) & 63;
+    uint32_t b = packed & 31;
+    color[0] = (float)((r << 3) | (r >> 2));
+    color[1] = (float)((g << 2) | (g >> 4));
+    color[2] = (float)((b << 3) | (b >> 2));
+}
+
+// Picks the nearest of the four palette colors for every pixel. Returns the squared error.
+inline float selectBC1Indices(const float (*pixels)[3], uint16_t color0, uint16_t color1, uint32_t& indices) {
+    float palette[4][3];
+    unpackColor565(color0, palette[0]);
+    unpackColor565(color1, palette[1]);
+    for(uint32_t c = 0; c < 3; c++) {
+        palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+        palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+    }
+    float error = 0.0f;
+    indices = 0;
+    for(uint32_t i = 0; i < 16; i++) {
+        uint32_t best = 0;
+        float bestError = FLT_MAX;
+        for(uint32_t p = 0; p < 4; p++) {
+            float d[3] = {pixels[i][0] - palette[p][0], pixels[i][1] - palette[p][1], pixels[i][2] - palette[p][2]};
+            float e = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+            if(e < bestError) {
+                bestError = e;
+                best = p;
+            }
+        }
+        indices |= best << (i * 2);
+        error += bestError;
+    }
+    return error;
+}
+
+// Writes the 8 byte color block in four color mode, which BC3 requires as well
+inline void writeBC1Block(uint16_t color0, uint16_t color1, uint32_t indices, uint8_t* output) {
+    if(color0 < color1) {
+        std::swap(color0, color1);
+        // Swap the endpoints in the indices too: 0 <-> 1, 2 <-> 3
+        indices ^= 0x55555555;
+    } else if(color0 == color1) {
+        indices = 0;
+    }
+    memcpy(output, &color0, 2);
+    memcpy(output + 2, &color1, 2);
+    memcpy(output + 4, &indices, 4);
+}
+
+// pixels are the 16 RGBA pixels of a block, row by row
+inline void encodeBC1Block(const uint8_t* pixels, uint8_t* output) {
+    float colors[16][3];
+    float mean[3] = {0.0f, 0.0f, 0.0f};
+    for(uint32_t i = 0; i < 16; i++) {
+        for(uint32_t c = 0; c < 3; c++) {
+            colors[i][c] = pixels[i * 4 + c];
+            mean[c] += colors[i][c] / 16.0f;
+        }
+    }
+    float covariance[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    for(uint32_t i = 0; i < 16; i++) {
+        float d[3] = {colors[i][0] - mean[0], colors[i][1] - mean[1], colors[i][2] - mean[2]};
+        covariance[0] += d[0] * d[0];
+        covariance[1] += d[0] * d[1];
+        covariance[2] += d[0] * d[2];
+        covariance[3] += d[1] * d[1];
+        covariance[4] += d[1] * d[2];
+        covariance[5] += d[2] * d[2];
+    }
+    // Principal axis by power iteration, starting from the covariance row of the largest length.
+    // A fixed start like (1, 1, 1) is orthogonal to some variations (red against green at a
+    // constant sum), which then never show up.
+    const float rows[3][3] = {
+        {covariance[0], covariance[1], covariance[2]},
+        {covariance[1], covariance[3], covariance[4]},
+        {covariance[2], covariance[4], covariance[5]}
+    };
+    uint32_t largestRow = 0;
+    float largestLength = -1.0f;
+    for(uint32_t i = 0; i < 3; i++) {
+        float length = rows[i][0] * rows[i][0] + rows[i][1] * rows[i][1] + rows[i][2] * rows[i][2];
+        if(length > largestLength) {
+            largestLength = length;
+            largestRow = i;
+        }
+    }
+    float axis[3] = {rows[largestRow][0], rows[largestRow][1], rows[largestRow][2]};
+    for(uint32_t iteration = 0; iteration < 8; iteration++) {
+        float next[3] = {
+            covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+            covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+            covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+        };
+        float length = std::max(std::max(fabsf(next[0]), fabsf(next[1])), fabsf(next[2]));
+        if(length < 1e-6f) {
+            break;
+        }
+        axis[0] = next[0] / length;
+        axis[1] = next[1] / length;
+        axis[2] = next[2] / length;
+    }
+    float minProjection = FLT_MAX;
+    float maxProjection = -FLT_MAX;
+    uint32_t minPixel = 0;
+    uint32_t maxPixel = 0;
+    for(uint32_t i = 0; i < 16; i++) {
+        float projection = colors[i][0] * axis[0] + colors[i][1] * axis[1] + colors[i][2] * axis[2];
+        if(projection < minProjection) {
+            minProjection = projection;
+            minPixel = i;
+        }
+        if(projection > maxProjection) {
+            maxProjection = projection;
+            maxPixel = i;
+        }
+    }
+
+    uint16_t color0 = packColor565(colors[maxPixel]);
+    uint16_t color1 = packColor565(colors[minPixel]);
+    uint32_t indices;
+    float error = selectBC1Indices(colors, color0, color1, indices);
+
+    // Least squares fit of the endpoints to the chosen indices
+    const float weights[4] = {1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f};
+    float aa = 0.0f, bb = 0.0f, ab = 0.0f;
+    float ax[3] = {0.0f, 0.0f, 0.0f};
+    float bx[3] = {0.0f, 0.0f, 0.0f};
+    for(uint32_t i = 0; i < 16; i++) {
+        float a = weights[(indices >> (i * 2)) & 3];
+        float b = 1.0f - a;
+        aa += a * a;
+        bb += b * b;
+        ab += a * b;
+        for(uint32_t c = 0; c < 3; c++) {
+            ax[c] += a * colors[i][c];
+            bx[c] += b * colors[i][c];
+        }
+    }
+    float determinant = aa * bb - ab * ab;
+    if(fabsf(determinant) > 1e-6f) {
+        float endpoint0[3];
+        float endpoint1[3];
+        for(uint32_t c = 0; c < 3; c++) {
+            endpoint0[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+            endpoint1[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+        }
+        uint16_t refined0 = packColor565(endpoint0);
+        uint16_t refined1 = packColor565(endpoint1);
+        uint32_t refinedIndices;
+        float refinedError = selectBC1Indices(colors, refined0, refined1, refinedIndices);
+        if(refinedError < error) {
+            color0 = refined0;
+            color1 = refined1;
+            indices = refinedIndices;
+        }
+    }
+    writeBC1Block(color0, color1, indices, output);
+}
+
+// Single channel block of BC3 alpha and BC5. values are the 16 values of the block, stride bytes apart.
+inline void encodeBC4Block(const uint8_t* values, uint32_t stride, uint8_t* output) {
+    uint8_t minValue = 255;
+    uint8_t maxValue = 0;
+    for(uint32_t i = 0; i < 16; i++) {
+        minValue = std::min(minValue, values[i * stride]);
+        maxValue = std::max(maxValue, values[i * stride]);
+    }
+    output[0] = maxValue;
+    output[1] = minValue;
+    uint64_t indices = 0;
+    if(maxValue > minValue) {
+        // Eight value mode: index 0 is the maximum, 1 the minimum and 2 to 7 step from max to min
+        float range = (float)(maxValue - minValue);
+        for(uint32_t i = 0; i < 16; i++) {
+            uint32_t step = (uint32_t)((maxValue - values[i * stride]) * 7.0f / range + 0.5f);
+            uint64_t index = step == 0 ? 0 : (step == 7 ? 1 : step + 1);
+            indices |= index << (i * 3);
+        }
+    }
+    for(uint32_t i = 0; i < 6; i++) {
+        output[2 + i] = (uint8_t)(indices >> (i * 8));
+    }
+}
+
+inline uint32_t bcBlockSize(uint32_t format) {
+    return format == BMF_TEXTURE_BC1 ? 8 : 16;
+}
+
+// Appends the blocks of image in format (BC1, BC3 or BC5). Edge blocks repeat the last row and column.
+inline void compressImage(const TextureImage& image, uint32_t format, std::vector<uint8_t>& result) {
+    uint32_t blocksX = (image.width + 3) / 4;
+    uint32_t blocksY = (image.height + 3) / 4;
+    uint64_t offset = result.size();
+    result.resize(offset + (uint64_t)blocksX * blocksY * bcBlockSize(format));
+    uint8_t* output = result.data() + offset;
+    uint8_t block[16 * 4];
+    for(uint32_t by = 0; by < blocksY; by++) {
+        for(uint32_t bx = 0; bx < blocksX; bx++) {
+            for(uint32_t y = 0; y < 4; y++) {
+                for(uint32_t x = 0; x < 4; x++) {
+                    uint32_t px = std::min(bx * 4 + x, image.width - 1);
+                    uint32_t py = std::min(by * 4 + y, image.height - 1);
+                    memcpy(block + (y * 4 + x) * 4, &image.pixels[((uint64_t)py * image.width + px) * 4], 4);
+                }
+            }
+            if(format == BMF_TEXTURE_BC1) {
+                encodeBC1Block(block, output);
+            } else if(format == BMF_TEXTURE_BC3) {
+                encodeBC4Block(block + 3, 4, output);
+                encodeBC1Block(block, output + 8);
+            } else {
+                encodeBC4Block(block, 4, output);
+                encodeBC4Block(block + 1, 4, output + 8);
+            }
+            output += bcBlockSize(format);
+        }
+    }
+}
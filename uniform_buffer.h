@@ -0,0 +1,137 @@
+#pragma once
+#include <GL/glew.h>
+
+#include "defines.h"
+#include "gl_state.h"
+
+// Binding points of the uniform blocks. Shader binds blocks of these names to them after linking,
+// so every program reads the same buffers.
+enum UniformBinding {
+    UNIFORM_BINDING_CAMERA = 0,
+    UNIFORM_BINDING_LIGHTS = 1,
+    UNIFORM_BINDING_MATERIAL = 2,
+};
+
+// std140 layouts of the blocks in the shaders. vec3s start at 16 byte boundaries, a following float
+// or int fills the rest of the 16 bytes.
+
+// Block "Camera", updated once per frame
+struct CameraBlock {
+    glm::mat4 modelViewProj;
+    glm::mat4 modelView;
+    glm::mat4 invModelView;
+};
+
+// Light directions and positions are in view space
+struct DirectionalLightBlock {
+    glm::vec3 direction;
+    float padding0;
+    glm::vec3 diffuse;
+    float padding1;
+    glm::vec3 specular;
+    float padding2;
+    glm::vec3 ambient;
+    float padding3;
+};
+
+struct PointLightBlock {
+    glm::vec3 position;
+    float linear;
+    glm::vec3 diffuse;
+    float quadratic;
+    glm::vec3 specular;
+    float padding0;
+    glm::vec3 ambient;
+    float padding1;
+};
+
+struct SpotLightBlock {
+    glm::vec3 position;
+    float innerCone;
+    // Must be a normalized vector
+    glm::vec3 direction;
+    float outerCone;
+    glm::vec3 diffuse;
+    float padding0;
+    glm::vec3 specular;
+    float padding1;
+    glm::vec3 ambient;
+    float padding2;
+};
+
+// Block "Lights", updated once per frame
+struct LightsBlock {
+    DirectionalLightBlock directional;
+    PointLightBlock point;
+    SpotLightBlock spot;
+};
+
+// Block "Material", one per mesh. Holds the material and how the vertices of the mesh are decoded,
+// so a draw only has to bind its range of the buffer.
+struct MaterialBlock {
+    glm::vec3 diffuse;
+    float shininess;
+    glm::vec3 specular;
+    // BMFSpecularChannel
+    uint32 specularChannel;
+    glm::vec3 emissive;
+    // Normals and tangents are octahedral encoded, see BMF_MESH_QUANTIZED_VERTICES
+    uint32 octahedralNormals;
+    // Positions are decoded as positionOffset + position * positionScale
+    glm::vec3 positionOffset;
+    float padding0;
+    glm::vec3 positionScale;
+    float padding1;
+};
+
+static_assert(sizeof(CameraBlock) == 192, "CameraBlock must match the std140 layout");
+static_assert(sizeof(LightsBlock) == 208, "LightsBlock must match the std140 layout");
+static_assert(sizeof(MaterialBlock) == 80, "MaterialBlock must match the std140 layout");
+
+struct UniformBuffer {
+    UniformBuffer(uint64 size) {
+        this->size = size;
+        glGenBuffers(1, &bufferId);
+        GLState::get().bindBuffer(GL_UNIFORM_BUFFER, bufferId);
+        glBufferData(GL_UNIFORM_BUFFER, size, 0, GL_DYNAMIC_DRAW);
+    }
+
+    virtual ~UniformBuffer() {
+        GLState::get().deleteBuffer(bufferId);
+    }
+
+    void update(const void* data, uint64 offset, uint64 size) {
+        GLState::get().bindBuffer(GL_UNIFORM_BUFFER, bufferId);
+        glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+    }
+
+    // Binds the whole buffer to a UniformBinding
+    void bind(uint32 binding) {
+        GLState::get().bindBufferRange(GL_UNIFORM_BUFFER, binding, bufferId, 0, size);
+    }
+
+    // Binds a range, offset must be a multiple of getOffsetAlignment()
+    void bind(uint32 binding, uint64 offset, uint64 size) {
+        GLState::get().bindBufferRange(GL_UNIFORM_BUFFER, binding, bufferId, offset, size);
+    }
+
+    // Distance of the elements of a buffer that holds an array of blocks of the given size, so
+    // every element can be bound on its own
+    static uint64 getStride(uint64 blockSize) {
+        uint64 alignment = getOffsetAlignment();
+        return (blockSize + alignment - 1) / alignment * alignment;
+    }
+
+    // Offsets of ranges bound to a uniform binding must be multiples of this
+    static uint64 getOffsetAlignment() {
+        static GLint alignment = 0;
+        if(!alignment) {
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        }
+        return (uint64)alignment;
+    }
+
+private:
+    GLuint bufferId;
+    uint64 size;
+};
@@ -2,41 +2,85 @@
 #include <GL/glew.h>
 
 #include "defines.h"
+#include "bmf.h"
+#include "gl_state.h"
 
-struct VertexBuffer {
-    VertexBuffer(void* data, uint32 numVertices) {
-        glGenVertexArrays(1, &vao);
-        glBindVertexArray(vao);
-
-        glGenBuffers(1, &bufferId);
-        glBindBuffer(GL_ARRAY_BUFFER, bufferId);
-        glBufferData(GL_ARRAY_BUFFER, numVertices * sizeof(Vertex), data, GL_STATIC_DRAW);
-
+// Points the vertex attributes 0-4 at the bound GL_ARRAY_BUFFER, in the layout meshFlags selects
+// (see BMF_MESH_QUANTIZED_VERTICES and BMF_MESH_VERTEX_OCCLUSION). The vertex array must be bound.
+inline void setVertexAttributes(uint32 meshFlags) {
+    if(meshFlags & BMF_MESH_QUANTIZED_VERTICES) {
+        // Decoded in basic.vs
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(BMFQuantizedVertex), (void*) offsetof(struct BMFQuantizedVertex,position));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(BMFQuantizedVertex), (void*) offsetof(struct BMFQuantizedVertex,normal));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_SHORT, GL_TRUE, sizeof(BMFQuantizedVertex), (void*) offsetof(struct BMFQuantizedVertex,tangent));
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(BMFQuantizedVertex), (void*) offsetof(struct BMFQuantizedVertex,textureCoord));
+        if(meshFlags & BMF_MESH_VERTEX_OCCLUSION) {
+            glEnableVertexAttribArray(4);
+            glVertexAttribPointer(4, 1, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(BMFQuantizedVertex), (void*) (offsetof(struct BMFQuantizedVertex,position) + 3 * sizeof(uint16)));
+        }
+    } else {
+        // Vertex, followed by the ambient occlusion if the mesh has it
+        GLsizei stride = (GLsizei)bmfVertexSize(meshFlags);
         glEnableVertexAttribArray(0);
-	    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(struct Vertex,position));
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*) offsetof(struct Vertex,position));
         glEnableVertexAttribArray(1);
-	    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(struct Vertex,normal));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*) offsetof(struct Vertex,normal));
         glEnableVertexAttribArray(2);
-	    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(struct Vertex,tangent));
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (void*) offsetof(struct Vertex,tangent));
         glEnableVertexAttribArray(3);
-        glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(struct Vertex,textureCoord));
+        glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, stride, (void*) offsetof(struct Vertex,textureCoord));
+        if(meshFlags & BMF_MESH_VERTEX_OCCLUSION) {
+            glEnableVertexAttribArray(4);
+            glVertexAttribPointer(4, 1, GL_FLOAT, GL_FALSE, stride, (void*) sizeof(Vertex));
+        }
+    }
+    if(!(meshFlags & BMF_MESH_VERTEX_OCCLUSION)) {
+        // Attributes without an array read the current value, which is not part of the vertex
+        // array state but stays at 1 since nothing else sets it
+        glVertexAttrib1f(4, 1.0f);
+    }
+}
 
-        glBindVertexArray(0);
+// Per instance transforms, read by basic.vs from locations 8-11 (transform) and 12-14 (normal
+// matrix). Kept apart from the vertices, which can live in a shared vertex array.
+struct InstanceBuffer {
+    InstanceBuffer(const Instance* instances, uint32 numInstances) {
+        glGenBuffers(1, &bufferId);
+        GLState::get().bindBuffer(GL_ARRAY_BUFFER, bufferId);
+        glBufferData(GL_ARRAY_BUFFER, numInstances * sizeof(Instance), instances, GL_STATIC_DRAW);
     }
 
-    virtual ~VertexBuffer() {
-        glDeleteBuffers(1, &bufferId);
+    virtual ~InstanceBuffer() {
+        GLState::get().deleteBuffer(bufferId);
     }
 
-    void bind() {
-       glBindVertexArray(vao);
+    // Replaces the first numInstances instances
+    void update(const Instance* instances, uint32 numInstances) {
+        GLState::get().bindBuffer(GL_ARRAY_BUFFER, bufferId);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, numInstances * sizeof(Instance), instances);
     }
 
-    void unbind() {
-        glBindVertexArray(0);
+    // Points the instance attributes of the bound vertex array at firstInstance, so instanced draws
+    // start there. GL 3.3 has no base instance.
+    void bind(uint32 firstInstance) {
+        GLState::get().bindBuffer(GL_ARRAY_BUFFER, bufferId);
+        uint64 offset = (uint64)firstInstance * sizeof(Instance);
+        for(uint32 i = 0; i < 4; i++) {
+            glEnableVertexAttribArray(8 + i);
+            glVertexAttribPointer(8 + i, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*) (offset + offsetof(struct Instance,transform) + i * sizeof(glm::vec4)));
+            glVertexAttribDivisor(8 + i, 1);
+        }
+        for(uint32 i = 0; i < 3; i++) {
+            glEnableVertexAttribArray(12 + i);
+            glVertexAttribPointer(12 + i, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*) (offset + offsetof(struct Instance,normalMatrix) + i * sizeof(glm::vec3)));
+            glVertexAttribDivisor(12 + i, 1);
+        }
     }
 
 private:
     GLuint bufferId;
-    GLuint vao;
-};
\ No newline at end of file
+};